@@ -0,0 +1,73 @@
+#include "analytic.h"
+#include <cmath>
+#include <algorithm>
+
+LightBatch::LightBatch(const std::vector<std::shared_ptr<QuadLight>>& lights)
+{
+	for (auto l : lights) {
+		addPolygon({ l->va, l->vb, l->vd, l->vc }, l->c);
+	}
+}
+
+void LightBatch::addPolygon(const std::vector<Eigen::Vector3d>& vertices, Eigen::Array3d c)
+{
+	start.push_back(x.size());
+	color.push_back(c);
+	for (int k = 0; k <= (int)vertices.size(); k++) {
+		const Eigen::Vector3d& v = vertices[k % vertices.size()];
+		x.push_back(v[0]);
+		y.push_back(v[1]);
+		z.push_back(v[2]);
+		// the edge leaving the closing vertex jumps to the next light
+		edgeMask.push_back(k < (int)vertices.size() ? 1 : 0);
+	}
+}
+
+double thetaOverSin(double c)
+{
+	double a = std::abs(c);
+	// the fit is for theta / (2 pi sin(theta)) on [0, 1], negative c uses theta(-c) = pi - theta(c)
+	double v = 2 * PI * (0.8543985 + (0.4965155 + 0.0145206 * a) * a) / (3.4175940 + (4.1616724 + a) * a);
+	return c > 0 ? v : PI / std::sqrt(std::max(1 - c * c, 1e-12)) - v;
+}
+
+Eigen::Array3d LightBatch::irradiance(const Eigen::Vector3d& r, const Eigen::Vector3d& n) const
+{
+	// per-thread scratch so shading points do not allocate
+	thread_local std::vector<double> ux, uy, uz, term;
+	const int count = x.size();
+	ux.resize(count);
+	uy.resize(count);
+	uz.resize(count);
+	term.resize(count);
+
+	// unit directions to every vertex, shared by the two edges meeting there
+	for (int i = 0; i < count; i++) {
+		double dx = x[i] - r[0];
+		double dy = y[i] - r[1];
+		double dz = z[i] - r[2];
+		double inv = 1 / std::sqrt(dx * dx + dy * dy + dz * dz);
+		ux[i] = dx * inv;
+		uy[i] = dy * inv;
+		uz[i] = dz * inv;
+	}
+	// theta * gamma . n = theta / sin(theta) * (a x b) . n for unit a, b
+	for (int i = 0; i < count - 1; i++) {
+		double c = ux[i] * ux[i + 1] + uy[i] * uy[i + 1] + uz[i] * uz[i + 1];
+		double cx = uy[i] * uz[i + 1] - uz[i] * uy[i + 1];
+		double cy = uz[i] * ux[i + 1] - ux[i] * uz[i + 1];
+		double cz = ux[i] * uy[i + 1] - uy[i] * ux[i + 1];
+		term[i] = edgeMask[i] * thetaOverSin(c) * (cx * n[0] + cy * n[1] + cz * n[2]);
+	}
+
+	Eigen::Array3d total(0, 0, 0);
+	for (int l = 0; l < (int)start.size(); l++) {
+		int end = l + 1 < (int)start.size() ? start[l + 1] : count;
+		double sum = 0;
+		for (int i = start[l]; i < end - 1; i++) {
+			sum += term[i];
+		}
+		total += color[l] * sum * 0.5;
+	}
+	return total;
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <vector>
+#include "light.h"
+
+// Polygonal lights flattened into structure-of-arrays vertex loops for the
+// analytic irradiance integrator. Each light stores its n vertices followed
+// by its first vertex again, so edge i always runs from vertex i to i + 1
+// and the edge loop has no gathers. Edges bridging two lights are masked
+// out. Any vertex count works, quads are added in a, b, d, c order.
+class LightBatch {
+public:
+	std::vector<double> x, y, z;
+	// 1 for real edges, 0 for the edge from one light's loop to the next
+	std::vector<double> edgeMask;
+	// first vertex of each light and its color
+	std::vector<int> start;
+	std::vector<Eigen::Array3d> color;
+
+	LightBatch() = default;
+	LightBatch(const std::vector<std::shared_ptr<QuadLight>>& lights);
+	void addPolygon(const std::vector<Eigen::Vector3d>& vertices, Eigen::Array3d c);
+	// sum over lights of color * dot(irradiance vector, n) at point r
+	Eigen::Array3d irradiance(const Eigen::Vector3d& r, const Eigen::Vector3d& n) const;
+};
+
+// acos(c) / sqrt(1 - c^2) from a rational fit (Heitz et al. 2016), measured
+// max relative error 1.5e-6 over [-1, 1]
+double thetaOverSin(double c);
@@ -0,0 +1,214 @@
+#include "arena.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+Arena::Arena(size_t bytes) : blockBytes(bytes)
+{
+}
+
+void* Arena::allocate(size_t bytes, size_t alignment)
+{
+	// blocks too small for this request are skipped until the next rewind
+	for (; current < blocks.size(); current++, offset = 0) {
+		Block& b = blocks[current];
+		uintptr_t address = (uintptr_t)b.data.get() + offset;
+		size_t start = offset + (alignment - address % alignment) % alignment;
+		if (start + bytes <= b.size) {
+			offset = start + bytes;
+			return b.data.get() + start;
+		}
+	}
+	size_t size = std::max(blockBytes, bytes + alignment);
+	blocks.push_back(Block{ std::unique_ptr<char[]>(new char[size]), size });
+	current = blocks.size() - 1;
+	offset = 0;
+	return allocate(bytes, alignment);
+}
+
+Arena::Mark Arena::mark() const
+{
+	return Mark{ current, offset };
+}
+
+void Arena::rewind(Mark m)
+{
+	current = m.block;
+	offset = m.offset;
+}
+
+size_t Arena::capacity() const
+{
+	size_t total = 0;
+	for (const Block& b : blocks) {
+		total += b.size;
+	}
+	return total;
+}
+
+Arena& Arena::local()
+{
+	thread_local Arena arena;
+	return arena;
+}
+
+#ifdef MPT_COUNT_ALLOCATIONS
+static thread_local long long allocations = 0;
+
+void* operator new(std::size_t size)
+{
+	allocations++;
+	void* p = std::malloc(size > 0 ? size : 1);
+	if (p == nullptr) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void* operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+// the other forms are replaced too, the library versions would not count: nothrow
+// new of the containers and aligned new of over-aligned (Eigen) types
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+	allocations++;
+	return std::malloc(size > 0 ? size : 1);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t& tag) noexcept
+{
+	return operator new(size, tag);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+	std::free(p);
+}
+
+static void* alignedMalloc(std::size_t size, std::size_t alignment)
+{
+	size = size > 0 ? size : 1;
+#ifdef _WIN32
+	return _aligned_malloc(size, alignment);
+#else
+	void* p = nullptr;
+	return posix_memalign(&p, std::max(alignment, sizeof(void*)), size) == 0 ? p : nullptr;
+#endif
+}
+
+static void alignedFree(void* p)
+{
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	std::free(p);
+#endif
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	allocations++;
+	return alignedMalloc(size, (std::size_t)alignment);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t& tag) noexcept
+{
+	return operator new(size, alignment, tag);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+	void* p = operator new(size, alignment, std::nothrow);
+	if (p == nullptr) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+	return operator new(size, alignment);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept
+{
+	alignedFree(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept
+{
+	alignedFree(p);
+}
+
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept
+{
+	alignedFree(p);
+}
+
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept
+{
+	alignedFree(p);
+}
+
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	alignedFree(p);
+}
+
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	alignedFree(p);
+}
+
+bool countingAllocations()
+{
+	return true;
+}
+
+long long heapAllocations()
+{
+	return allocations;
+}
+#else
+bool countingAllocations()
+{
+	return false;
+}
+
+long long heapAllocations()
+{
+	return 0;
+}
+#endif
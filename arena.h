@@ -0,0 +1,57 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+// Bump allocator for scratch memory of the shading loop. Everything allocated
+// after a mark is released at once by rewinding to it, and the blocks are kept,
+// so a loop that rewinds every sample stops touching the heap once warmed up.
+class Arena {
+public:
+	struct Mark {
+		size_t block;
+		size_t offset;
+	};
+
+	Arena(size_t blockBytes = 64 * 1024);
+	void* allocate(size_t bytes, size_t alignment);
+	// uninitialized storage for count objects, released without running destructors
+	template<class T>
+	T* allocate(size_t count)
+	{
+		static_assert(std::is_trivially_destructible<T>::value, "arena memory is released without destructors");
+		return static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+	}
+	Mark mark() const;
+	void rewind(Mark m);
+	size_t capacity() const;
+	// the calling thread's arena
+	static Arena& local();
+
+private:
+	struct Block {
+		std::unique_ptr<char[]> data;
+		size_t size;
+	};
+	std::vector<Block> blocks;
+	size_t blockBytes;
+	size_t current = 0;
+	size_t offset = 0;
+};
+
+// releases what was allocated from the arena while the scope was open
+class ArenaScope {
+public:
+	ArenaScope(Arena& a) : arena(a), start(a.mark()) {}
+	~ArenaScope() { arena.rewind(start); }
+
+private:
+	Arena& arena;
+	Arena::Mark start;
+};
+
+// operator new calls made so far by the calling thread, all forms including nothrow
+// and aligned new, counted only in builds with MPT_COUNT_ALLOCATIONS
+bool countingAllocations();
+long long heapAllocations();
@@ -1,6 +1,13 @@
 #include "bvh.h"
+#include "counters.h"
+#include "parallel.h"
+#include "trace.h"
+#include <limits>
 
 constexpr auto LEAF_PRIM_COUNT = 4;
+constexpr int SAH_BINS = 12;
+// ranges smaller than this are not worth a task of their own
+constexpr int PARALLEL_BUILD_MIN = 4096;
 
 
 BVHnode::BVHnode(Eigen::AlignedBox3d bbox, std::shared_ptr<BVHnode> l, std::shared_ptr<BVHnode> r)
@@ -8,6 +15,9 @@ BVHnode::BVHnode(Eigen::AlignedBox3d bbox, std::shared_ptr<BVHnode> l, std::shar
 	box = bbox;
 	left = l;
 	right = r;
+	left->parent = this;
+	right->parent = this;
+	buildArea = surfaceArea(box);
 }
 
 BVHnode::BVHnode(Eigen::AlignedBox3d bbox, std::vector<std::shared_ptr<Primitive>> prims)
@@ -16,6 +26,96 @@ BVHnode::BVHnode(Eigen::AlignedBox3d bbox, std::vector<std::shared_ptr<Primitive
 	left = nullptr;
 	right = nullptr;
 	primitives = prims;
+	for (auto p : primitives) {
+		p->leaf = this;
+	}
+	buildArea = surfaceArea(box);
+}
+
+double surfaceArea(const Eigen::AlignedBox3d& bbox)
+{
+	if (bbox.isEmpty()) {
+		return 0;
+	}
+	Eigen::Vector3d d = bbox.sizes();
+	return 2 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+Eigen::AlignedBox3d BVHnode::fitBox()
+{
+	Eigen::AlignedBox3d bbox;
+	if (left == nullptr && right == nullptr) {
+		for (auto p : primitives) {
+			bbox.extend(p->bbox);
+		}
+	}
+	else {
+		bbox.extend(left->box);
+		bbox.extend(right->box);
+	}
+	return bbox;
+}
+
+void BVHnode::collect(std::vector<std::shared_ptr<Primitive>>& prims)
+{
+	if (left == nullptr && right == nullptr) {
+		prims.insert(prims.end(), primitives.begin(), primitives.end());
+		return;
+	}
+	left->collect(prims);
+	right->collect(prims);
+}
+
+void BVHnode::replace(std::shared_ptr<BVHnode> subtree)
+{
+	box = subtree->box;
+	buildArea = subtree->buildArea;
+	left = subtree->left;
+	right = subtree->right;
+	primitives = subtree->primitives;
+	if (left != nullptr) {
+		left->parent = this;
+		right->parent = this;
+	}
+	for (auto p : primitives) {
+		p->leaf = this;
+	}
+}
+
+size_t BVHnode::memoryBytes()
+{
+	// make_shared puts the node next to a control block of two counters and a vtable pointer
+	size_t bytes = sizeof(BVHnode) + 2 * sizeof(long) + sizeof(void*);
+	bytes += primitives.capacity() * sizeof(std::shared_ptr<Primitive>);
+	if (left != nullptr) {
+		bytes += left->memoryBytes() + right->memoryBytes();
+	}
+	return bytes;
+}
+
+static void accumulate(BVHnode* node, double rootArea, BVHStats& stats)
+{
+	double area = surfaceArea(node->box) / rootArea;
+	stats.nodes++;
+	if (node->left == nullptr && node->right == nullptr) {
+		stats.leaves++;
+		stats.references += node->primitives.size();
+		stats.cost += area * node->primitives.size();
+		return;
+	}
+	stats.cost += area * 2;
+	stats.overlap += surfaceArea(node->left->box.intersection(node->right->box)) / rootArea;
+	accumulate(node->left.get(), rootArea, stats);
+	accumulate(node->right.get(), rootArea, stats);
+}
+
+BVHStats treeStats(BVHnode* root)
+{
+	BVHStats stats;
+	if (root != nullptr && surfaceArea(root->box) > 0) {
+		accumulate(root, surfaceArea(root->box), stats);
+	}
+	return stats;
 }
 
 bool bbox_hit(Ray ray, Eigen::AlignedBox3d bbox) {
@@ -45,80 +145,72 @@ bool bbox_hit(Ray ray, Eigen::AlignedBox3d bbox) {
 Intersection BVHnode::intersect(Ray ray)
 {
 	if (!bbox_hit(ray, box)) {
-		return { -1 , nullptr };
+		Intersection miss;
+		miss.nodes = 1;
+		return miss;
 	}
 	if (left == nullptr && right == nullptr) {
 		double min_t = -1;
 		double temp_t = -1;
-		std::shared_ptr<Primitive> prim = nullptr;
-		for (auto p : primitives) {
-			temp_t = p->intersect(ray);
+		Primitive* prim = nullptr;
+		Eigen::Vector2d uv, temp_uv;
+		int element = 0, temp_element = 0;
+		for (const auto& p : primitives) {
+			temp_t = p->intersect(ray, &temp_uv, &temp_element);
 			if (temp_t > 0 && (min_t == -1 || temp_t < min_t)) {
 				min_t = temp_t;
-				prim = p;
+				prim = p.get();
+				uv = temp_uv;
+				element = temp_element;
 			}
 		}
-		return Intersection{ min_t, prim };
+		Intersection result;
+		result.t = min_t;
+		result.prim = prim;
+		result.nodes = 1;
+		result.tests = primitives.size();
+		result.uv = uv;
+		result.element = element;
+		return result;
 	}
 	Intersection l_intersect = left->intersect(ray);
 	Intersection r_intersect = right->intersect(ray);
+	int nodes = 1 + l_intersect.nodes + r_intersect.nodes;
+	int tests = l_intersect.tests + r_intersect.tests;
+	Intersection result;
 	if (l_intersect.t != -1 && r_intersect.t != -1) {
 		double min_t = std::min(l_intersect.t, r_intersect.t);
 		if (l_intersect.t == min_t) {
-			return l_intersect;
+			result = l_intersect;
 		}
 		else {
-			return r_intersect;
+			result = r_intersect;
 		}
 	}
 	else if (l_intersect.t == -1 && r_intersect.t == -1) {
-		return Intersection{ -1, nullptr };
+		result = Intersection();
 	}
 	else if (l_intersect.t == -1) {
-		return r_intersect;
+		result = r_intersect;
 	}
 	else {
-		return l_intersect;
+		result = l_intersect;
 	}
+	result.nodes = nodes;
+	result.tests = tests;
+	return result;
 }
 
-Axis findAxis(std::vector<std::shared_ptr<Primitive>> primitives) {
-	double min_x = 0, max_x = 0, min_y = 0, max_y = 0, min_z = 0, max_z = 0;
-	for (auto p: primitives)
-	{
-		Eigen::Vector3d c = p->bbox.center();
-		if (c[0] < min_x) {
-			min_x = c[0];
-		}
-		else if (c[0] > max_x)
-		{
-			max_x = c[0];
-		}
-
-		if (c[1] < min_y) {
-			min_y = c[1];
-		}
-		else if (c[1] > max_y)
-		{
-			max_y = c[1];
-		}
-
-		if (c[2] < min_z) {
-			min_z = c[2];
-		}
-		else if (c[2] > max_z)
-		{
-			max_z = c[2];
-		}
+Axis findAxis(std::vector<std::shared_ptr<Primitive>>& primitives, int begin, int end) {
+	Eigen::AlignedBox3d centroids;
+	for (int i = begin; i < end; i++) {
+		centroids.extend(primitives[i]->bbox.center());
 	}
-	min_x = max_x - min_x;
-	min_y = max_y - min_y;
-	min_z = max_z - min_z;
-	double max_value = std::max(std::max(min_x, min_y), min_z);
-	if (abs(min_x - max_value) < eps) {
+	Eigen::Vector3d extent = centroids.sizes();
+	if (extent[0] >= extent[1] && extent[0] >= extent[2]) {
 		return Axis::x;
 	}
-	else if (abs(min_y - max_value) < eps) {
+	else if (extent[1] >= extent[2]) {
 		return Axis::y;
 	}
 	else {
@@ -126,59 +218,168 @@ Axis findAxis(std::vector<std::shared_ptr<Primitive>> primitives) {
 	}
 }
 
-bool cmp_bbox_x(std::shared_ptr<Primitive> p1, std::shared_ptr<Primitive> p2) {
-	return p1->bbox.center()[Axis::x] < p2->bbox.center()[Axis::x];
+int medianSplit(std::vector<std::shared_ptr<Primitive>>& primitives, int begin, int end, Axis ax)
+{
+	int mid = begin + (end - begin) / 2;
+	std::nth_element(primitives.begin() + begin, primitives.begin() + mid, primitives.begin() + end,
+		[ax](const std::shared_ptr<Primitive>& p1, const std::shared_ptr<Primitive>& p2) {
+			return p1->bbox.center()[ax] < p2->bbox.center()[ax];
+		});
+	return mid;
 }
 
-bool cmp_bbox_y(std::shared_ptr<Primitive> p1, std::shared_ptr<Primitive> p2) {
-	return p1->bbox.center()[Axis::y] < p2->bbox.center()[Axis::y];
-}
+int splitInd(std::vector<std::shared_ptr<Primitive>>& primitives, int begin, int end, Axis ax)
+{
+	double cmin = std::numeric_limits<double>::infinity();
+	double cmax = -cmin;
+	for (int i = begin; i < end; i++) {
+		double c = primitives[i]->bbox.center()[ax];
+		cmin = std::min(cmin, c);
+		cmax = std::max(cmax, c);
+	}
+	if (cmax - cmin < eps) {
+		return medianSplit(primitives, begin, end, ax);
+	}
 
-bool cmp_bbox_z(std::shared_ptr<Primitive> p1, std::shared_ptr<Primitive> p2) {
-	return p1->bbox.center()[Axis::z] < p2->bbox.center()[Axis::z];
+	// bin the centroids and sweep for the cheapest boundary
+	int counts[SAH_BINS] = {};
+	Eigen::AlignedBox3d boxes[SAH_BINS];
+	double scale = SAH_BINS / (cmax - cmin);
+	auto binOf = [&](const std::shared_ptr<Primitive>& p) {
+		return std::min((int)((p->bbox.center()[ax] - cmin) * scale), SAH_BINS - 1);
+	};
+	for (int i = begin; i < end; i++) {
+		int b = binOf(primitives[i]);
+		counts[b]++;
+		boxes[b].extend(primitives[i]->bbox);
+	}
+	double rightArea[SAH_BINS];
+	int rightCount[SAH_BINS];
+	Eigen::AlignedBox3d acc;
+	int n = 0;
+	for (int b = SAH_BINS - 1; b > 0; b--) {
+		acc.extend(boxes[b]);
+		n += counts[b];
+		rightArea[b] = surfaceArea(acc);
+		rightCount[b] = n;
+	}
+	double bestCost = std::numeric_limits<double>::infinity();
+	int bestBin = -1;
+	acc.setEmpty();
+	n = 0;
+	for (int b = 0; b < SAH_BINS - 1; b++) {
+		acc.extend(boxes[b]);
+		n += counts[b];
+		double cost = surfaceArea(acc) * n + rightArea[b + 1] * rightCount[b + 1];
+		if (n > 0 && rightCount[b + 1] > 0 && cost < bestCost) {
+			bestCost = cost;
+			bestBin = b;
+		}
+	}
+	if (bestBin < 0) {
+		return medianSplit(primitives, begin, end, ax);
+	}
+	auto mid = std::partition(primitives.begin() + begin, primitives.begin() + end,
+		[&](const std::shared_ptr<Primitive>& p) { return binOf(p) <= bestBin; });
+	return mid - primitives.begin();
 }
 
-std::vector<std::shared_ptr<Primitive>> reorder(std::vector<std::shared_ptr<Primitive>> primitives, Axis ax) {
-	std::vector<std::shared_ptr<Primitive>> primitives_sorted = primitives;
-	if (ax == Axis::x) {
-		std::sort(primitives_sorted.begin(), primitives_sorted.end(), cmp_bbox_x);
+std::shared_ptr<BVHnode> buildRange(std::vector<std::shared_ptr<Primitive>>& primitives, int begin, int end, int depth)
+{
+	// ranges that may become tasks, smaller ones are built serially
+	TraceScope scope(end - begin > PARALLEL_BUILD_MIN ? "build" : nullptr, "primitives", end - begin);
+	CounterScope counting(PhaseBuild);
+	Eigen::AlignedBox3d bbox;
+	assert(bbox.isEmpty());
+
+	if (end - begin <= LEAF_PRIM_COUNT) {
+		for (int i = begin; i < end; i++) {
+			bbox.extend(primitives[i]->bbox);
+		}
+		return std::make_shared<BVHnode>(bbox, std::vector<std::shared_ptr<Primitive>>(primitives.begin() + begin, primitives.begin() + end));
 	}
-	else if (ax == Axis::y) {
-		std::sort(primitives_sorted.begin(), primitives_sorted.end(), cmp_bbox_y);
+
+	Axis ax = findAxis(primitives, begin, end);
+	int split = splitInd(primitives, begin, end, ax);
+	std::shared_ptr<BVHnode> left, right;
+	// the two halves are disjoint ranges, so a pool worker can build one while this thread builds the other
+	if (end - begin > PARALLEL_BUILD_MIN && depth > 0) {
+		parallelFor(0, 2, [&](int half) {
+			if (half == 0) {
+				left = buildRange(primitives, begin, split, depth - 1);
+			}
+			else {
+				right = buildRange(primitives, split, end, depth - 1);
+			}
+		});
 	}
 	else {
-		std::sort(primitives_sorted.begin(), primitives_sorted.end(), cmp_bbox_z);
+		left = buildRange(primitives, begin, split, depth - 1);
+		right = buildRange(primitives, split, end, depth - 1);
 	}
-	return primitives_sorted;
+	bbox.extend(left->box);
+	bbox.extend(right->box);
+	return std::make_shared<BVHnode>(bbox, left, right);
 }
 
-int splitInd(std::vector<std::shared_ptr<Primitive>> primitives)
+std::shared_ptr<BVHnode> buildTree(std::vector<std::shared_ptr<Primitive>> primitives, int threads)
 {
-// TODO: implement SAH
-	return primitives.size() * 0.5;
+	if (primitives.empty()) {
+		return nullptr;
+	}
+	// spawn tasks down to a depth that covers every allowed core
+	int workers = threads > 0 ? threads : workerCount();
+	int depth = 0;
+	while ((1 << depth) < workers) {
+		depth++;
+	}
+	return buildRange(primitives, 0, primitives.size(), depth);
 }
 
+// walks from node to the root updating boxes, stops once a box no longer changes
+void refitPath(BVHnode* node, std::vector<BVHnode*>& touched)
+{
+	while (node != nullptr) {
+		Eigen::AlignedBox3d bbox = node->fitBox();
+		if (bbox.min() == node->box.min() && bbox.max() == node->box.max()) {
+			return;
+		}
+		node->box = bbox;
+		touched.push_back(node);
+		node = node->parent;
+	}
+}
 
-std::shared_ptr<BVHnode> buildTree(std::vector<std::shared_ptr<Primitive>> primitives)
+int refitTree(std::vector<std::shared_ptr<Primitive>> moved, double rebuildRatio, int threads)
 {
-	Eigen::AlignedBox3d bbox;
-	assert(bbox.isEmpty());
+	std::vector<BVHnode*> touched;
+	for (auto p : moved) {
+		refitPath(p->leaf, touched);
+	}
 
-	if (primitives.size() <= LEAF_PRIM_COUNT) {
-		for (std::shared_ptr<Primitive> p : primitives) {
-			bbox.extend(p->bbox);
+	// pick the topmost degraded nodes, their descendants are rebuilt with them
+	std::vector<BVHnode*> degraded;
+	for (BVHnode* node : touched) {
+		if (surfaceArea(node->box) > rebuildRatio * node->buildArea) {
+			degraded.push_back(node);
+		}
+	}
+	std::vector<BVHnode*> rebuild;
+	for (BVHnode* node : degraded) {
+		bool covered = false;
+		for (BVHnode* a = node->parent; a != nullptr && !covered; a = a->parent) {
+			covered = std::find(degraded.begin(), degraded.end(), a) != degraded.end();
+		}
+		if (!covered && std::find(rebuild.begin(), rebuild.end(), node) == rebuild.end()) {
+			rebuild.push_back(node);
 		}
-		return std::make_shared<BVHnode>(bbox, primitives);
 	}
 
-	Axis ax = findAxis(primitives);
-	primitives = reorder(primitives, ax);
-	int split = splitInd(primitives);
-	std::vector<std::shared_ptr<Primitive>> priml(primitives.begin(), primitives.begin() + split);
-	std::vector<std::shared_ptr<Primitive>> primr(primitives.begin() + split, primitives.end());
-	std::shared_ptr<BVHnode> left(buildTree(priml));
-	std::shared_ptr<BVHnode> right(buildTree(primr));
-	bbox.extend(left->box);
-	bbox.extend(right->box);
-	return std::make_shared<BVHnode>(bbox, left, right);
-}
+	for (BVHnode* node : rebuild) {
+		std::vector<std::shared_ptr<Primitive>> prims;
+		node->collect(prims);
+		node->replace(buildTree(prims, threads));
+		refitPath(node->parent, touched);
+	}
+	return rebuild.size();
+}
\ No newline at end of file
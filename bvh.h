@@ -11,16 +11,53 @@ public:
 	std::shared_ptr<BVHnode> left;
 	std::shared_ptr<BVHnode> right;
 	std::vector<std::shared_ptr<Primitive>> primitives;
+	BVHnode* parent = nullptr;
+	// surface area when the node was built, refit quality reference
+	double buildArea = 0;
 
 	BVHnode(Eigen::AlignedBox3d bbox, std::shared_ptr<BVHnode> l, std::shared_ptr<BVHnode> r);
 	BVHnode(Eigen::AlignedBox3d bbox, std::vector<std::shared_ptr<Primitive>> prims);
 	Intersection intersect(Ray ray);
+	// box enclosing the children (or primitives for leaves) as they are now
+	Eigen::AlignedBox3d fitBox();
+	void collect(std::vector<std::shared_ptr<Primitive>>& prims);
+	// takes over the content of a freshly built subtree
+	void replace(std::shared_ptr<BVHnode> subtree);
+	// nodes, control blocks and leaf vectors of this subtree
+	size_t memoryBytes();
 };
 
-Axis findAxis(std::vector<std::shared_ptr<Primitive>> primitives);
+double surfaceArea(const Eigen::AlignedBox3d& bbox);
 
-std::vector<std::shared_ptr<Primitive>> reorder(std::vector<std::shared_ptr<Primitive>> primitives, Axis ax);
+// shape of a built tree, reported to compare builders
+class BVHStats {
+public:
+	int nodes = 0;
+	int leaves = 0;
+	// primitives in leaves, counting duplicates
+	int references = 0;
+	// expected box and primitive tests of a ray through the root under the surface area heuristic
+	double cost = 0;
+	// summed area shared by sibling boxes, relative to the root area
+	double overlap = 0;
+};
+
+BVHStats treeStats(BVHnode* root);
+
+// the builders below work in place on the index range [begin, end) of primitives
+
+Axis findAxis(std::vector<std::shared_ptr<Primitive>>& primitives, int begin, int end);
+
+// binned SAH split along ax, partitions the range and returns the split index
+int splitInd(std::vector<std::shared_ptr<Primitive>>& primitives, int begin, int end, Axis ax);
+
+std::shared_ptr<BVHnode> buildRange(std::vector<std::shared_ptr<Primitive>>& primitives, int begin, int end, int depth);
 
-int splitInd(std::vector<std::shared_ptr<Primitive>> primitives);
+// builds subtrees of large ranges as parallel tasks on the worker pool, using at most
+// threads workers (0 for workerCount())
+std::shared_ptr<BVHnode> buildTree(std::vector<std::shared_ptr<Primitive>> primitives, int threads = 0);
 
-std::shared_ptr<BVHnode> buildTree(std::vector<std::shared_ptr<Primitive>> primitives);
\ No newline at end of file
+// refits the tree bottom-up from the leaves of moved primitives; subtrees whose
+// surface area grew beyond rebuildRatio times their build area are rebuilt.
+// returns the number of rebuilt subtrees
+int refitTree(std::vector<std::shared_ptr<Primitive>> moved, double rebuildRatio, int threads = 0);
\ No newline at end of file
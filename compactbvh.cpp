@@ -0,0 +1,236 @@
+#include "compactbvh.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+static_assert(sizeof(CompactNode) == 64, "compact nodes should fill exactly one cache line");
+
+constexpr uint32_t LEAF_COUNT_SHIFT = 27;
+constexpr uint32_t LEAF_MAX_COUNT = 15;
+constexpr uint32_t LEAF_MAX_OFFSET = (1u << LEAF_COUNT_SHIFT) - 1;
+
+// grid cell sizes indexed by exponent + 128
+static const std::vector<double> powerOfTwo = [] {
+	std::vector<double> table(256);
+	for (int e = -128; e < 128; e++) {
+		table[e + 128] = std::ldexp(1.0, e);
+	}
+	return table;
+}();
+
+CompactBVH::CompactBVH(std::shared_ptr<BVHnode> root)
+{
+	box = root->box;
+	flatten(root.get());
+	nodes.shrink_to_fit();
+	primitives.shrink_to_fit();
+}
+
+// grid over the union of the boxes, origin rounded down to float
+static CompactNode encodeNode(const std::vector<Eigen::AlignedBox3d>& boxes)
+{
+	Eigen::AlignedBox3d bbox;
+	for (const auto& b : boxes) {
+		bbox.extend(b);
+	}
+	CompactNode n{};
+	double scale[3];
+	for (int a = 0; a < 3; a++) {
+		float origin = (float)bbox.min()[a];
+		if (origin > bbox.min()[a]) {
+			origin = std::nextafter(origin, -std::numeric_limits<float>::infinity());
+		}
+		double extent = bbox.max()[a] - origin;
+		int e = extent > 0 ? (int)std::ceil(std::log2(extent / 255)) : -100;
+		e = std::max(e, -100);
+		while (std::ldexp(255.0, e) < extent) {
+			e++;
+		}
+		n.origin[a] = origin;
+		n.exponent[a] = (int8_t)e;
+		scale[a] = std::ldexp(1.0, e);
+	}
+	for (size_t c = 0; c < 4; c++) {
+		if (c >= boxes.size()) {
+			n.child[c] = CompactBVH::EMPTY;
+			continue;
+		}
+		for (int a = 0; a < 3; a++) {
+			double lo = std::clamp(std::floor((boxes[c].min()[a] - n.origin[a]) / scale[a]), 0.0, 255.0);
+			double hi = std::clamp(std::ceil((boxes[c].max()[a] - n.origin[a]) / scale[a]), 0.0, 255.0);
+			// guard against rounding in the division
+			while (lo > 0 && n.origin[a] + lo * scale[a] > boxes[c].min()[a]) {
+				lo--;
+			}
+			while (hi < 255 && n.origin[a] + hi * scale[a] < boxes[c].max()[a]) {
+				hi++;
+			}
+			n.lo[a][c] = (uint8_t)lo;
+			n.hi[a][c] = (uint8_t)hi;
+		}
+	}
+	return n;
+}
+
+uint32_t CompactBVH::leafRef(const std::vector<std::shared_ptr<Primitive>>& prims, size_t begin, size_t end)
+{
+	if (end - begin > LEAF_MAX_COUNT) {
+		// more than the count bits hold, the leaf becomes a node over up to four smaller ones
+		uint32_t index = nodes.size();
+		nodes.emplace_back();
+		size_t part = (end - begin + 3) / 4;
+		std::vector<Eigen::AlignedBox3d> boxes;
+		for (size_t b = begin; b < end; b += part) {
+			boxes.emplace_back();
+			for (size_t i = b; i < std::min(b + part, end); i++) {
+				boxes.back().extend(prims[i]->bbox);
+			}
+		}
+		CompactNode n = encodeNode(boxes);
+		for (size_t c = 0; c < boxes.size(); c++) {
+			n.child[c] = leafRef(prims, begin + c * part, std::min(begin + (c + 1) * part, end));
+		}
+		nodes[index] = n;
+		return index;
+	}
+	if (primitives.size() > LEAF_MAX_OFFSET) {
+		throw std::length_error("compact BVH holds at most 2^27 primitive references, use the pointer layout");
+	}
+	uint32_t offset = primitives.size();
+	for (size_t i = begin; i < end; i++) {
+		primitives.push_back(prims[i].get());
+	}
+	return LEAF_BIT | ((uint32_t)(end - begin) << LEAF_COUNT_SHIFT) | offset;
+}
+
+uint32_t CompactBVH::flatten(BVHnode* node)
+{
+	// pull grandchildren up until there are four children, opening the largest first
+	std::vector<BVHnode*> children;
+	if (node->left == nullptr) {
+		children.push_back(node);
+	}
+	else {
+		children = { node->left.get(), node->right.get() };
+	}
+	while (children.size() < 4) {
+		int open = -1;
+		for (int c = 0; c < (int)children.size(); c++) {
+			if (children[c]->left != nullptr && (open < 0 || surfaceArea(children[c]->box) > surfaceArea(children[open]->box))) {
+				open = c;
+			}
+		}
+		if (open < 0) {
+			break;
+		}
+		BVHnode* opened = children[open];
+		children[open] = opened->left.get();
+		children.push_back(opened->right.get());
+	}
+
+	uint32_t index = nodes.size();
+	nodes.emplace_back();
+
+	std::vector<Eigen::AlignedBox3d> boxes;
+	for (BVHnode* c : children) {
+		boxes.push_back(c->box);
+	}
+	CompactNode n = encodeNode(boxes);
+	for (size_t c = 0; c < children.size(); c++) {
+		BVHnode* child = children[c];
+		n.child[c] = child->left == nullptr ? leafRef(child->primitives, 0, child->primitives.size()) : flatten(child);
+	}
+	nodes[index] = n;
+	return index;
+}
+
+Intersection CompactBVH::intersect(const Ray& ray) const
+{
+	// 1 / pt without normalizing, unlike ray.rpt, so entry distances compare with hit
+	// distances; eps keeps it finite as in Ray, an infinite step would turn 0 * step into NaN
+	Eigen::Vector3d inverse = (ray.pt.array() + eps).inverse();
+	// pending nodes with their entry distance, skipped once a closer hit is known
+	thread_local std::vector<std::pair<uint32_t, double>> stack;
+	stack.clear();
+	stack.emplace_back(0, 0.0);
+	Intersection result;
+	while (!stack.empty()) {
+		auto [index, entry] = stack.back();
+		stack.pop_back();
+		if (result.t != -1 && entry > result.t) {
+			continue;
+		}
+		const CompactNode& n = nodes[index];
+		result.nodes++;
+
+		// slab test against the four children, a grid step is a fixed step in t along each axis
+		double tBase[3], tStep[3];
+		for (int a = 0; a < 3; a++) {
+			tBase[a] = (n.origin[a] - ray.p0[a]) * inverse[a];
+			tStep[a] = powerOfTwo[n.exponent[a] + 128] * inverse[a];
+		}
+		double tNear[4];
+		for (int c = 0; c < 4; c++) {
+			tNear[c] = std::numeric_limits<double>::infinity();
+			if (n.child[c] == EMPTY) {
+				continue;
+			}
+			double t_min = -std::numeric_limits<double>::infinity();
+			double t_max = std::numeric_limits<double>::infinity();
+			for (int a = 0; a < 3; a++) {
+				double t1 = tBase[a] + n.lo[a][c] * tStep[a];
+				double t2 = tBase[a] + n.hi[a][c] * tStep[a];
+				t_min = std::max(t_min, std::min(t1, t2));
+				t_max = std::min(t_max, std::max(t1, t2));
+			}
+			if (t_max > 0 && t_max >= t_min && (result.t == -1 || t_min <= result.t)) {
+				tNear[c] = t_min;
+			}
+		}
+
+		// leaves are tested near to far, then interior children pushed far to near
+		int order[4] = { 0, 1, 2, 3 };
+		for (int i = 1; i < 4; i++) {
+			for (int j = i; j > 0 && tNear[order[j]] < tNear[order[j - 1]]; j--) {
+				std::swap(order[j], order[j - 1]);
+			}
+		}
+		for (int i = 0; i < 4; i++) {
+			int c = order[i];
+			uint32_t ref = n.child[c];
+			if (tNear[c] == std::numeric_limits<double>::infinity() || !(ref & LEAF_BIT)) {
+				continue;
+			}
+			if (result.t != -1 && tNear[c] > result.t) {
+				break;
+			}
+			uint32_t count = (ref & ~LEAF_BIT) >> LEAF_COUNT_SHIFT;
+			uint32_t offset = ref & LEAF_MAX_OFFSET;
+			Eigen::Vector2d uv;
+			int element = 0;
+			for (uint32_t p = offset; p < offset + count; p++) {
+				double t = primitives[p]->intersect(ray, &uv, &element);
+				result.tests++;
+				if (t > 0 && (result.t == -1 || t < result.t)) {
+					result.t = t;
+					result.prim = primitives[p];
+					result.uv = uv;
+					result.element = element;
+				}
+			}
+		}
+		for (int i = 3; i >= 0; i--) {
+			int c = order[i];
+			if (tNear[c] != std::numeric_limits<double>::infinity() && !(n.child[c] & LEAF_BIT)) {
+				stack.emplace_back(n.child[c], tNear[c]);
+			}
+		}
+	}
+	return result;
+}
+
+size_t CompactBVH::memoryBytes() const
+{
+	return nodes.capacity() * sizeof(CompactNode) + primitives.capacity() * sizeof(Primitive*);
+}
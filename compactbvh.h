@@ -0,0 +1,40 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include "bvh.h"
+
+// One cache line per node. Up to four child boxes are stored as 8-bit offsets
+// on a grid anchored at origin with a power-of-two cell size per axis, always
+// rounded outwards so the decoded box encloses the exact one. Child references
+// are packed: an interior child is a node index, a leaf has LEAF_BIT set, its
+// primitive count in bits 27-30 and its first primitive in bits 0-26.
+struct alignas(64) CompactNode {
+	float origin[3];
+	int8_t exponent[3];
+	uint8_t lo[3][4];
+	uint8_t hi[3][4];
+	uint32_t child[4];
+};
+
+// Read-only 4-wide BVH flattened from a built BVHnode tree, roughly a quarter of
+// its memory at the cost of looser boxes. Rebuilt from the pointer tree after a
+// refit, it does not support updates of its own.
+class CompactBVH {
+public:
+	static constexpr uint32_t EMPTY = 0xFFFFFFFF;
+	static constexpr uint32_t LEAF_BIT = 0x80000000;
+
+	std::vector<CompactNode> nodes;
+	// primitives in leaf order, owned by the scene
+	std::vector<Primitive*> primitives;
+	Eigen::AlignedBox3d box;
+
+	CompactBVH(std::shared_ptr<BVHnode> root);
+	Intersection intersect(const Ray& ray) const;
+	size_t memoryBytes() const;
+
+private:
+	uint32_t flatten(BVHnode* node);
+	// leaves of more than 15 primitives are split under a node of their own
+	uint32_t leafRef(const std::vector<std::shared_ptr<Primitive>>& prims, size_t begin, size_t end);
+};
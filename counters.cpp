@@ -0,0 +1,323 @@
+#include "counters.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+enum { Cycles, Instructions, CacheMisses, BranchMisses, L1DMisses, EventCount };
+const char* const EVENT_NAMES[EventCount] = { "cycles", "instructions", "cache misses", "branch misses", "L1D read misses" };
+const char* const PHASE_NAMES[PhaseCount] = { "parse", "build", "primary rays", "shadow rays", "shading", "encode" };
+// what the per item figures of a phase are per, none for parse and build
+const char* const ITEM_NAMES[PhaseCount] = { nullptr, nullptr, "ray", "ray", "sample", "image" };
+
+struct PhaseTotals {
+	// raw counts, scaled by enabled / running time when the group was multiplexed
+	uint64_t values[EventCount] = {};
+	uint64_t enabled = 0;
+	uint64_t running = 0;
+	long long items = 0;
+};
+
+struct ThreadTotals {
+	int id;
+	PhaseTotals phases[PhaseCount];
+};
+
+struct Reading {
+	uint64_t enabled = 0;
+	uint64_t running = 0;
+	uint64_t values[EventCount] = {};
+};
+
+// the counter group of a thread, closed when the thread exits
+struct ThreadCounters {
+	bool opened = false;
+	int leader = -1;
+	// opened events in the order the group reads them
+	int fds[EventCount];
+	int events[EventCount];
+	int count = 0;
+	// owned by the registry, so totals of finished threads stay until printed
+	ThreadTotals* totals = nullptr;
+	// phase being counted, PhaseCount outside any scope
+	CounterPhase phase = PhaseCount;
+	Reading last;
+
+	~ThreadCounters();
+};
+
+std::atomic<bool> enabled = false;
+std::mutex registryLock;
+std::vector<std::unique_ptr<ThreadTotals>> registry;
+// events the first group could open, the groups of other threads open the same
+bool available[EventCount] = {};
+
+#ifdef __linux__
+int openEvent(int event, int group)
+{
+	perf_event_attr attr;
+	std::memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	switch (event) {
+	case Cycles: attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+	case Instructions: attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+	case CacheMisses: attr.config = PERF_COUNT_HW_CACHE_MISSES; break;
+	case BranchMisses: attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+	default:
+		attr.type = PERF_TYPE_HW_CACHE;
+		attr.config = PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+	}
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	// user space only, which is also all an unprivileged process may count
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+Reading readGroup(const ThreadCounters& c)
+{
+	Reading r;
+	uint64_t buffer[3 + EventCount];
+	if (read(c.leader, buffer, sizeof(buffer)) < (ssize_t)(3 * sizeof(uint64_t))) {
+		return r;
+	}
+	r.enabled = buffer[1];
+	r.running = buffer[2];
+	for (int k = 0; k < c.count && k < (int)buffer[0]; k++) {
+		r.values[c.events[k]] = buffer[3 + k];
+	}
+	return r;
+}
+
+// the first group finds the available events; the leader counts cycles, without it nothing is counted
+bool openGroup(ThreadCounters& c, bool probe)
+{
+	for (int e = 0; e < EventCount; e++) {
+		if (!probe && !available[e]) {
+			continue;
+		}
+		int fd = openEvent(e, c.leader);
+		if (fd < 0) {
+			if (e == Cycles) {
+				return false;
+			}
+			continue;
+		}
+		if (e == Cycles) {
+			c.leader = fd;
+		}
+		c.fds[c.count] = fd;
+		c.events[c.count++] = e;
+		if (probe) {
+			available[e] = true;
+		}
+	}
+	std::lock_guard<std::mutex> guard(registryLock);
+	registry.push_back(std::make_unique<ThreadTotals>());
+	c.totals = registry.back().get();
+	c.totals->id = registry.size();
+	c.last = readGroup(c);
+	return true;
+}
+#endif
+
+ThreadCounters::~ThreadCounters()
+{
+#ifdef __linux__
+	for (int k = 0; k < count; k++) {
+		close(fds[k]);
+	}
+#endif
+}
+
+thread_local ThreadCounters threadCounters;
+
+// opens the group of the calling thread on first use
+ThreadCounters& localCounters()
+{
+#ifdef __linux__
+	if (!threadCounters.opened) {
+		threadCounters.opened = true;
+		openGroup(threadCounters, false);
+	}
+#endif
+	return threadCounters;
+}
+
+// adds what was counted since the last change to the phase being left
+void charge(ThreadCounters& c)
+{
+#ifdef __linux__
+	Reading now = readGroup(c);
+	if (c.phase != PhaseCount) {
+		PhaseTotals& p = c.totals->phases[c.phase];
+		p.enabled += now.enabled - c.last.enabled;
+		p.running += now.running - c.last.running;
+		for (int e = 0; e < EventCount; e++) {
+			p.values[e] += now.values[e] - c.last.values[e];
+		}
+	}
+	c.last = now;
+#endif
+}
+
+double scaled(const PhaseTotals& p, int e)
+{
+	return p.running > 0 ? (double)p.values[e] * p.enabled / p.running : 0;
+}
+
+void add(PhaseTotals& sum, const PhaseTotals& p)
+{
+	sum.enabled += p.enabled;
+	sum.running += p.running;
+	sum.items += p.items;
+	for (int e = 0; e < EventCount; e++) {
+		sum.values[e] += p.values[e];
+	}
+}
+
+// cycles and IPC of p, then per item counts when it has items
+void printTotals(std::ostream& out, const PhaseTotals& p, const char* item)
+{
+	char line[256];
+	if (p.enabled > 0 && p.running == 0) {
+		out << "group never scheduled, the PMU is taken" << std::endl;
+		return;
+	}
+	std::snprintf(line, sizeof(line), "%.1fM cycles", scaled(p, Cycles) / 1e6);
+	out << line;
+	if (available[Instructions] && p.values[Cycles] > 0) {
+		std::snprintf(line, sizeof(line), ", IPC %.2f", (double)p.values[Instructions] / p.values[Cycles]);
+		out << line;
+	}
+	if (p.running < p.enabled) {
+		std::snprintf(line, sizeof(line), ", multiplexed %.0f%%", 100.0 * p.running / p.enabled);
+		out << line;
+	}
+	if (item != nullptr && p.items > 0) {
+		out << "; " << p.items << " " << item << "s, per " << item;
+		const char* separator = " ";
+		for (int e = CacheMisses; e < EventCount; e++) {
+			if (available[e]) {
+				std::snprintf(line, sizeof(line), "%s%.2f %s", separator, scaled(p, e) / p.items, EVENT_NAMES[e]);
+				out << line;
+				separator = ", ";
+			}
+		}
+	}
+	out << std::endl;
+}
+
+}
+
+bool startCounters(std::string* reason)
+{
+#ifdef __linux__
+	// the group of the calling thread also finds the available events
+	ThreadCounters& c = threadCounters;
+	if (!c.opened) {
+		c.opened = true;
+		openGroup(c, true);
+	}
+	if (c.totals == nullptr) {
+		if (reason != nullptr) {
+			int error = errno;
+			*reason = std::string("perf_event_open: ") + std::strerror(error);
+			if (error == EACCES || error == EPERM) {
+				*reason += ", see /proc/sys/kernel/perf_event_paranoid";
+			}
+			else if (error == ENOENT || error == EOPNOTSUPP) {
+				*reason += ", no hardware counters, as in most virtual machines";
+			}
+		}
+		return false;
+	}
+	enabled = true;
+	return true;
+#else
+	if (reason != nullptr) {
+		*reason = "perf_event is only available on Linux";
+	}
+	return false;
+#endif
+}
+
+bool counting()
+{
+	return enabled.load(std::memory_order_relaxed);
+}
+
+void printCounters(std::ostream& out)
+{
+	std::lock_guard<std::mutex> guard(registryLock);
+	out << "Counters (user space):";
+	for (int e = 0; e < EventCount; e++) {
+		if (!available[e]) {
+			out << " no " << EVENT_NAMES[e] << ",";
+		}
+	}
+	out << " " << registry.size() << " threads" << std::endl;
+	for (int phase = 0; phase < PhaseCount; phase++) {
+		PhaseTotals sum;
+		for (const auto& t : registry) {
+			add(sum, t->phases[phase]);
+		}
+		if (sum.enabled > 0) {
+			out << "\t" << PHASE_NAMES[phase] << ": ";
+			printTotals(out, sum, ITEM_NAMES[phase]);
+		}
+	}
+	for (const auto& t : registry) {
+		PhaseTotals sum;
+		for (const PhaseTotals& p : t->phases) {
+			add(sum, p);
+		}
+		if (sum.enabled > 0) {
+			out << "\tthread " << t->id << ": ";
+			printTotals(out, sum, nullptr);
+		}
+	}
+}
+
+CounterScope::CounterScope(CounterPhase p, long long items) : phase(p), previous(PhaseCount), active(false)
+{
+	if (!counting()) {
+		return;
+	}
+	ThreadCounters& c = localCounters();
+	if (c.totals == nullptr) {
+		return;
+	}
+	active = true;
+	previous = c.phase;
+	c.totals->phases[phase].items += items;
+	// nested scopes of the same phase need no read
+	if (phase != previous) {
+		charge(c);
+		c.phase = phase;
+	}
+}
+
+CounterScope::~CounterScope()
+{
+	if (!active) {
+		return;
+	}
+	ThreadCounters& c = localCounters();
+	if (phase != previous) {
+		charge(c);
+		c.phase = previous;
+	}
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <ostream>
+#include <string>
+
+// render phases hardware counters are attributed to; bounce rays count as shading
+enum CounterPhase { PhaseParse, PhaseBuild, PhasePrimary, PhaseShadow, PhaseShading, PhaseEncode, PhaseCount };
+
+// Opt-in hardware performance counters through Linux perf_event_open. Every
+// thread counts cycles, instructions, cache misses, branch misses and L1 data
+// read misses of its own user space code as one group, opened on the thread's
+// first counted scope. The group is read whenever the thread changes phase and
+// the difference goes to the phase it leaves, so nested scopes are exclusive.
+// Each change costs a read() of the group, so counts are exact but wall time
+// grows with fine grained phases such as single shadow rays.
+// false, with the reason, when the counters cannot be opened; scopes then do nothing
+bool startCounters(std::string* reason = nullptr);
+bool counting();
+// per phase and per thread totals with IPC and misses per ray or sample, to be
+// called while no counted work is running
+void printCounters(std::ostream& out);
+
+class CounterScope {
+public:
+	// items are the rays or samples the scope handles, for the per item figures
+	CounterScope(CounterPhase phase, long long items = 0);
+	~CounterScope();
+
+private:
+	CounterPhase phase;
+	CounterPhase previous;
+	bool active;
+};
@@ -0,0 +1,76 @@
+#include "denoiser.h"
+#include <cmath>
+#include <algorithm>
+#include "parallel.h"
+
+static const float kernel[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+
+// one a-trous pass with taps step pixels apart, reads src and writes dst
+void atrousPass(const GBuffer& g, const std::vector<float>* src, std::vector<float>* dst, int step, const DenoiseSettings& s, float sigmaColor)
+{
+	const int w = g.width;
+	const int h = g.height;
+	const float invColor = 1.0f / (sigmaColor * sigmaColor);
+	const float invNormal = 1.0f / (s.sigmaNormal * s.sigmaNormal);
+	const float invAlbedo = 1.0f / (s.sigmaAlbedo * s.sigmaAlbedo);
+	const float invDepth = 1.0f / (s.sigmaDepth * step);
+	const float* c0 = src[0].data();
+	const float* c1 = src[1].data();
+	const float* c2 = src[2].data();
+
+	parallelFor(0, h, [&](int y) {
+		for (int x = 0; x < w; x++) {
+			int p = y * w + x;
+			float pz = g.depth[p];
+			float sum0 = 0, sum1 = 0, sum2 = 0, wsum = 0;
+			for (int j = -2; j <= 2; j++) {
+				int qy = std::clamp(y + j * step, 0, h - 1);
+				for (int i = -2; i <= 2; i++) {
+					int qx = std::clamp(x + i * step, 0, w - 1);
+					int q = qy * w + qx;
+					float dc = (c0[q] - c0[p]) * (c0[q] - c0[p]) + (c1[q] - c1[p]) * (c1[q] - c1[p]) + (c2[q] - c2[p]) * (c2[q] - c2[p]);
+					float dn = 0, da = 0;
+					for (int k = 0; k < 3; k++) {
+						float n = g.normal[k][q] - g.normal[k][p];
+						float a = g.albedo[k][q] - g.albedo[k][p];
+						dn += n * n;
+						da += a * a;
+					}
+					// background pixels (depth -1) only blend with each other
+					float dz = (pz < 0) != (g.depth[q] < 0) ? 1e9f : std::abs(g.depth[q] - pz);
+					float weight = kernel[i + 2] * kernel[j + 2]
+						* std::exp(-dc * invColor - dn * invNormal - da * invAlbedo - dz * invDepth);
+					sum0 += weight * c0[q];
+					sum1 += weight * c1[q];
+					sum2 += weight * c2[q];
+					wsum += weight;
+				}
+			}
+			dst[0][p] = sum0 / wsum;
+			dst[1][p] = sum1 / wsum;
+			dst[2][p] = sum2 / wsum;
+		}
+	}, s.threads);
+}
+
+void denoise(GBuffer& g, DenoiseSettings settings)
+{
+	std::vector<float> scratch[3];
+	for (int c = 0; c < 3; c++) {
+		scratch[c].resize(g.color[c].size());
+	}
+	std::vector<float>* src = g.color;
+	std::vector<float>* dst = scratch;
+	float sigmaColor = settings.sigmaColor;
+	for (int i = 0; i < settings.iterations; i++) {
+		atrousPass(g, src, dst, 1 << i, settings, sigmaColor);
+		std::swap(src, dst);
+		// later passes average over wider areas, be stricter about color
+		sigmaColor *= 0.5f;
+	}
+	if (src != g.color) {
+		for (int c = 0; c < 3; c++) {
+			g.color[c].swap(scratch[c]);
+		}
+	}
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include "gbuffer.h"
+
+class DenoiseSettings {
+public:
+	int iterations = 4;
+	// edge stopping widths for color, normal, depth and albedo differences
+	float sigmaColor = 1.0f;
+	float sigmaNormal = 0.3f;
+	float sigmaDepth = 0.5f;
+	float sigmaAlbedo = 0.1f;
+	// threads filtering rows, 0 for all cores
+	int threads = 0;
+};
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010): repeated 5x5
+// B3-spline passes with doubling tap spacing, where each tap is weighted by
+// its color, normal, depth and albedo difference to the center pixel.
+// Filters g.color in place, rows are processed in parallel.
+void denoise(GBuffer& g, DenoiseSettings settings);
@@ -0,0 +1,71 @@
+#include "gbuffer.h"
+#include <algorithm>
+
+void GBuffer::resize(int w, int h)
+{
+	width = w;
+	height = h;
+	for (int c = 0; c < 3; c++) {
+		color[c].assign(w * h, 0);
+		albedo[c].assign(w * h, 0);
+		normal[c].assign(w * h, 0);
+		direct[c].assign(w * h, 0);
+		reflected[c].assign(w * h, 0);
+	}
+	depth.assign(w * h, -1);
+	primId.assign(w * h, -1);
+	matId.assign(w * h, -1);
+}
+
+GBuffer GBuffer::crop(int x, int y, int w, int h) const
+{
+	GBuffer g;
+	g.resize(w, h);
+	auto copy = [&](const std::vector<float>& from, std::vector<float>& to) {
+		for (int row = 0; row < h; row++) {
+			std::copy_n(from.begin() + (y + row) * width + x, w, to.begin() + row * w);
+		}
+	};
+	for (int c = 0; c < 3; c++) {
+		copy(color[c], g.color[c]);
+		copy(albedo[c], g.albedo[c]);
+		copy(normal[c], g.normal[c]);
+		copy(direct[c], g.direct[c]);
+		copy(reflected[c], g.reflected[c]);
+	}
+	copy(depth, g.depth);
+	copy(primId, g.primId);
+	copy(matId, g.matId);
+	return g;
+}
+
+void GBuffer::setColor(int pixel, const Eigen::Vector3d& c)
+{
+	for (int k = 0; k < 3; k++) {
+		// radiance is never negative, keep integrator round-off out of the filter
+		color[k][pixel] = std::max(c[k], 0.0);
+	}
+}
+
+void GBuffer::setFeatures(int pixel, const Eigen::Array3d& a, const Eigen::Vector3d& n, double t)
+{
+	for (int k = 0; k < 3; k++) {
+		albedo[k][pixel] = a[k];
+		normal[k][pixel] = n[k];
+	}
+	depth[pixel] = t;
+}
+
+void GBuffer::setIds(int pixel, int prim, int mat)
+{
+	primId[pixel] = prim;
+	matId[pixel] = mat;
+}
+
+void GBuffer::setContributions(int pixel, const Eigen::Vector3d& d, const Eigen::Vector3d& r)
+{
+	for (int k = 0; k < 3; k++) {
+		direct[k][pixel] = d[k];
+		reflected[k][pixel] = r[k];
+	}
+}
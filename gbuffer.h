@@ -0,0 +1,33 @@
+#pragma once
+#include <vector>
+#include <Eigen/Core>
+
+// Per-pixel buffers gathered from the camera pass, stored as planar floats
+// so filters can stream over one channel at a time.
+class GBuffer {
+public:
+	int width = 0;
+	int height = 0;
+	// linear radiance before clamping, canvas (BGR) channel order
+	std::vector<float> color[3];
+	// first-hit diffuse albedo
+	std::vector<float> albedo[3];
+	// first-hit shading normal, zero where nothing was hit
+	std::vector<float> normal[3];
+	// camera ray hit distance, -1 where nothing was hit
+	std::vector<float> depth;
+	// primitive and material index of the first hit, -1 where nothing was hit
+	std::vector<float> primId;
+	std::vector<float> matId;
+	// raytracer contribution of the first hit itself and of its reflections
+	std::vector<float> direct[3];
+	std::vector<float> reflected[3];
+
+	void resize(int w, int h);
+	// copy of the w by h rectangle at x, y
+	GBuffer crop(int x, int y, int w, int h) const;
+	void setColor(int pixel, const Eigen::Vector3d& c);
+	void setFeatures(int pixel, const Eigen::Array3d& a, const Eigen::Vector3d& n, double t);
+	void setIds(int pixel, int prim, int mat);
+	void setContributions(int pixel, const Eigen::Vector3d& d, const Eigen::Vector3d& r);
+};
@@ -0,0 +1,186 @@
+#include "irradiancecache.h"
+#include <fstream>
+#include <cstdint>
+#include <mutex>
+#include <cmath>
+
+constexpr int OCTREE_MAX_DEPTH = 16;
+// "MPTIRRAD", then the format version
+constexpr uint64_t CACHE_MAGIC = 0x444152524954504Dull;
+constexpr uint32_t CACHE_VERSION = 1;
+
+struct CacheHeader {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t recordBytes;
+	uint64_t count;
+	uint64_t fingerprint;
+};
+
+Eigen::AlignedBox3d childBox(const Eigen::AlignedBox3d& box, int child)
+{
+	Eigen::Vector3d c = box.center();
+	Eigen::Vector3d lo, hi;
+	for (int k = 0; k < 3; k++) {
+		bool upper = child & (1 << k);
+		lo[k] = upper ? c[k] : box.min()[k];
+		hi[k] = upper ? box.max()[k] : c[k];
+	}
+	return Eigen::AlignedBox3d(lo, hi);
+}
+
+IrradianceCache::IrradianceCache(Eigen::AlignedBox3d sceneBounds, double error)
+{
+	// a cube around the scene so octree cells stay cubic
+	Eigen::Vector3d c = sceneBounds.center();
+	double half = sceneBounds.sizes().maxCoeff() * 0.5 + 1e-3;
+	bounds = Eigen::AlignedBox3d(c.array() - half, c.array() + half);
+	a = error;
+}
+
+void IrradianceCache::insert(Node& node, const Eigen::AlignedBox3d& nodeBox, const Eigen::AlignedBox3d& extent, int index, int depth)
+{
+	// stop at the first cell no larger than the record's area of influence
+	if (depth == OCTREE_MAX_DEPTH || nodeBox.sizes().squaredNorm() < extent.sizes().squaredNorm()) {
+		node.records.push_back(index);
+		return;
+	}
+	for (int child = 0; child < 8; child++) {
+		Eigen::AlignedBox3d box = childBox(nodeBox, child);
+		if (!box.intersects(extent)) {
+			continue;
+		}
+		if (node.children[child] == nullptr) {
+			node.children[child] = std::make_unique<Node>();
+		}
+		insert(*node.children[child], box, extent, index, depth + 1);
+	}
+}
+
+void IrradianceCache::add(IrradianceRecord record)
+{
+	std::unique_lock<std::shared_mutex> guard(lock);
+	records.push_back(record);
+	double r = a * record.R;
+	Eigen::AlignedBox3d extent(record.p.array() - r, record.p.array() + r);
+	insert(root, bounds, extent, records.size() - 1, 0);
+}
+
+bool IrradianceCache::lookup(const Eigen::Vector3d& p, const Eigen::Vector3d& n, Eigen::Array3d& E)
+{
+	std::shared_lock<std::shared_mutex> guard(lock);
+	if (!bounds.contains(p)) {
+		return false;
+	}
+	Eigen::Array3d sum(0, 0, 0);
+	double wsum = 0;
+	const Node* node = &root;
+	Eigen::AlignedBox3d box = bounds;
+	while (node != nullptr) {
+		for (int index : node->records) {
+			const IrradianceRecord& r = records[index];
+			Eigen::Vector3d d = p - r.p;
+			// skip records in front of p, they see occluders p does not
+			if (d.dot(n + r.n) * 0.5 < -0.05 * r.R) {
+				continue;
+			}
+			double cosine = std::min(n.dot(r.n), 1.0);
+			double w = 1 / (d.norm() / r.R + std::sqrt(1 - cosine) + 1e-9);
+			if (w <= 1 / a) {
+				continue;
+			}
+			Eigen::Vector3d axis = r.n.cross(n);
+			sum += w * (r.E + (r.gradR * axis).array() + (r.gradT * d).array());
+			wsum += w;
+		}
+		// descend into the child cell holding p
+		Eigen::Vector3d c = box.center();
+		int child = (p[0] > c[0] ? 1 : 0) | (p[1] > c[1] ? 2 : 0) | (p[2] > c[2] ? 4 : 0);
+		box = childBox(box, child);
+		node = node->children[child].get();
+	}
+	if (wsum <= 0) {
+		return false;
+	}
+	E = (sum / wsum).max(0);
+	return true;
+}
+
+void IrradianceCache::take(IrradianceCache& staged)
+{
+	std::vector<IrradianceRecord> moved;
+	{
+		std::unique_lock<std::shared_mutex> guard(staged.lock);
+		moved.swap(staged.records);
+		staged.root = Node();
+	}
+	for (const IrradianceRecord& record : moved) {
+		add(record);
+	}
+}
+
+void IrradianceCache::clear()
+{
+	std::unique_lock<std::shared_mutex> guard(lock);
+	records.clear();
+	root = Node();
+}
+
+int IrradianceCache::size()
+{
+	std::shared_lock<std::shared_mutex> guard(lock);
+	return records.size();
+}
+
+bool IrradianceCache::save(std::string filename, uint64_t fingerprint)
+{
+	std::shared_lock<std::shared_mutex> guard(lock);
+	std::ofstream file(filename, std::ios::binary);
+	if (!file.is_open()) {
+		return false;
+	}
+	CacheHeader header{ CACHE_MAGIC, CACHE_VERSION, sizeof(IrradianceRecord), records.size(), fingerprint };
+	file.write((const char*)&header, sizeof(header));
+	file.write((const char*)records.data(), sizeof(IrradianceRecord) * records.size());
+	return file.good();
+}
+
+bool IrradianceCache::load(std::string filename, uint64_t fingerprint, std::string* reason)
+{
+	std::ifstream file(filename, std::ios::binary | std::ios::ate);
+	if (!file.is_open()) {
+		return false;
+	}
+	auto fail = [&](const std::string& why) {
+		if (reason != nullptr) {
+			*reason = why;
+		}
+		return false;
+	};
+	uint64_t bytes = file.tellg();
+	file.seekg(0);
+	CacheHeader header{};
+	file.read((char*)&header, sizeof(header));
+	if (!file.good() || header.magic != CACHE_MAGIC) {
+		return fail("not an irradiance cache");
+	}
+	if (header.version != CACHE_VERSION || header.recordBytes != sizeof(IrradianceRecord)) {
+		return fail("written by another version");
+	}
+	// the count is checked against the file before anything is allocated
+	if (header.count != (bytes - sizeof(header)) / sizeof(IrradianceRecord) || (bytes - sizeof(header)) % sizeof(IrradianceRecord) != 0) {
+		return fail("truncated or corrupt");
+	}
+	if (header.fingerprint != fingerprint) {
+		return fail("saved for another scene");
+	}
+	std::vector<IrradianceRecord> loaded(header.count);
+	file.read((char*)loaded.data(), sizeof(IrradianceRecord) * loaded.size());
+	if (!file.good()) {
+		return fail("truncated or corrupt");
+	}
+	for (IrradianceRecord& r : loaded) {
+		add(r);
+	}
+	return true;
+}
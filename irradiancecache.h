@@ -0,0 +1,55 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <string>
+#include <shared_mutex>
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+class IrradianceRecord {
+public:
+	Eigen::Vector3d p;
+	Eigen::Vector3d n;
+	// irradiance per color channel
+	Eigen::Array3d E;
+	// harmonic mean distance to the surfaces seen from p
+	double R = 0;
+	// rows are color channels: translational and rotational gradients
+	Eigen::Matrix3d gradT = Eigen::Matrix3d::Zero();
+	Eigen::Matrix3d gradR = Eigen::Matrix3d::Zero();
+};
+
+// Ward-style irradiance cache: records live in an octree at the level
+// matching their radius of validity a * R, lookups interpolate every record
+// whose weight 1 / (|x - xi| / Ri + sqrt(1 - n.ni)) exceeds 1 / a, using the
+// record gradients. Safe for concurrent lookups and inserts.
+class IrradianceCache {
+public:
+	// a: maximum allowed error, larger values reuse records further away
+	IrradianceCache(Eigen::AlignedBox3d bounds, double a);
+	// true and the interpolated irradiance if enough records cover (p, n)
+	bool lookup(const Eigen::Vector3d& p, const Eigen::Vector3d& n, Eigen::Array3d& E);
+	void add(IrradianceRecord record);
+	// adds the records of staged in the order they were made and clears it
+	void take(IrradianceCache& staged);
+	void clear();
+	int size();
+	// files start with a header of format version, record size, record count and the
+	// scene fingerprint; load() rejects files of another build or scene, with the reason
+	// unless the file does not exist
+	bool save(std::string filename, uint64_t fingerprint);
+	bool load(std::string filename, uint64_t fingerprint, std::string* reason = nullptr);
+	double a;
+
+private:
+	struct Node {
+		std::vector<int> records;
+		std::unique_ptr<Node> children[8];
+	};
+	Eigen::AlignedBox3d bounds;
+	Node root;
+	std::vector<IrradianceRecord> records;
+	std::shared_mutex lock;
+	void insert(Node& node, const Eigen::AlignedBox3d& nodeBox, const Eigen::AlignedBox3d& extent, int index, int depth);
+};
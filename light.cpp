@@ -84,21 +84,29 @@ Eigen::Vector3d QuadLight::barycentric(Eigen::Vector3d point, int partition) {
 	return Eigen::Vector3d(u, v, w);
 }
 
-std::vector<Eigen::Vector3d> QuadLight::samples(int count, bool stratify, std::default_random_engine random)
+int QuadLight::sampleCount(int count, bool stratify) const
+{
+	if (!stratify) {
+		// the corners come first
+		return std::max(count, 4);
+	}
+	int side = (int)std::sqrt(count);
+	return side * side;
+}
+
+void QuadLight::samples(int count, bool stratify, std::mt19937& random, Eigen::Vector3d* out)
 {
 	std::uniform_real_distribution<double> dis(0, 1.0);
-	std::vector<Eigen::Vector3d> lightSamples;
 	double r1, r2;
 	if (!stratify) {
-		lightSamples.push_back(va);
-		lightSamples.push_back(vb);
-		lightSamples.push_back(vc);
-		lightSamples.push_back(vd);
+		*out++ = va;
+		*out++ = vb;
+		*out++ = vc;
+		*out++ = vd;
 		for (int i = 0; i < count - 4; i++) {
 			r1 = dis(random);
 			r2 = dis(random);
-			Eigen::Vector3d sample = va + e1 * r1 + e2 * r2;
-			lightSamples.push_back(sample);
+			*out++ = va + e1 * r1 + e2 * r2;
 		}
 	}
 	else {
@@ -107,10 +115,8 @@ std::vector<Eigen::Vector3d> QuadLight::samples(int count, bool stratify, std::d
 			for (int j = 0; j < count; j++) {
 				r1 = dis(random);
 				r2 = dis(random);
-				Eigen::Vector3d sample = va + (j + r1) / count * e1 + (i + r2) / count * e2;
-				lightSamples.push_back(sample);
+				*out++ = va + (j + r1) / count * e1 + (i + r2) / count * e2;
 			}
 		}
 	}
-	return lightSamples;
 }
\ No newline at end of file
@@ -32,5 +32,8 @@ public:
 	QuadLight(Eigen::Vector3d origin, Eigen::Vector3d edge1, Eigen::Vector3d edge2, Eigen::Array3d color);
 	double intersect(Ray ray);
 	Eigen::Vector3d barycentric(Eigen::Vector3d point, int partition);
-	std::vector<Eigen::Vector3d> samples(int count, bool stratify, std::default_random_engine random);
+	// number of points samples() writes for a requested count
+	int sampleCount(int count, bool stratify) const;
+	// writes sampleCount(count, stratify) points on the light to out
+	void samples(int count, bool stratify, std::mt19937& random, Eigen::Vector3d* out);
 };
\ No newline at end of file
@@ -0,0 +1,82 @@
+#include "lighttree.h"
+#include <algorithm>
+#include <limits>
+
+LightTree::LightTree(const std::vector<std::shared_ptr<Light>>& lights, const std::vector<double>& a) : attenuation(a)
+{
+	std::vector<const Light*> points, directions;
+	for (const auto& l : lights) {
+		(l->kind == "point" ? points : directions).push_back(l.get());
+	}
+	// fixed seed, the same scene always gets the same representatives
+	std::mt19937 random(0x4C43);
+	clusters.reserve(2 * lights.size());
+	if (!points.empty()) {
+		roots[0] = build(points, 0, points.size(), random);
+	}
+	if (!directions.empty()) {
+		roots[1] = build(directions, 0, directions.size(), random);
+	}
+}
+
+int LightTree::build(std::vector<const Light*>& lights, int begin, int end, std::mt19937& random)
+{
+	LightCluster c;
+	for (int i = begin; i < end; i++) {
+		c.box.extend(lights[i]->v0);
+		c.intensity += lights[i]->c;
+	}
+	if (end - begin == 1) {
+		c.representative = lights[begin];
+		clusters.push_back(c);
+		return clusters.size() - 1;
+	}
+	int axis;
+	c.box.diagonal().maxCoeff(&axis);
+	int mid = (begin + end) / 2;
+	std::nth_element(lights.begin() + begin, lights.begin() + mid, lights.begin() + end,
+		[axis](const Light* a, const Light* b) { return a->v0[axis] < b->v0[axis]; });
+	c.left = build(lights, begin, mid, random);
+	c.right = build(lights, mid, end, random);
+	const LightCluster& l = clusters[c.left];
+	const LightCluster& r = clusters[c.right];
+	double total = l.intensity.sum() + r.intensity.sum();
+	std::uniform_real_distribution<double> dis(0, total);
+	c.representative = total > 0 && dis(random) >= l.intensity.sum() ? r.representative : l.representative;
+	clusters.push_back(c);
+	return clusters.size() - 1;
+}
+
+double LightTree::errorBound(const LightCluster& c, const Intersection& hit) const
+{
+	if (c.left < 0) {
+		return 0;
+	}
+	const Eigen::Vector3d& n = hit.normal;
+	double cosine;
+	double geometric = 1;
+	if (c.representative->kind == "point") {
+		// largest n . (p - x) over the box, over the smallest distance to it
+		double reach = 0;
+		for (int a = 0; a < 3; a++) {
+			reach += n[a] * ((n[a] > 0 ? c.box.max()[a] : c.box.min()[a]) - hit.point[a]);
+		}
+		double r = c.box.exteriorDistance(hit.point);
+		cosine = reach <= 0 ? 0 : r > 0 ? std::min(reach / r, 1.0) : 1;
+		double falloff = attenuation[0] + r * attenuation[1] + r * r * attenuation[2];
+		geometric = falloff > 0 ? 1 / falloff : std::numeric_limits<double>::infinity();
+	}
+	else {
+		// the directions are unit vectors inside the box, so n . d is at most its
+		// largest value over the box; box corners can be longer than a unit vector,
+		// and a cosine is never above one
+		cosine = 0;
+		for (int a = 0; a < 3; a++) {
+			cosine += std::max(n[a] * c.box.min()[a], n[a] * c.box.max()[a]);
+		}
+		cosine = std::clamp(cosine, 0.0, 1.0);
+	}
+	// the highlight is at most the specular color, wherever the lights are
+	double material = hit.mat->diffuse.sum() / 3 * cosine + hit.mat->specualr.sum() / 3;
+	return material * geometric * c.intensity.sum() / 3;
+}
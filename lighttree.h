@@ -0,0 +1,46 @@
+#pragma once
+#include <random>
+#include <vector>
+#include "light.h"
+
+// A cluster of point or directional lights, lit as if all their color came
+// from one representative member
+class LightCluster {
+public:
+	// positions of point lights, or directions of directional lights
+	Eigen::AlignedBox3d box;
+	Eigen::Array3d intensity = Eigen::Array3d(0, 0, 0);
+	const Light* representative = nullptr;
+	// children, -1 for single lights
+	int left = -1;
+	int right = -1;
+};
+
+// a cluster of a cut with its unshadowed estimate and error bound
+class CutLight {
+public:
+	int cluster;
+	const Light* light;
+	Eigen::Array3d contribution;
+	double bound;
+};
+
+// Light tree of Walter et al., "Lightcuts" (2005), over the point and the
+// directional lights, one subtree each. Clusters are split at the median of
+// their longest axis; representatives are picked at build time with
+// probability proportional to brightness, so a cluster's estimate is unbiased.
+class LightTree {
+public:
+	std::vector<LightCluster> clusters;
+	// point and directional subtrees, -1 when there are no such lights
+	int roots[2] = { -1, -1 };
+
+	LightTree() = default;
+	LightTree(const std::vector<std::shared_ptr<Light>>& lights, const std::vector<double>& attenuation);
+	// upper bound of the unshadowed light the cluster sends to a hit, 0 for single lights
+	double errorBound(const LightCluster& cluster, const Intersection& hit) const;
+
+private:
+	std::vector<double> attenuation;
+	int build(std::vector<const Light*>& lights, int begin, int end, std::mt19937& random);
+};
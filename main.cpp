@@ -1,62 +1,348 @@
 ﻿#include <limits>
 #include <chrono>
+#include <cstring>
 // External libraries
 #include <FreeImage.h>
 // Project components
 #include "scene.h"
 #include "pathtracer.h"
-
-#define SEED time(NULL)
+#include "sequence.h"
+#include "writer.h"
+#include "server.h"
+#include "counters.h"
+#include "trace.h"
 
 using namespace std;
 
+// durations accept an optional unit: 90, 90s, 1.5m, 2h
+double parseSeconds(const string& s)
+{
+	size_t end = 0;
+	double value = stod(s, &end);
+	string unit = s.substr(end);
+	if (unit == "m" || unit == "min") {
+		return value * 60;
+	}
+	if (unit == "h") {
+		return value * 3600;
+	}
+	return value;
+}
+
+// queues a rendered frame and its heatmap, if any, for saving
+void saveFrame(PathTracer& pathtracer, FrameWriter& writer, unsigned char* canvas, string outname, double seconds)
+{
+	int width = pathtracer.scene.width;
+	int height = pathtracer.scene.height;
+	cout << "\nRendered " << outname << " in " << seconds << "s" << endl;
+	writer.push(canvas, width, height, outname);
+	auto heatmap = pathtracer.heatmapCanvas();
+	if (heatmap != nullptr) {
+		writer.push(heatmap, width, height, suffixName(outname, "heatmap"));
+	}
+	// AOVs are float layers saved as output_<layer>.exr, color layers go from canvas (BGR) to RGB order
+	GBuffer& g = pathtracer.gbuffer;
+	string exrname = outname.substr(0, outname.find_last_of('.')) + ".exr";
+	for (string aov : pathtracer.scene.aovs) {
+		vector<const float*> channels;
+		if (aov == "depth") {
+			channels = { g.depth.data() };
+		}
+		else if (aov == "normal") {
+			channels = { g.normal[0].data(), g.normal[1].data(), g.normal[2].data() };
+		}
+		else if (aov == "albedo") {
+			channels = { g.albedo[2].data(), g.albedo[1].data(), g.albedo[0].data() };
+		}
+		else if (aov == "primid") {
+			channels = { g.primId.data() };
+		}
+		else if (aov == "matid") {
+			channels = { g.matId.data() };
+		}
+		else if (aov == "direct") {
+			channels = { g.direct[2].data(), g.direct[1].data(), g.direct[0].data() };
+		}
+		else if (aov == "reflected") {
+			channels = { g.reflected[2].data(), g.reflected[1].data(), g.reflected[0].data() };
+		}
+		else {
+			cerr << "Unknown AOV " << aov << endl;
+			continue;
+		}
+		string aovname = suffixName(exrname, aov);
+		if (saveFloatImage(channels, width, height, aovname)) {
+			cout << "AOV " << aov << " generated at " << aovname << endl;
+		}
+	}
+}
+
 int main(int argc, char** argv)
 {
-	cout << "Simple Path Tracer v0.1\nBy Yijian Liu" << endl;
-	if (argc != 2) {
-		cerr << "\nOne argument needed for scene description." << endl;
+	// options may appear anywhere, the remaining arguments are the scene and an optional sequence file
+	vector<string> files;
+	ProgressiveSettings progressive;
+	bool progressiveMode = false;
+	int threads = 0;
+	// time based unless given, renders are reproducible for a fixed seed
+	unsigned seed = (unsigned)time(NULL);
+	// server mode keeps scenes loaded between jobs read from stdin or a socket
+	bool serverMode = false;
+	string socketPath;
+	double cacheMegabytes = 1024;
+	// Chrome trace-event timeline of the run, off unless a path is given
+	string tracePath;
+	// hardware counters per phase and thread, reported with the render statistics
+	bool counters = false;
+	for (int i = 1; i < argc; i++) {
+		bool hasValue = i + 1 < argc;
+		if (!strcmp(argv[i], "--time-limit") && hasValue) {
+			progressive.timeLimit = parseSeconds(argv[++i]);
+			progressiveMode = true;
+		}
+		else if (!strcmp(argv[i], "--target-noise") && hasValue) {
+			progressive.targetNoise = stod(argv[++i]);
+			progressiveMode = true;
+		}
+		else if (!strcmp(argv[i], "--snapshot-interval") && hasValue) {
+			progressive.snapshotInterval = parseSeconds(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--passes") && hasValue) {
+			progressive.maxPasses = stoi(argv[++i]);
+			progressiveMode = true;
+		}
+		else if (!strcmp(argv[i], "--threads") && hasValue) {
+			threads = stoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--seed") && hasValue) {
+			seed = (unsigned)stoul(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--server")) {
+			serverMode = true;
+		}
+		else if (!strcmp(argv[i], "--socket") && hasValue) {
+			socketPath = argv[++i];
+			serverMode = true;
+		}
+		else if (!strcmp(argv[i], "--cache-mb") && hasValue) {
+			cacheMegabytes = stod(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--trace") && hasValue) {
+			tracePath = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--counters")) {
+			counters = true;
+		}
+		else {
+			files.push_back(argv[i]);
+		}
+	}
+	// snapshots are taken between passes of a progressive render only
+	if (progressive.snapshotInterval > 0 && !progressiveMode) {
+		cerr << "--snapshot-interval needs --time-limit, --target-noise or --passes" << endl;
+		return 1;
+	}
+	if (!tracePath.empty()) {
+		traceThreadName("main");
+		startTrace();
+	}
+	// stdout carries the replies when serving stdin
+	(serverMode && socketPath.empty() ? cerr : cout) << "Simple Path Tracer v0.1\nBy Yijian Liu" << endl;
+	if (serverMode) {
+		FreeImage_Initialise();
+		RenderServer server((size_t)(cacheMegabytes * 1024 * 1024), threads);
+		bool served = true;
+		if (socketPath.empty()) {
+			server.serveStdin();
+		}
+		else {
+			served = server.serveSocket(socketPath);
+		}
+		FreeImage_DeInitialise();
+		if (!tracePath.empty() && writeTrace(tracePath)) {
+			cerr << "Trace written to " << tracePath << endl;
+		}
+		return served ? 0 : 1;
+	}
+	if (files.size() != 1 && files.size() != 2) {
+		cerr << "\nOne argument needed for scene description, optionally followed by a sequence file." << endl;
+		cerr << "Options: --time-limit <t> --target-noise <x> --passes <n> --snapshot-interval <t> --threads <n> --seed <n> --trace <json> --counters" << endl;
+		cerr << "Server: --server (stdin) or --socket <path>, --cache-mb <n>" << endl;
 		return 0;
 	}
-	ifstream scenefile(argv[1], ios::in);
+	ifstream scenefile(files[0], ios::in);
 	if (!scenefile.is_open()) {
 		cerr << "\nCannot open scene description file." << endl;
 	} else {
-		cout << "\nParsing " << argv[1] << endl; 
+		cout << "\nParsing " << files[0] << endl; 
 	}
-	//TODO: add subfolder support
-	string outprefix("out\\");
-
 	// parsing scene description
-	Scene scene(scenefile);
+	string countersUnavailable;
+	if (counters && !startCounters(&countersUnavailable)) {
+		cout << "\tCounters unavailable (" << countersUnavailable << ")" << endl;
+	}
+	Scene scene = [&] {
+		TraceScope parsing("parse");
+		CounterScope counting(PhaseParse);
+		return Scene(scenefile, threads);
+	}();
 	cout << "\tOutput: " << scene.outname << " (" << scene.width << "x" << scene.height << ")" << endl;
 	cout << "\t" << scene.primitives.size() << " Primitives" << endl;
 	cout << "\t" << scene.simpleLights.size() + scene.polyLights.size() << " Lights" << endl;
 	cout << "\tMax recursion depth: " << scene.maxdepth << endl;
+	if (!scene.primitives.empty()) {
+		cout << "\tBVH: " << scene.bvhFormat << ", " << (double)scene.treeBytes() / scene.primitives.size() << " bytes/primitive";
+		if (scene.compactTree != nullptr) {
+			cout << " (pointer layout " << (double)scene.pointerTreeBytes / scene.primitives.size() << ")";
+		}
+		cout << endl;
+		cout << "\tGeometry: " << scene.geometry << ", " << (double)scene.primitiveBytes() / scene.primitives.size() << " bytes/primitive";
+		if (scene.paged != nullptr) {
+			cout << " (" << scene.paged->triangles << " triangles in " << scene.paged->chunkCount() << " chunks, "
+				<< scene.paged->fileBytes() / 1048576.0 << " MB at " << scene.paged->path << ")";
+		}
+		if (!scene.meshGrids.empty()) {
+			double finest = std::numeric_limits<double>::infinity(), coarsest = 0;
+			for (const auto& grid : scene.meshGrids) {
+				finest = std::min(finest, grid->step.maxCoeff());
+				coarsest = std::max(coarsest, grid->step.maxCoeff());
+			}
+			cout << " (" << scene.meshGrids.size() << (scene.meshGrids.size() == 1 ? " mesh" : " meshes") << ", grid step " << finest << " to " << coarsest << ")";
+		}
+		cout << endl;
+		if (scene.bvhBuilder == "sbvh") {
+			cout << "\tSBVH: " << scene.bvhStats.references << " references (+"
+				<< 100.0 * (scene.bvhStats.references - (int)scene.primitives.size()) / scene.primitives.size() << "%), SAH cost "
+				<< scene.bvhStats.cost << " (sah " << scene.sahStats.cost << "), overlap "
+				<< scene.bvhStats.overlap << " (sah " << scene.sahStats.overlap << ")" << endl;
+		}
+	}
 	cout << "\tIntegrator: " << scene.integrator << endl;
-	cout << "\tRandom seed: " << SEED << endl;
-	int width = scene.width;
-	int height = scene.height;
+	if (scene.engine != "recursive") {
+		cout << "\tEngine: " << scene.engine << endl;
+	}
+	if (scene.primary == "raster") {
+		bool rasterized = scene.engine == "recursive" && Rasterizer::supports(scene);
+		cout << "\tPrimary visibility: " << (rasterized ? "raster" : "traced, raster needs the recursive engine and unpaged triangles or spheres") << endl;
+	}
+	if (!scene.heatmap.empty()) {
+		cout << "\tHeatmap: " << scene.heatmap << endl;
+	}
+	if (scene.denoise > 0) {
+		cout << "\tDenoiser: " << scene.denoise << " iterations" << endl;
+	}
+	if (!scene.aovs.empty()) {
+		cout << "\tAOVs:";
+		for (string aov : scene.aovs) {
+			cout << " " << aov;
+		}
+		cout << endl;
+	}
+	if (progressiveMode) {
+		cout << "\tProgressive: ";
+		if (progressive.timeLimit > 0) {
+			cout << progressive.timeLimit << "s budget ";
+		}
+		if (progressive.targetNoise > 0) {
+			cout << "noise target " << progressive.targetNoise << " ";
+		}
+		if (progressive.passLimit() > 0) {
+			cout << (progressive.maxPasses > 0 ? "" : "at most ") << progressive.passLimit() << " passes";
+		}
+		cout << endl;
+	}
+	cout << "\tRandom seed: " << seed << endl;
 	string outname = scene.outname;
 
-	// start shading/integration
-	auto begin = chrono::steady_clock::now();
-	PathTracer pathtracer(move(scene), SEED);
-	auto canvas = pathtracer.pathTraceInit();
+	// animation sequence, the scene and its BVH are reused across frames
+	Sequence sequence;
+	if (files.size() == 2) {
+		ifstream sequencefile(files[1], ios::in);
+		if (!sequencefile.is_open()) {
+			cerr << "\nCannot open sequence file." << endl;
+			return 1;
+		}
+		sequence = Sequence(sequencefile);
+		cout << "\tSequence: " << sequence.frames.size() << " frames" << endl;
+	}
 
-	//save image and cleanup memory
-	FIBITMAP* img = FreeImage_ConvertFromRawBits(canvas, width, height, width * 3, 24, 0xFF0000, 0x00FF00, 0x0000FF, true);
-	auto end = chrono::steady_clock::now();
+	// start shading/integration
 	FreeImage_Initialise();
-	if (FreeImage_Save(FIF_PNG, img, outname.c_str(), 0)) {
-		cout << "\nImage generated at " << outname << endl;
-		cout << "Time spent: " << chrono::duration_cast<chrono::milliseconds>(end - begin).count()/1000.0 << "s" << endl;
+	// images are encoded and written in the background while the next frame renders
+	FrameWriter writer;
+	auto begin = chrono::steady_clock::now();
+	long long faultsBefore = pageFaults();
+	PathTracer pathtracer(move(scene), seed);
+	// best-so-far images overwrite the output until the final one is written
+	auto render = [&](const string& name) {
+		if (!progressiveMode) {
+			return pathtracer.pathTraceInit();
+		}
+		return pathtracer.progressiveRender(progressive, [&](unsigned char* snapshot) {
+			writer.push(snapshot, pathtracer.scene.width, pathtracer.scene.height, name);
+		});
+	};
+	if (sequence.frames.empty()) {
+		auto canvas = render(outname);
+		auto end = chrono::steady_clock::now();
+		saveFrame(pathtracer, writer, canvas, outname, chrono::duration_cast<chrono::milliseconds>(end - begin).count() / 1000.0);
 	}
-	else {
-		cout << "\nImage generation failed" << endl;
+	for (int f = 0; f < (int)sequence.frames.size(); f++) {
+		cout << "\nFrame " << f + 1 << "/" << sequence.frames.size() << endl;
+		auto frameBegin = chrono::steady_clock::now();
+		int rebuilt;
+		{
+			TraceScope setup("setup", "frame", f);
+			rebuilt = sequence.apply(pathtracer.scene, f);
+		}
+		// cached irradiance is only valid while the geometry stays put
+		if (!sequence.frames[f].moves.empty() && pathtracer.irradianceCache != nullptr) {
+			pathtracer.irradianceCache->clear();
+		}
+		auto setupEnd = chrono::steady_clock::now();
+		cout << "\tSetup: " << chrono::duration<double, milli>(setupEnd - frameBegin).count() << "ms, "
+			<< rebuilt << " subtrees rebuilt" << endl;
+		auto canvas = render(sequence.frames[f].outname);
+		auto end = chrono::steady_clock::now();
+		saveFrame(pathtracer, writer, canvas, sequence.frames[f].outname, chrono::duration_cast<chrono::milliseconds>(end - frameBegin).count() / 1000.0);
 	}
-	FreeImage_Unload(img);
+	writer.finish();
+	if (writer.failed > 0) {
+		cerr << writer.failed << " image(s) could not be written" << endl;
+	}
+	if (pathtracer.irradianceCache != nullptr) {
+		cout << "Irradiance cache: " << pathtracer.irradianceCache->size() << " records" << endl;
+		if (!pathtracer.scene.cacheFile.empty() && pathtracer.irradianceCache->save(pathtracer.scene.cacheFile, pathtracer.scene.fingerprint())) {
+			cout << "Irradiance cache saved at " << pathtracer.scene.cacheFile << endl;
+		}
+	}
+	if (pathtracer.scene.analyticKernel == "check") {
+		cout << "Analytic kernel max relative error: " << pathtracer.analyticError
+			<< (pathtracer.analyticError > PathTracer::ANALYTIC_ERROR_BOUND ? ", above the bound of " : ", bound ")
+			<< PathTracer::ANALYTIC_ERROR_BOUND << endl;
+	}
+	if (pathtracer.scene.paged != nullptr) {
+		PagedGeometry& paged = *pathtracer.scene.paged;
+		cout << "Paged geometry: " << paged.chunkLoads << " chunk loads, " << paged.evictions << " evictions, peak "
+			<< paged.peakResidentBytes / 1048576.0 << " MB resident, " << pageFaults() - faultsBefore << " page faults" << endl;
+	}
+	if (pathtracer.cuts > 0) {
+		cout << "Average light cut: " << (double)pathtracer.cutLights / pathtracer.cuts << " of "
+			<< pathtracer.scene.simpleLights.size() << " lights" << endl;
+	}
+	if (countingAllocations()) {
+		cout << "Render loop heap allocations: " << pathtracer.warmupAllocations << " in the first pass, "
+			<< pathtracer.loopAllocations << " after" << endl;
+	}
+	if (counting()) {
+		printCounters(cout);
+	}
+	auto end = chrono::steady_clock::now();
+	cout << "Time spent: " << chrono::duration_cast<chrono::milliseconds>(end - begin).count() / 1000.0 << "s" << endl;
 	FreeImage_DeInitialise();
-	delete[] canvas;
+	if (!tracePath.empty() && writeTrace(tracePath)) {
+		cout << "Trace written to " << tracePath << endl;
+	}
 	cout << "Exiting renderer..." << endl;
-	return 0;
+	return writer.failed > 0 ? 1 : 0;
 }
@@ -0,0 +1,385 @@
+#include "paging.h"
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+#include "trace.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+constexpr int CHUNK_TRIANGLES = 4096;
+constexpr int CHUNK_LEAF_TRIANGLES = 4;
+// chunks start on a page so releasing one never drops a neighbour's pages
+constexpr size_t PAGE_BYTES = 4096;
+
+MappedFile::MappedFile(const std::string& path)
+{
+#ifdef _WIN32
+	file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	LARGE_INTEGER size;
+	if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size)) {
+		throw std::runtime_error("cannot open " + path);
+	}
+	bytes = size.QuadPart;
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	base = mapping != nullptr ? (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+#else
+	fd = open(path.c_str(), O_RDONLY);
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info) != 0) {
+		throw std::runtime_error("cannot open " + path);
+	}
+	bytes = info.st_size;
+	void* address = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+	base = address != MAP_FAILED ? (const char*)address : nullptr;
+#endif
+	if (base == nullptr) {
+		throw std::runtime_error("cannot map " + path);
+	}
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+	UnmapViewOfFile(base);
+	CloseHandle(mapping);
+	CloseHandle(file);
+#else
+	munmap((void*)base, bytes);
+	close(fd);
+#endif
+}
+
+void MappedFile::release(size_t offset, size_t length)
+{
+#ifdef _WIN32
+	// unlocking pages that are not locked takes them out of the working set
+	VirtualUnlock((void*)(base + offset), length);
+#else
+	madvise((void*)(base + offset), length, MADV_DONTNEED);
+#endif
+}
+
+long long pageFaults()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+	return counters.PageFaultCount;
+#else
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_minflt + usage.ru_majflt;
+#endif
+}
+
+PagedGeometry::PagedGeometry(const std::string& p, size_t budget) : path(p), residentBudget(budget)
+{
+	spill.open(path + ".spill", std::ios::binary | std::ios::trunc);
+	if (!spill.is_open()) {
+		throw std::runtime_error("cannot write " + path + ".spill");
+	}
+}
+
+PagedGeometry::~PagedGeometry()
+{
+	mapped = nullptr;
+	if (spill.is_open()) {
+		spill.close();
+		std::remove((path + ".spill").c_str());
+	}
+	std::remove(path.c_str());
+}
+
+void PagedGeometry::add(const Eigen::Vector3d* vertices, const Eigen::Vector3d* normals, int materialId)
+{
+	PagedTriangle t{};
+	for (int v = 0; v < 3; v++) {
+		for (int a = 0; a < 3; a++) {
+			t.v[v][a] = vertices[v][a];
+		}
+		t.normal[v] = normals != nullptr ? encodeNormal(normals[v]) : 0;
+	}
+	t.smooth = normals != nullptr;
+	t.material = materialId;
+	spill.write((const char*)&t, sizeof(t));
+	centroids.push_back(((vertices[0] + vertices[1] + vertices[2]) / 3).cast<float>());
+	triangles++;
+}
+
+// median splits on the longest axis until ranges fit a chunk, in depth first order
+void PagedGeometry::cluster(std::vector<uint32_t>& order, int begin, int end, std::vector<std::pair<int, int>>& ranges)
+{
+	if (end - begin <= CHUNK_TRIANGLES) {
+		ranges.emplace_back(begin, end);
+		return;
+	}
+	Eigen::AlignedBox3f bounds;
+	for (int i = begin; i < end; i++) {
+		bounds.extend(centroids[order[i]]);
+	}
+	int axis;
+	bounds.diagonal().maxCoeff(&axis);
+	int mid = begin + (end - begin) / 2;
+	std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+		[&](uint32_t a, uint32_t b) { return centroids[a][axis] < centroids[b][axis]; });
+	cluster(order, begin, mid, ranges);
+	cluster(order, mid, end, ranges);
+}
+
+static Eigen::AlignedBox3d triangleBox(const PagedTriangle& t)
+{
+	Eigen::AlignedBox3d box;
+	for (int v = 0; v < 3; v++) {
+		box.extend(Eigen::Vector3d(t.v[v][0], t.v[v][1], t.v[v][2]));
+	}
+	return box;
+}
+
+static uint32_t buildNodes(std::vector<PagedTriangle>& tris, int begin, int end, std::vector<PagedNode>& nodes)
+{
+	Eigen::AlignedBox3d box, centers;
+	for (int i = begin; i < end; i++) {
+		Eigen::AlignedBox3d b = triangleBox(tris[i]);
+		box.extend(b);
+		centers.extend(b.center());
+	}
+	PagedNode node{};
+	for (int a = 0; a < 3; a++) {
+		node.lo[a] = (float)box.min()[a];
+		if (node.lo[a] > box.min()[a]) {
+			node.lo[a] = std::nextafter(node.lo[a], -std::numeric_limits<float>::infinity());
+		}
+		node.hi[a] = (float)box.max()[a];
+		if (node.hi[a] < box.max()[a]) {
+			node.hi[a] = std::nextafter(node.hi[a], std::numeric_limits<float>::infinity());
+		}
+	}
+	uint32_t index = nodes.size();
+	nodes.push_back(node);
+	if (end - begin <= CHUNK_LEAF_TRIANGLES) {
+		nodes[index].first = begin;
+		nodes[index].count = end - begin;
+		return index;
+	}
+	int axis;
+	centers.diagonal().maxCoeff(&axis);
+	int mid = begin + (end - begin) / 2;
+	std::nth_element(tris.begin() + begin, tris.begin() + mid, tris.begin() + end,
+		[axis](const PagedTriangle& a, const PagedTriangle& b) {
+			return a.v[0][axis] + a.v[1][axis] + a.v[2][axis] < b.v[0][axis] + b.v[1][axis] + b.v[2][axis];
+		});
+	buildNodes(tris, begin, mid, nodes);
+	nodes[index].first = buildNodes(tris, mid, end, nodes);
+	nodes[index].count = 0;
+	return index;
+}
+
+void PagedGeometry::writeChunk(std::ofstream& out, const MappedFile& source, const uint32_t* ids, int count)
+{
+	std::vector<PagedTriangle> tris(count);
+	Eigen::AlignedBox3d bounds;
+	for (int i = 0; i < count; i++) {
+		tris[i] = ((const PagedTriangle*)source.data())[ids[i]];
+		bounds.extend(triangleBox(tris[i]));
+	}
+	std::vector<PagedNode> nodes;
+	buildNodes(tris, 0, count, nodes);
+	size_t offset = out.tellp();
+	size_t padding = (PAGE_BYTES - offset % PAGE_BYTES) % PAGE_BYTES;
+	std::vector<char> zeros(padding, 0);
+	out.write(zeros.data(), padding);
+	offset += padding;
+	out.write((const char*)nodes.data(), nodes.size() * sizeof(PagedNode));
+	out.write((const char*)tris.data(), tris.size() * sizeof(PagedTriangle));
+	chunks.push_back(Chunk{ offset, nodes.size() * sizeof(PagedNode) + tris.size() * sizeof(PagedTriangle), (uint32_t)nodes.size(), bounds });
+}
+
+std::vector<std::shared_ptr<Primitive>> PagedGeometry::finish()
+{
+	TraceScope scope("page geometry", "triangles", triangles);
+	std::vector<std::shared_ptr<Primitive>> result;
+	if (!spill.is_open()) {
+		return result;
+	}
+	spill.close();
+	if (triangles > 0) {
+		std::vector<uint32_t> order(triangles);
+		for (uint32_t i = 0; i < triangles; i++) {
+			order[i] = i;
+		}
+		std::vector<std::pair<int, int>> ranges;
+		cluster(order, 0, triangles, ranges);
+		centroids.clear();
+		centroids.shrink_to_fit();
+		{
+			MappedFile source(path + ".spill");
+			std::ofstream out(path, std::ios::binary | std::ios::trunc);
+			if (!out.is_open()) {
+				throw std::runtime_error("cannot write " + path);
+			}
+			for (const auto& r : ranges) {
+				writeChunk(out, source, order.data() + r.first, r.second - r.first);
+			}
+		}
+		mapped = std::make_unique<MappedFile>(path);
+		resident = std::make_unique<std::atomic<bool>[]>(chunks.size());
+		lastUse = std::make_unique<std::atomic<uint32_t>[]>(chunks.size());
+		for (int c = 0; c < (int)chunks.size(); c++) {
+			resident[c] = false;
+			lastUse[c] = 0;
+			result.push_back(std::make_shared<PagedChunk>(this, c));
+		}
+	}
+	std::remove((path + ".spill").c_str());
+	return result;
+}
+
+size_t PagedGeometry::fileBytes() const
+{
+	return mapped != nullptr ? mapped->size() : 0;
+}
+
+void PagedGeometry::touch(int chunk)
+{
+	uint32_t now = epoch.load(std::memory_order_relaxed);
+	// written only when it changes, hot chunks are read by every thread
+	if (lastUse[chunk].load(std::memory_order_relaxed) != now) {
+		lastUse[chunk].store(now, std::memory_order_relaxed);
+	}
+	if (!resident[chunk].load(std::memory_order_relaxed) && !resident[chunk].exchange(true)) {
+		chunkLoads++;
+		size_t bytes = residentBytes += chunks[chunk].bytes;
+		size_t peak = peakResidentBytes;
+		while (bytes > peak && !peakResidentBytes.compare_exchange_weak(peak, bytes)) {
+		}
+	}
+}
+
+void PagedGeometry::flush()
+{
+	epoch.fetch_add(1, std::memory_order_relaxed);
+	if (residentBudget == 0 || residentBytes <= residentBudget) {
+		return;
+	}
+	// chunks still read by another thread are simply paged in again
+	std::lock_guard<std::mutex> guard(evictLock);
+	while (residentBytes > residentBudget) {
+		int oldest = -1;
+		for (int c = 0; c < (int)chunks.size(); c++) {
+			if (resident[c] && (oldest < 0 || lastUse[c] < lastUse[oldest])) {
+				oldest = c;
+			}
+		}
+		if (oldest < 0) {
+			break;
+		}
+		mapped->release(chunks[oldest].offset, chunks[oldest].bytes);
+		resident[oldest] = false;
+		residentBytes -= chunks[oldest].bytes;
+		evictions++;
+	}
+}
+
+PagedChunk::PagedChunk(PagedGeometry* g, int c) : geometry(g), chunk(c)
+{
+	bbox = geometry->chunks[chunk].bounds;
+}
+
+// distance along the ray to where it enters node, infinity when it misses; inverse
+// holds 1 / ray.pt, not the normalized ray.rpt, so entries compare with hit distances
+static double nodeEntry(const Ray& ray, const Eigen::Vector3d& inverse, const PagedNode& node)
+{
+	double tMin = -std::numeric_limits<double>::infinity();
+	double tMax = std::numeric_limits<double>::infinity();
+	for (int a = 0; a < 3; a++) {
+		double t1 = (node.lo[a] - ray.p0[a]) * inverse[a];
+		double t2 = (node.hi[a] - ray.p0[a]) * inverse[a];
+		tMin = std::max(tMin, std::min(t1, t2));
+		tMax = std::min(tMax, std::max(t1, t2));
+	}
+	return tMax > 0 && tMax >= tMin ? tMin : std::numeric_limits<double>::infinity();
+}
+
+double PagedChunk::intersect(const Ray& ray, Eigen::Vector2d* uv, int* element)
+{
+	geometry->touch(chunk);
+	const PagedGeometry::Chunk& c = geometry->chunks[chunk];
+	const char* base = geometry->mapped->data() + c.offset;
+	const PagedNode* nodes = (const PagedNode*)base;
+	const PagedTriangle* tris = (const PagedTriangle*)(base + c.nodes * sizeof(PagedNode));
+	double best = -1;
+	Eigen::Vector2d hitUv, triUv;
+	int hitTriangle = 0;
+	// pending nodes with their entry distance, skipped once a closer hit is known;
+	// chunks hold at most CHUNK_TRIANGLES, median splits keep the depth near log2 of that
+	Eigen::Vector3d inverse = ray.pt.cwiseInverse();
+	std::pair<uint32_t, double> stack[64];
+	int size = 0;
+	stack[size++] = { 0, nodeEntry(ray, inverse, nodes[0]) };
+	while (size > 0) {
+		auto [index, entry] = stack[--size];
+		if (entry == std::numeric_limits<double>::infinity() || (best != -1 && entry > best)) {
+			continue;
+		}
+		const PagedNode& node = nodes[index];
+		if (node.count == 0) {
+			// the nearer child is pushed last, so it is visited first and can cull the other
+			std::pair<uint32_t, double> left = { index + 1, nodeEntry(ray, inverse, nodes[index + 1]) };
+			std::pair<uint32_t, double> right = { node.first, nodeEntry(ray, inverse, nodes[node.first]) };
+			if (left.second < right.second) {
+				std::swap(left, right);
+			}
+			stack[size++] = left;
+			stack[size++] = right;
+			continue;
+		}
+		for (uint32_t i = node.first; i < node.first + node.count; i++) {
+			const PagedTriangle& tri = tris[i];
+			Eigen::Vector3d v0(tri.v[0][0], tri.v[0][1], tri.v[0][2]);
+			Eigen::Vector3d v1(tri.v[1][0], tri.v[1][1], tri.v[1][2]);
+			Eigen::Vector3d v2(tri.v[2][0], tri.v[2][1], tri.v[2][2]);
+			double t = intersectTriangle(v0, v1, v2, (v1 - v0).cross(v2 - v0).normalized(), ray, &triUv);
+			if (t > 0 && (best == -1 || t < best)) {
+				best = t;
+				hitUv = triUv;
+				hitTriangle = i;
+			}
+		}
+	}
+	if (best > 0) {
+		if (uv != nullptr) {
+			*uv = hitUv;
+		}
+		if (element != nullptr) {
+			*element = hitTriangle;
+		}
+	}
+	return best;
+}
+
+void PagedChunk::surface(Intersection& hit)
+{
+	const PagedGeometry::Chunk& c = geometry->chunks[chunk];
+	const PagedTriangle& tri = ((const PagedTriangle*)(geometry->mapped->data() + c.offset + c.nodes * sizeof(PagedNode)))[hit.element];
+	Eigen::Vector3d v0(tri.v[0][0], tri.v[0][1], tri.v[0][2]);
+	Eigen::Vector3d v1(tri.v[1][0], tri.v[1][1], tri.v[1][2]);
+	Eigen::Vector3d v2(tri.v[2][0], tri.v[2][1], tri.v[2][2]);
+	hit.geometricNormal = (v1 - v0).cross(v2 - v0).normalized();
+	hit.normal = hit.geometricNormal;
+	if (tri.smooth) {
+		double u = 1 - hit.uv[0] - hit.uv[1];
+		hit.normal = (u * decodeNormal(tri.normal[0]) + hit.uv[0] * decodeNormal(tri.normal[1]) + hit.uv[1] * decodeNormal(tri.normal[2])).normalized();
+	}
+	hit.material = tri.material;
+}
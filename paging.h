@@ -0,0 +1,119 @@
+#pragma once
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "primitive.h"
+
+// triangle as stored in a chunk, positions in world space
+struct PagedTriangle {
+	double v[3][3];
+	// octahedral vertex normals, valid when smooth is set
+	uint32_t normal[3];
+	// index in the scene's material table
+	int32_t material;
+	uint32_t smooth;
+};
+
+// node of a chunk's BVH, boxes rounded outwards to float; leaves have count
+// triangles from first, inner nodes have their left child next and the right one at first
+struct PagedNode {
+	float lo[3];
+	float hi[3];
+	uint32_t first;
+	uint32_t count;
+};
+
+// a read-only file mapped into the address space
+class MappedFile {
+public:
+	MappedFile(const std::string& path);
+	~MappedFile();
+	const char* data() const { return base; }
+	size_t size() const { return bytes; }
+	// gives the pages of [offset, offset + length) back to the OS, they are read again on access
+	void release(size_t offset, size_t length);
+
+private:
+	const char* base = nullptr;
+	size_t bytes = 0;
+#ifdef _WIN32
+	void* file = nullptr;
+	void* mapping = nullptr;
+#else
+	int fd = -1;
+#endif
+};
+
+// Out-of-core storage for static triangles. During parsing triangles are spilled
+// to disk with only their centroids kept in memory; finish() groups them into
+// spatially clustered chunks of CHUNK_TRIANGLES, each with its own small BVH,
+// written page-aligned to one file that is memory-mapped and paged in on demand.
+// The scene sees one PagedChunk primitive per chunk. Chunks touched by a tile are
+// marked resident; when they exceed the resident budget the least recently used
+// ones are released back to the OS.
+class PagedGeometry {
+public:
+	std::string path;
+	size_t residentBudget;
+	size_t triangles = 0;
+	// chunks paged in on first touch or after a release, chunks released
+	std::atomic<long long> chunkLoads = 0;
+	std::atomic<long long> evictions = 0;
+	std::atomic<size_t> residentBytes = 0;
+	std::atomic<size_t> peakResidentBytes = 0;
+
+	PagedGeometry(const std::string& path, size_t residentBudget);
+	~PagedGeometry();
+	// vertices in world space, normals null for flat triangles
+	void add(const Eigen::Vector3d* vertices, const Eigen::Vector3d* normals, int materialId);
+	// writes the chunk file and maps it; returns one primitive per chunk
+	std::vector<std::shared_ptr<Primitive>> finish();
+	size_t chunkCount() const { return chunks.size(); }
+	size_t fileBytes() const;
+
+	// called by chunks on every intersection test
+	void touch(int chunk);
+	// per tile bookkeeping of the calling thread, releases chunks over the budget
+	void flush();
+
+private:
+	friend class PagedChunk;
+	struct Chunk {
+		size_t offset;
+		size_t bytes;
+		uint32_t nodes;
+		Eigen::AlignedBox3d bounds;
+	};
+	std::vector<Chunk> chunks;
+	std::unique_ptr<MappedFile> mapped;
+	std::unique_ptr<std::atomic<bool>[]> resident;
+	std::unique_ptr<std::atomic<uint32_t>[]> lastUse;
+	std::atomic<uint32_t> epoch = 0;
+	std::mutex evictLock;
+	// parsing state
+	std::ofstream spill;
+	std::vector<Eigen::Vector3f> centroids;
+
+	void cluster(std::vector<uint32_t>& order, int begin, int end, std::vector<std::pair<int, int>>& ranges);
+	void writeChunk(std::ofstream& out, const MappedFile& source, const uint32_t* ids, int count);
+};
+
+// one chunk of a PagedGeometry, element is the hit triangle within the chunk
+class PagedChunk : public Primitive {
+public:
+	PagedChunk(PagedGeometry* geometry, int chunk);
+	virtual double intersect(const Ray& ray, Eigen::Vector2d* uv = nullptr, int* element = nullptr);
+	virtual void surface(Intersection& hit);
+	// paged triangles are static
+	virtual void transform(const Eigen::Affine3d&) {}
+
+private:
+	PagedGeometry* geometry;
+	int chunk;
+};
+
+// page faults of the process so far, minor and major
+long long pageFaults();
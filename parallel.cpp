@@ -0,0 +1,123 @@
+#include "parallel.h"
+#include "trace.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+int workerCount()
+{
+	static const int count = std::max((int)std::thread::hardware_concurrency(), 1);
+	return count;
+}
+
+// Threads are started on first use and live as long as the process, so their
+// thread_local scratch (arenas, traversal stacks) carries over between passes
+// and no thread is created per call.
+class WorkerPool {
+public:
+	~WorkerPool()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto& t : threads) {
+			t.join();
+		}
+	}
+
+	void submit(int count, std::function<void()> task)
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			while ((int)threads.size() < count) {
+				threads.emplace_back(&WorkerPool::run, this, (int)threads.size() + 1);
+			}
+			for (int i = 0; i < count; i++) {
+				tasks.push_back(task);
+			}
+		}
+		wake.notify_all();
+	}
+
+private:
+	std::vector<std::thread> threads;
+	std::deque<std::function<void()>> tasks;
+	std::mutex lock;
+	std::condition_variable wake;
+	bool stopping = false;
+
+	void run(int index)
+	{
+		traceThreadName(("worker " + std::to_string(index)).c_str());
+		while (true) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				wake.wait(guard, [this] { return stopping || !tasks.empty(); });
+				if (tasks.empty()) {
+					return;
+				}
+				task = std::move(tasks.front());
+				tasks.pop_front();
+			}
+			task();
+		}
+	}
+};
+
+static WorkerPool pool;
+
+void parallelFor(int begin, int end, std::function<void(int)> body, int limit)
+{
+	int threads = std::min(limit > 0 ? limit : workerCount(), end - begin);
+	if (threads <= 1) {
+		for (int i = begin; i < end; i++) {
+			body(i);
+		}
+		return;
+	}
+	// indices are handed out one at a time, iterations (tiles, rows) can differ a lot in cost;
+	// the caller works too, helpers that start after the range ran out return at once
+	struct Range {
+		std::atomic<int> next;
+		int end;
+		std::function<void(int)>* body;
+		int active = 0;
+		std::mutex lock;
+		std::condition_variable idle;
+	};
+	auto range = std::make_shared<Range>();
+	range->next = begin;
+	range->end = end;
+	range->body = &body;
+	pool.submit(threads - 1, [range] {
+		{
+			std::lock_guard<std::mutex> guard(range->lock);
+			if (range->next >= range->end) {
+				return;
+			}
+			range->active++;
+		}
+		for (int i = range->next++; i < range->end; i = range->next++) {
+			(*range->body)(i);
+		}
+		{
+			std::lock_guard<std::mutex> guard(range->lock);
+			range->active--;
+		}
+		range->idle.notify_all();
+	});
+	for (int i = range->next++; i < end; i = range->next++) {
+		body(i);
+	}
+	std::unique_lock<std::mutex> guard(range->lock);
+	range->idle.wait(guard, [&] { return range->active == 0; });
+}
@@ -0,0 +1,10 @@
+#pragma once
+#include <functional>
+
+// the hardware concurrency, what parallelFor uses unless told otherwise
+int workerCount();
+
+// runs body(i) for i in [begin, end) over up to threads threads, the caller's included,
+// in no particular order; 0 for workerCount(). The pool is shared, so concurrent loops
+// with different limits do not affect each other
+void parallelFor(int begin, int end, std::function<void(int)> body, int threads = 0);
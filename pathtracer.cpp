@@ -1,4 +1,28 @@
 #include "pathtracer.h"
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <iostream>
+#include "denoiser.h"
+#include "parallel.h"
+#include "counters.h"
+#include "trace.h"
+
+constexpr int TILE_SIZE = 16;
+// pixels traced together by the wavefront engine, bounds its queue memory
+constexpr int WAVE_SIZE = 1 << 16;
+// tiles per round when an irradiance cache is shared, fixed so records do not depend on the thread count
+constexpr int CACHE_ROUND_TILES = 32;
+// reservoirs carried over from the previous pass or frame count at most this many times the new candidates
+constexpr double RESERVOIR_HISTORY = 20;
+
+thread_local std::mt19937 PathTracer::random;
+thread_local long long PathTracer::pixelSteps = 0;
+thread_local IrradianceCache* PathTracer::cacheStage = nullptr;
+thread_local long long PathTracer::pixelTests = 0;
+thread_local long long PathTracer::threadRays = 0;
+thread_local long long PathTracer::threadCutLights = 0;
+thread_local long long PathTracer::threadCuts = 0;
 
 void NormalizeColor(Eigen::Vector3d& color) {
 	color[0] = (color[0] < 1) ? color[0] * 255 : 255;
@@ -9,69 +33,170 @@ void NormalizeColor(Eigen::Vector3d& color) {
 PathTracer::PathTracer(Scene s, double randomSeed)
 {
 	scene = std::move(s);
+	lightBatch = LightBatch(scene.polyLights);
+	if (scene.restirCandidates > 0) {
+		double power = 0;
+		for (const auto& light : scene.polyLights) {
+			power += light->c.sum() / 3 * light->area;
+			lightCdf.push_back(power);
+		}
+		if (power <= 0) {
+			lightCdf.clear();
+		}
+	}
+	if (scene.lightcutError > 0 && !scene.simpleLights.empty()) {
+		lightTree = LightTree(scene.simpleLights, scene.attenuation);
+	}
+	if (scene.cacheError > 0 && !scene.bounds.isEmpty()) {
+		irradianceCache = std::make_unique<IrradianceCache>(scene.bounds, scene.cacheError);
+		if (!scene.cacheFile.empty()) {
+			std::string reason;
+			if (!irradianceCache->load(scene.cacheFile, scene.fingerprint(), &reason) && !reason.empty()) {
+				std::cerr << "Irradiance cache " << scene.cacheFile << " ignored: " << reason << std::endl;
+			}
+		}
+	}
 	seed = randomSeed;
-	random = std::default_random_engine(seed);
+	random = std::mt19937(seed);
+	threads = scene.threads;
+	if (scene.engine == "wavefront") {
+		wavefront = std::make_unique<Wavefront>(*this);
+	}
+	else if (scene.primary == "raster" && Rasterizer::supports(scene)) {
+		rasterizer = std::make_unique<Rasterizer>(scene, TILE_SIZE);
+	}
 }
 
 Intersection PathTracer::intersect(Ray ray)
 {
+	threadRays++;
+	if (scene.compactTree != nullptr) {
+		Intersection hit = scene.compactTree->intersect(ray);
+		pixelSteps += hit.nodes;
+		pixelTests += hit.tests;
+		return hit;
+	}
 	if (scene.BVHtree != nullptr) {
-		return scene.BVHtree->intersect(ray);
+		Intersection hit = scene.BVHtree->intersect(ray);
+		pixelSteps += hit.nodes;
+		pixelTests += hit.tests;
+		return hit;
 	}
 	double dist = std::numeric_limits<double>::infinity();
 	double t = -1;
-	std::shared_ptr<Primitive> prim = nullptr;
+	Primitive* prim = nullptr;
+
+	Eigen::Vector2d uv, hitUv;
+	int element = 0, hitElement = 0;
 
-	for (int p = 0; p < scene.primitives.size(); p++)
+	for (int p = 0; p < (int)scene.primitives.size(); p++)
 	{
-		t = scene.primitives[p]->intersect(ray);
+		t = scene.primitives[p]->intersect(ray, &uv, &element);
 		if (t > eps && t < dist) {
 			dist = t;
-			prim = scene.primitives[p];
+			prim = scene.primitives[p].get();
+			hitUv = uv;
+			hitElement = element;
 		}
 	}
 	if (prim == nullptr) {
 		dist = -1;
 	}
-	return Intersection{ dist, prim };
+	pixelTests += scene.primitives.size();
+	Intersection hit{ dist, prim, 0, (int)scene.primitives.size() };
+	hit.uv = hitUv;
+	hit.element = hitElement;
+	return hit;
 }
 
 // Simple ray tracing
-Eigen::Array3d PathTracer::raytracer(Eigen::Vector3d point, std::shared_ptr<Primitive> prim, int bounce, Eigen::Vector3d eye) {
-	Eigen::Array3d shade = prim->mat.ambient + prim->mat.emission;
-	for (auto i: scene.simpleLights) {
-		if (visible(point, i)) {
-			double attenuation = 1;
-			if (i->kind == "point") {
-				double r = (i->v0 - point).norm();
-				attenuation = scene.attenuation[0] + r * scene.attenuation[1] + r * r * scene.attenuation[2];
+Eigen::Array3d PathTracer::raytracer(const Intersection& hit, int bounce, Eigen::Vector3d eye) {
+	return raytracerLocal(hit, eye) + raytracerReflection(hit, bounce, eye);
+}
+
+// ambient, emission and the simple lights at this hit
+Eigen::Array3d PathTracer::raytracerLocal(const Intersection& hit, Eigen::Vector3d eye) {
+	const Eigen::Vector3d& point = hit.point;
+	Eigen::Array3d shade = hit.mat->ambient + hit.mat->emission;
+	if (!lightTree.clusters.empty()) {
+		ArenaScope scope(Arena::local());
+		CutLight* cut = Arena::local().allocate<CutLight>(scene.lightcutMax);
+		int size = lightcut(hit, eye, cut);
+		for (int c = 0; c < size; c++) {
+			if (visible(point, *cut[c].light)) {
+				shade += cut[c].contribution;
 			}
-			shade += (diffuse(point, prim, i) + specular(point, prim, i, eye)) / attenuation;
+		}
+		return shade;
+	}
+	for (const auto& i: scene.simpleLights) {
+		if (visible(point, *i)) {
+			shade += unshadowed(hit, *i, i->c, eye);
+		}
+	}
+	return shade;
+}
+
+// Picks the cut of the light tree for this hit: starting from the roots, the
+// cluster with the largest error bound is replaced by its children until every
+// bound is below lightcutError times the total estimate, or the cut is full
+int PathTracer::lightcut(const Intersection& hit, Eigen::Vector3d eye, CutLight* out)
+{
+	auto evaluate = [&](int index) {
+		const LightCluster& c = lightTree.clusters[index];
+		return CutLight{ index, c.representative, unshadowed(hit, *c.representative, c.intensity, eye), lightTree.errorBound(c, hit) };
+	};
+	auto looser = [](const CutLight& a, const CutLight& b) { return a.bound < b.bound; };
+	int size = 0;
+	Eigen::Array3d total(0, 0, 0);
+	for (int root : lightTree.roots) {
+		if (root >= 0) {
+			out[size] = evaluate(root);
+			total += out[size++].contribution;
 		}
 	}
-	if (bounce > 1 && prim->mat.specualr.sum() > eps) {
-		Ray reflection = reflRay(point, prim, eye);
-		Intersection hit = intersect(reflection);
-		if (hit.prim != nullptr) {
-			Eigen::Vector3d newpoint = point + hit.t * reflection.pt;
-			shade += prim->mat.specualr * raytracer(newpoint, hit.prim, bounce - 1, point);
+	std::make_heap(out, out + size, looser);
+	while (size < scene.lightcutMax && out[0].bound > scene.lightcutError * total.sum() / 3) {
+		std::pop_heap(out, out + size, looser);
+		CutLight refined = out[--size];
+		total -= refined.contribution;
+		for (int child : { lightTree.clusters[refined.cluster].left, lightTree.clusters[refined.cluster].right }) {
+			out[size] = evaluate(child);
+			total += out[size++].contribution;
+			std::push_heap(out, out + size, looser);
+		}
+	}
+	threadCutLights += size;
+	threadCuts++;
+	return size;
+}
+
+// mirror reflection, traced recursively
+Eigen::Array3d PathTracer::raytracerReflection(const Intersection& hit, int bounce, Eigen::Vector3d eye) {
+	Eigen::Array3d shade(0, 0, 0);
+	if (bounce > 1 && hit.mat->specualr.sum() > eps) {
+		Ray reflection = reflRay(hit, eye);
+		Intersection next = intersect(reflection);
+		if (next.prim != nullptr) {
+			next.complete(reflection, scene.materials);
+			shade += hit.mat->specualr * raytracer(next, bounce - 1, hit.point);
 		}
 	}
 	return shade;
 }
 
 
-bool PathTracer::visible(Eigen::Vector3d point, std::shared_ptr<Light> light)
+bool PathTracer::visible(Eigen::Vector3d point, const Light& light)
 {
 	double dist = std::numeric_limits<double>::infinity();
-	Eigen::Vector3d color = light->c;
-	Eigen::Vector3d direction = light->v0;
-	if (light->kind == "point") {
+	Eigen::Vector3d direction = light.v0;
+	if (light.kind == "point") {
 		direction = direction - point;
 		direction.normalize();
-		dist = (point - light->v0).norm();
+		dist = (point - light.v0).norm();
 	}
 	Ray shadowRay(point + eps * direction, direction);
+	CounterScope counting(PhaseShadow, 1);
 	Intersection hit = intersect(shadowRay);
 	if (hit.prim != nullptr && hit.t < dist) {
 		return false;
@@ -79,58 +204,83 @@ bool PathTracer::visible(Eigen::Vector3d point, std::shared_ptr<Light> light)
 	return true;
 }
 
-Eigen::Array3d PathTracer::diffuse(Eigen::Vector3d point, std::shared_ptr<Primitive> prim, std::shared_ptr<Light> light)
+Eigen::Array3d PathTracer::diffuse(const Intersection& hit, const Light& light, const Eigen::Array3d& lightColor)
 {
-	Eigen::Vector3d LiDir = light->v0;
-	Eigen::Vector3d a;
-	if (light->kind == "point") {
-		LiDir = LiDir - point;
+	Eigen::Vector3d LiDir = light.v0;
+	if (light.kind == "point") {
+		LiDir = LiDir - hit.point;
 		LiDir.normalize();
 	}
-	Eigen::Vector3d normal = prim->normal(point);
-	double intensity = std::max(normal.dot(LiDir), 0.0);
-	Eigen::Array3d color = light->c * prim->mat.diffuse;
+	double intensity = std::max(hit.normal.dot(LiDir), 0.0);
+	Eigen::Array3d color = lightColor * hit.mat->diffuse;
 	return color * intensity;
 }
 
-Eigen::Array3d PathTracer::specular(Eigen::Vector3d point, std::shared_ptr<Primitive> prim, std::shared_ptr<Light> light, Eigen::Vector3d eye)
+Eigen::Array3d PathTracer::specular(const Intersection& hit, const Light& light, const Eigen::Array3d& lightColor, Eigen::Vector3d eye)
 {
-	Eigen::Vector3d LiDir = light->v0;
-	if (light->kind == "point") {
-		LiDir = LiDir - point;
+	Eigen::Vector3d LiDir = light.v0;
+	if (light.kind == "point") {
+		LiDir = LiDir - hit.point;
 		LiDir.normalize();
 	}
-	Eigen::Vector3d viewDir = (eye - point).normalized();
-	Eigen::Vector3d normal = prim->normal(point);
+	Eigen::Vector3d viewDir = (eye - hit.point).normalized();
 	Eigen::Vector3d halfAngle = (LiDir + viewDir).normalized();
-	double intensity = std::max(normal.dot(halfAngle), 0.0);
-	Eigen::Array3d color = light->c * prim->mat.specualr;
-	color *= std::pow(intensity, prim->mat.shininess);
+	double intensity = std::max(hit.normal.dot(halfAngle), 0.0);
+	Eigen::Array3d color = lightColor * hit.mat->specualr;
+	color *= std::pow(intensity, hit.mat->shininess);
 	return color;
 }
 
-Ray PathTracer::reflRay(Eigen::Vector3d point, std::shared_ptr<Primitive> prim, Eigen::Vector3d eye) {
-	Eigen::Vector3d normal = prim->normal(point);
-	Eigen::Vector3d viewDir = (eye - point).normalized();
+double PathTracer::attenuation(const Light& light, const Eigen::Vector3d& point)
+{
+	if (light.kind != "point") {
+		return 1;
+	}
+	double r = (light.v0 - point).norm();
+	return scene.attenuation[0] + r * scene.attenuation[1] + r * r * scene.attenuation[2];
+}
+
+Eigen::Array3d PathTracer::unshadowed(const Intersection& hit, const Light& light, const Eigen::Array3d& color, Eigen::Vector3d eye)
+{
+	return (diffuse(hit, light, color) + specular(hit, light, color, eye)) / attenuation(light, hit.point);
+}
+
+Ray PathTracer::reflRay(const Intersection& hit, Eigen::Vector3d eye) {
+	const Eigen::Vector3d& normal = hit.normal;
+	Eigen::Vector3d viewDir = (eye - hit.point).normalized();
 	Eigen::Vector3d refDir = 2 * normal * viewDir.dot(normal) - viewDir;
 	refDir.normalize();
-	return Ray(point + eps * refDir, refDir);
+	return Ray(hit.point + eps * refDir, refDir);
 }
 
 // analytic solution
-Eigen::Array3d PathTracer::analytic(Eigen::Vector3d r, std::shared_ptr<Primitive> prim)
+Eigen::Array3d PathTracer::analytic(const Intersection& hit)
 {
-	Eigen::Vector3d n = prim->normal(r);
+	const Eigen::Vector3d& r = hit.point;
+	const Eigen::Vector3d& n = hit.normal;
+	const Material& mat = *hit.mat;
 	Eigen::Array3d color(0, 0, 0);
+	if (scene.analyticKernel != "exact" && mat.emission.sum() - 0 < eps) {
+		color = mat.diffuse * lightBatch.irradiance(r, n) / PI;
+		if (scene.analyticKernel != "check") {
+			return color;
+		}
+	}
+	Eigen::Array3d exact(0, 0, 0);
 	for (auto i: scene.polyLights) {
-		if (prim->mat.emission.sum() - 0 <  eps) {
-			color += prim->mat.diffuse * i->c * (phi(r, i).dot(n)) / PI;
+		if (mat.emission.sum() - 0 <  eps) {
+			exact += mat.diffuse * i->c * (phi(r, i).dot(n)) / PI;
 		}
 		else {
-			color += prim->mat.emission;
+			exact += mat.emission;
 		}
 	}
-	return color;
+	if (scene.analyticKernel == "check" && mat.emission.sum() - 0 < eps) {
+		double scale = std::max(exact.abs().maxCoeff(), eps);
+		std::lock_guard<std::mutex> guard(statsLock);
+		analyticError = std::max(analyticError, (color - exact).abs().maxCoeff() / scale);
+	}
+	return exact;
 }
 
 double PathTracer::theta(Eigen::Vector3d r, Eigen::Vector3d vk, Eigen::Vector3d vk1) {
@@ -141,7 +291,7 @@ Eigen::Vector3d PathTracer::gamma(Eigen::Vector3d r, Eigen::Vector3d vk, Eigen::
 	return (vk - r).cross(vk1 - r).normalized();
 }
 
-Eigen::Vector3d PathTracer::phi(Eigen::Vector3d r, std::shared_ptr<QuadLight> light) {
+Eigen::Vector3d PathTracer::phi(Eigen::Vector3d r, const std::shared_ptr<QuadLight>& light) {
 	Eigen::Vector3d a = light->va;
 	Eigen::Vector3d b = light->vb;
 	Eigen::Vector3d c = light->vc;
@@ -155,41 +305,49 @@ Eigen::Vector3d PathTracer::phi(Eigen::Vector3d r, std::shared_ptr<QuadLight> li
 }
 
 // Monte Carlo direct illumination
-Eigen::Array3d PathTracer::direct(Eigen::Vector3d point, std::shared_ptr<Primitive> prim, Eigen::Vector3d eye)
+Eigen::Array3d PathTracer::direct(const Intersection& hit, Eigen::Vector3d eye, const Reservoir* reservoir)
 {
+	if (scene.restirCandidates > 0 && !lightCdf.empty()) {
+		return reservoir != nullptr ? shadeReservoir(hit, eye, *reservoir) : shadeReservoir(hit, eye, sampleLights(hit, eye));
+	}
 	// TODO: rendering incorrect
-	Eigen::Vector3d n = prim->normal(point);
+	const Eigen::Vector3d& point = hit.point;
 	Eigen::Array3d color(0, 0, 0), color_i(0, 0, 0);
 	Eigen::Array3d constant(1,1,1);
-	for (std::shared_ptr<QuadLight> li : scene.polyLights) {
+	ArenaScope scope(Arena::local());
+	for (const std::shared_ptr<QuadLight>& li : scene.polyLights) {
 		color_i.setZero();
-		std::vector<Eigen::Vector3d> lightSamples = li->samples(scene.sample, scene.stratify, random);
-		for (auto p : lightSamples) {
-			if (visibility(point, p, prim, li)) {
-				color_i += phoneBRDF(prim, eye, point, p) * geometry(prim, li, point, p);
+		int count = li->sampleCount(scene.sample, scene.stratify);
+		Eigen::Vector3d* lightSamples = Arena::local().allocate<Eigen::Vector3d>(count);
+		li->samples(scene.sample, scene.stratify, random, lightSamples);
+		for (int s = 0; s < count; s++) {
+			const Eigen::Vector3d& p = lightSamples[s];
+			if (visibility(point, p, li)) {
+				color_i += phoneBRDF(hit, eye, p) * geometry(hit, li, p);
 			}
 		}
-		color += color_i * li->c * li->area / lightSamples.size();
+		color += color_i * li->c * li->area / count;
 	}
 	return color;
 }
 
-bool PathTracer::visibility(Eigen::Vector3d x1, Eigen::Vector3d x2, std::shared_ptr<Primitive> prim, std::shared_ptr<QuadLight> light) {
+bool PathTracer::visibility(Eigen::Vector3d x1, Eigen::Vector3d x2, const std::shared_ptr<QuadLight>& light) {
 	//x1: point of primitive
 	//x2: point of light
 	Eigen::Vector3d direction = (x2 - x1).normalized();
 	Ray r(x1 + eps * direction, direction);
+	CounterScope counting(PhaseShadow, 1);
 	Intersection hit = intersect(r);
-	if (light->n.dot(r.pt) < 0 || hit.t > eps && hit.t < (x2 - x1).norm()) return false;
+	if (light->n.dot(r.pt) < 0 || (hit.t > eps && hit.t < (x2 - x1).norm())) return false;
 	return true;
 }
 
-double PathTracer::geometry(std::shared_ptr<Primitive> prim, std::shared_ptr<QuadLight> light, Eigen::Vector3d x1, Eigen::Vector3d x2) {
+double PathTracer::geometry(const Intersection& hit, const std::shared_ptr<QuadLight>& light, Eigen::Vector3d x2) {
 	double R, nldir;
-	Eigen::Vector3d n, nl, dir;
-	n = prim->normal(x1);
+	Eigen::Vector3d nl, dir;
+	const Eigen::Vector3d& n = hit.normal;
 	nl = light->n;
-	dir = (x2 - x1);
+	dir = (x2 - hit.point);
 	R = dir.norm();
 	dir.normalize();
 	nldir = nl.dot(dir);
@@ -197,20 +355,267 @@ double PathTracer::geometry(std::shared_ptr<Primitive> prim, std::shared_ptr<Qua
 	return (n.dot(dir)) * nldir / (R * R);
 }
 
-Eigen::Array3d PathTracer::phoneBRDF(std::shared_ptr<Primitive> prim, Eigen::Vector3d eye, Eigen::Vector3d x1, Eigen::Vector3d x2) {
+Eigen::Array3d PathTracer::phoneBRDF(const Intersection& hit, Eigen::Vector3d eye, Eigen::Vector3d x2) {
 	Eigen::Array3d diffuse, specular;
-	Eigen::Vector3d r, lm, n;
+	Eigen::Vector3d r, lm;
+	const Eigen::Vector3d& x1 = hit.point;
+	const Eigen::Vector3d& n = hit.normal;
 	double intensity;
-	diffuse = prim->mat.diffuse / PI;
-	specular = prim->mat.specualr * (prim->mat.shininess + 2) / (2 * PI);
+	diffuse = hit.mat->diffuse / PI;
+	specular = hit.mat->specualr * (hit.mat->shininess + 2) / (2 * PI);
 	lm = (x2 - x1).normalized();
-	n = prim->normal(x1);
 	r = 2 * (lm.dot(n)) * n - lm;
-	intensity = pow(r.dot((eye - x1).normalized()), prim->mat.shininess);
+	intensity = pow(r.dot((eye - x1).normalized()), hit.mat->shininess);
 	return diffuse + specular * intensity;
 }
 
+double PathTracer::lightTarget(const Intersection& hit, Eigen::Vector3d eye, int light, double r1, double r2, Eigen::Array3d* f)
+{
+	const QuadLight& l = *scene.polyLights[light];
+	Eigen::Vector3d y = l.va + r1 * l.e1 + r2 * l.e2;
+	Eigen::Vector3d dir = y - hit.point;
+	double R2 = dir.squaredNorm();
+	dir /= std::sqrt(R2);
+	double cosine = hit.normal.dot(dir);
+	// lights only shine to one side, as in visibility()
+	if (cosine <= 0 || l.n.dot(dir) < 0) {
+		return 0;
+	}
+	Eigen::Array3d contribution = phoneBRDF(hit, eye, y) * (cosine * l.n.dot(dir) / R2) * l.c;
+	double target = contribution.sum() / 3;
+	if (!(target > 0)) {
+		return 0;
+	}
+	if (f != nullptr) {
+		*f = contribution;
+	}
+	return target;
+}
+
+Reservoir PathTracer::sampleLights(const Intersection& hit, Eigen::Vector3d eye)
+{
+	std::uniform_real_distribution<double> dis(0, 1.0);
+	Reservoir reservoir;
+	for (int c = 0; c < scene.restirCandidates; c++) {
+		int l = std::upper_bound(lightCdf.begin(), lightCdf.end(), dis(random) * lightCdf.back()) - lightCdf.begin();
+		l = std::min(l, (int)lightCdf.size() - 1);
+		// source density over the lights' area: power share over area
+		double pdf = (lightCdf[l] - (l > 0 ? lightCdf[l - 1] : 0)) / lightCdf.back() / scene.polyLights[l]->area;
+		double r1 = dis(random), r2 = dis(random);
+		double target = lightTarget(hit, eye, l, r1, r2);
+		reservoir.update(l, r1, r2, target, target / pdf, 1, dis(random));
+	}
+	reservoir.normal = hit.normal;
+	reservoir.depth = hit.t;
+	reservoir.finish();
+	return reservoir;
+}
+
+Eigen::Array3d PathTracer::shadeReservoir(const Intersection& hit, Eigen::Vector3d eye, const Reservoir& reservoir)
+{
+	Eigen::Array3d f;
+	if (reservoir.light < 0 || reservoir.W <= 0 || lightTarget(hit, eye, reservoir.light, reservoir.r1, reservoir.r2, &f) <= 0) {
+		return Eigen::Array3d(0, 0, 0);
+	}
+	const std::shared_ptr<QuadLight>& light = scene.polyLights[reservoir.light];
+	if (!visibility(hit.point, light->va + reservoir.r1 * light->e1 + reservoir.r2 * light->e2, light)) {
+		return Eigen::Array3d(0, 0, 0);
+	}
+	return f * reservoir.W;
+}
+
+PathTracer::CostScope::CostScope(SampleCost* c) : cost(c)
+{
+	if (cost != nullptr) {
+		pixelSteps = 0;
+		pixelTests = 0;
+		begin = std::chrono::steady_clock::now();
+	}
+}
+
+PathTracer::CostScope::~CostScope()
+{
+	if (cost != nullptr) {
+		cost->steps += pixelSteps;
+		cost->tests += pixelTests;
+		cost->micros += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+	}
+}
+
+// Spatiotemporal reuse of Bitterli et al. (2020) with the biased 1/M weights: each
+// hit streams its candidates, drops its sample when a shadow ray finds it occluded,
+// merges its pixel's reservoir of the previous pass or frame and then up to
+// restirNeighbors reservoirs of similar hits in the tile
+Reservoir* PathTracer::resampleTile(const VisibilitySample* samples, int x0, int y0, int columns, int count, SampleCost* costs)
+{
+	TraceScope scope("resample", "samples", count);
+	std::uniform_real_distribution<double> dis(0, 1.0);
+	Intersection* hits = Arena::local().allocate<Intersection>(count);
+	Reservoir* initial = Arena::local().allocate<Reservoir>(count);
+	Reservoir* reused = Arena::local().allocate<Reservoir>(count);
+	int* neighbors = Arena::local().allocate<int>(scene.restirNeighbors);
+	Eigen::Vector3d eye = scene.cameraFrom;
+	for (int i = 0; i < count; i++) {
+		CostScope cost(costs != nullptr ? &costs[i] : nullptr);
+		hits[i] = visibleHit(samples[i]);
+		initial[i] = Reservoir();
+		if (samples[i].prim < 0) {
+			continue;
+		}
+		Intersection& hit = hits[i];
+		hit.complete(camRay(samples[i].x, samples[i].y), scene.materials);
+		Reservoir& r = initial[i] = sampleLights(hit, eye);
+		if (r.light >= 0) {
+			const std::shared_ptr<QuadLight>& light = scene.polyLights[r.light];
+			if (!visibility(hit.point, light->va + r.r1 * light->e1 + r.r2 * light->e2, light)) {
+				r.weightSum = 0;
+				r.W = 0;
+			}
+		}
+		Reservoir previous = reservoirHistory[(y0 + i / columns) * scene.width + x0 + i % columns];
+		if (previous.light >= 0 && previous.similar(hit.normal, hit.t)) {
+			// bounded so that old samples do not take over
+			previous.count = std::min(previous.count, RESERVOIR_HISTORY * r.count);
+			r.merge(previous, lightTarget(hit, eye, previous.light, previous.r1, previous.r2), dis(random));
+			r.finish();
+		}
+	}
+	std::uniform_int_distribution<int> offset(-scene.restirRadius, scene.restirRadius);
+	int rows = count / columns;
+	for (int i = 0; i < count; i++) {
+		CostScope cost(costs != nullptr ? &costs[i] : nullptr);
+		reused[i] = initial[i];
+		if (samples[i].prim < 0) {
+			reservoirHistory[(y0 + i / columns) * scene.width + x0 + i % columns] = Reservoir();
+			continue;
+		}
+		int merged = 0;
+		for (int k = 0; k < scene.restirNeighbors; k++) {
+			int cx = i % columns + offset(random);
+			int cy = i / columns + offset(random);
+			int j = cy * columns + cx;
+			if (cx < 0 || cx >= columns || cy < 0 || cy >= rows || j == i) {
+				continue;
+			}
+			const Reservoir& neighbor = initial[j];
+			if (neighbor.light < 0 || !neighbor.similar(hits[i].normal, hits[i].t)) {
+				continue;
+			}
+			reused[i].merge(neighbor, lightTarget(hits[i], eye, neighbor.light, neighbor.r1, neighbor.r2), dis(random));
+			neighbors[merged++] = j;
+		}
+		// only the neighbours whose hits could have produced the kept sample count
+		const Reservoir& r = reused[i];
+		double candidates = initial[i].count;
+		for (int k = 0; k < merged && r.light >= 0; k++) {
+			if (lightTarget(hits[neighbors[k]], eye, r.light, r.r1, r.r2) > 0) {
+				candidates += initial[neighbors[k]].count;
+			}
+		}
+		reused[i].finish(candidates);
+		reservoirHistory[(y0 + i / columns) * scene.width + x0 + i % columns] = reused[i];
+	}
+	return reused;
+}
+
+Eigen::Array3d PathTracer::indirectDiffuse(const Intersection& hit)
+{
+	if (hit.mat->diffuse.sum() < eps) {
+		return Eigen::Array3d(0, 0, 0);
+	}
+	const Eigen::Vector3d& point = hit.point;
+	const Eigen::Vector3d& n = hit.normal;
+	Eigen::Array3d E;
+	if (irradianceCache == nullptr) {
+		E = sampleIrradiance(point, n).E;
+	}
+	else if (!irradianceCache->lookup(point, n, E) && (cacheStage == nullptr || !cacheStage->lookup(point, n, E))) {
+		IrradianceRecord record = sampleIrradiance(point, n);
+		(cacheStage != nullptr ? *cacheStage : *irradianceCache).add(record);
+		E = record.E;
+	}
+	return hit.mat->diffuse / PI * E;
+}
+
+// Stratified cosine-weighted hemisphere sampling of the light reflected by
+// other surfaces, with the gradient estimates of Ward and Heckbert (1992)
+IrradianceRecord PathTracer::sampleIrradiance(Eigen::Vector3d point, Eigen::Vector3d n)
+{
+	int M = std::max(2, (int)std::round(std::sqrt(scene.indirect / PI)));
+	int N = std::max(3, (int)std::round(PI * M));
+	Eigen::Vector3d t = (std::abs(n[0]) > 0.9 ? Eigen::Vector3d(0, 1, 0) : Eigen::Vector3d(1, 0, 0)).cross(n).normalized();
+	Eigen::Vector3d b = n.cross(t);
+	std::uniform_real_distribution<double> dis(0, 1.0);
+	ArenaScope scope(Arena::local());
+	Eigen::Array3d* L = Arena::local().allocate<Eigen::Array3d>(M * N);
+	double* R = Arena::local().allocate<double>(M * N);
+	double* tanTheta = Arena::local().allocate<double>(M * N);
+	double maxDist = !scene.bounds.isEmpty() ? scene.bounds.diagonal().norm() : 1e6;
+
+	IrradianceRecord record;
+	record.p = point;
+	record.n = n;
+	record.E.setZero();
+	double invDist = 0;
+	for (int j = 0; j < M; j++) {
+		for (int k = 0; k < N; k++) {
+			double sinTheta = std::sqrt((j + dis(random)) / M);
+			double cosTheta = std::sqrt(1 - sinTheta * sinTheta);
+			double phi = 2 * PI * (k + dis(random)) / N;
+			Eigen::Vector3d dir = (std::cos(phi) * t + std::sin(phi) * b) * sinTheta + cosTheta * n;
+			Ray ray(point + eps * dir, dir);
+			Intersection hit = intersect(ray);
+			int s = j * N + k;
+			L[s].setZero();
+			R[s] = maxDist;
+			if (hit.prim != nullptr) {
+				hit.complete(ray, scene.materials);
+				L[s] = hit.mat->emission + direct(hit, point);
+				R[s] = std::min(hit.t, maxDist);
+			}
+			tanTheta[s] = sinTheta / std::max(cosTheta, eps);
+			record.E += L[s];
+			invDist += 1 / R[s];
+		}
+	}
+	record.E *= PI / (M * N);
+	record.R = std::clamp(M * N / invDist, maxDist * 1e-3, maxDist * 0.1);
+
+	for (int k = 0; k < N; k++) {
+		double phiK = 2 * PI * (k + 0.5) / N;
+		double phiKm = 2 * PI * k / N;
+		Eigen::Vector3d u = std::cos(phiK) * t + std::sin(phiK) * b;
+		Eigen::Vector3d v = -std::sin(phiK) * t + std::cos(phiK) * b;
+		Eigen::Vector3d vm = -std::sin(phiKm) * t + std::cos(phiKm) * b;
+		int km = (k + N - 1) % N;
+		for (int j = 0; j < M; j++) {
+			int s = j * N + k;
+			double sinLo = std::sqrt((double)j / M);
+			double cosLo = std::sqrt(1 - (double)j / M);
+			double cosHi = std::sqrt(1 - (double)(j + 1) / M);
+			// rotation
+			record.gradR += (-tanTheta[s] * L[s]).matrix() * v.transpose() * PI / (M * N);
+			// translation across theta and phi strata boundaries
+			if (j > 0) {
+				int sm = (j - 1) * N + k;
+				double w = 2 * PI / N * sinLo * cosLo * cosLo / std::min(R[s], R[sm]);
+				record.gradT += (w * (L[s] - L[sm])).matrix() * u.transpose();
+			}
+			int sk = j * N + km;
+			double w = (cosLo - cosHi) / std::min(R[s], R[sk]);
+			record.gradT += (w * (L[s] - L[sk])).matrix() * vm.transpose();
+		}
+	}
+	return record;
+}
+
 Ray PathTracer::camRay(int x, int y)
+{
+	return camRay(x + 0.5, y + 0.5);
+}
+
+// ray through the continuous image position (dx, dy)
+Ray PathTracer::camRay(double dx, double dy)
 {
 	Eigen::Vector3d w, u, v;
 	w = (scene.cameraFrom - scene.cameraAt).normalized();
@@ -218,73 +623,506 @@ Ray PathTracer::camRay(int x, int y)
 	v = w.cross(u);
 	double hfov, alpha, beta;
 	hfov = tan(scene.fov * PI / 180 / 2);
-	double dx = x + 0.5;
-	double dy = y + 0.5;
 	alpha = hfov * scene.aspect * (2.0f * dx / scene.width - 1);
 	beta = hfov * (1 - 2.0f * dy / scene.height);
 	return Ray(scene.cameraFrom, alpha * u + beta * v - w);
 }
 
-Eigen::Array3d PathTracer::integratorDispatch(Eigen::Vector3d point, std::shared_ptr<Primitive> prim, int bounce, Eigen::Vector3d eye) {
+Eigen::Array3d PathTracer::integratorDispatch(const Intersection& hit, int bounce, Eigen::Vector3d eye, const Reservoir* reservoir) {
 	if (scene.integrator == "raytracer") {
-		return raytracer(point, prim, bounce, eye);
+		return raytracer(hit, bounce, eye);
 	}
 	else if (scene.integrator == "analyticdirect") {
-		return analytic(point, prim);
+		return analytic(hit);
 	}
 	else if (scene.integrator == "direct") {
-		return direct(point, prim, eye);
+		if (scene.indirect > 0) {
+			return direct(hit, eye, reservoir) + indirectDiffuse(hit);
+		}
+		return direct(hit, eye, reservoir);
 	}
 	return Eigen::Array3d(0, 0, 0);
 }
 
+// shades one camera ray, records the first hit features when asked
+Eigen::Vector3d PathTracer::shadeSample(Ray cameraRay, int pixel, bool recordFeatures)
+{
+	VisibilitySample sample;
+	traceVisibility(cameraRay, sample);
+	return shadeVisible(cameraRay, sample, pixel, recordFeatures);
+}
+
+void PathTracer::traceVisibility(const Ray& cameraRay, VisibilitySample& sample)
+{
+	CounterScope counting(PhasePrimary, 1);
+	// intersection test
+	Intersection hit = intersect(cameraRay);
+	sample.t = hit.t;
+	sample.prim = hit.prim != nullptr ? hit.prim->id : -1;
+	sample.light = -1;
+	sample.uv = hit.uv;
+	sample.element = hit.element;
+
+	double lightDepth = -1.0;
+	double lt = -1.0;
+	int light = -1;
+	pixelTests += scene.polyLights.size();
+	for (int l = 0; l < (int)scene.polyLights.size(); l++) {
+		lt = scene.polyLights[l]->intersect(cameraRay);
+		if (lt > 0 && (lt < lightDepth || lightDepth < 0)) {
+			lightDepth = lt;
+			light = l;
+		}
+	}
+	if (light >= 0 && (lightDepth < hit.t || hit.t == -1)) {
+		sample.t = lightDepth;
+		sample.prim = -1;
+		sample.light = light;
+	}
+}
+
+Intersection PathTracer::visibleHit(const VisibilitySample& sample)
+{
+	Intersection hit;
+	if (sample.prim >= 0) {
+		hit.t = sample.t;
+		hit.prim = scene.primitives[sample.prim].get();
+		hit.uv = sample.uv;
+		hit.element = sample.element;
+	}
+	return hit;
+}
+
+Eigen::Vector3d PathTracer::shadeVisible(const Ray& cameraRay, const VisibilitySample& sample, int pixel, bool recordFeatures, const Reservoir* reservoir)
+{
+	Eigen::Vector3d shade(0, 0, 0);
+	if (sample.light >= 0) {
+		const QuadLight& light = *scene.polyLights[sample.light];
+		shade = light.c;
+		if (recordFeatures) {
+			gbuffer.setFeatures(pixel, Eigen::Array3d(1, 1, 1), light.n, sample.t);
+			gbuffer.setContributions(pixel, shade, Eigen::Vector3d(0, 0, 0));
+		}
+	} 
+	else if (sample.prim >= 0) {
+		Intersection hit = visibleHit(sample);
+		hit.complete(cameraRay, scene.materials);
+		if (recordFeatures && scene.integrator == "raytracer") {
+			// same work as raytracer(), kept apart for the direct/reflected layers
+			Eigen::Vector3d local = raytracerLocal(hit, scene.cameraFrom);
+			Eigen::Vector3d reflected = raytracerReflection(hit, scene.maxdepth, scene.cameraFrom);
+			shade = local + reflected;
+			gbuffer.setContributions(pixel, local, reflected);
+		}
+		else {
+			shade = integratorDispatch(hit, scene.maxdepth, scene.cameraFrom, reservoir);
+			if (recordFeatures) {
+				gbuffer.setContributions(pixel, shade, Eigen::Vector3d(0, 0, 0));
+			}
+		}
+		if (recordFeatures) {
+			gbuffer.setFeatures(pixel, hit.mat->diffuse, hit.normal, hit.t);
+			gbuffer.setIds(pixel, hit.prim->id, hit.material);
+		}
+	}
+	return shade;
+}
+
+void PathTracer::beginRender()
+{
+	int pixels = scene.height * scene.width;
+	accum.assign(pixels, Eigen::Array3d(0, 0, 0));
+	lumSq.assign(pixels, 0);
+	sampleCount.assign(pixels, 0);
+	if (!scene.heatmap.empty()) {
+		heat.assign(pixels, 0);
+	}
+	if (scene.denoise > 0 || !scene.aovs.empty()) {
+		gbuffer.resize(scene.width, scene.height);
+	}
+	if (rasterizer != nullptr) {
+		rasterizer->bin(threads);
+	}
+	// kept across frames, stale reservoirs fail the similarity test of the pixel's new hit
+	if (scene.restirCandidates > 0 && reservoirHistory.size() != (size_t)pixels) {
+		reservoirHistory.assign(pixels, Reservoir());
+	}
+	rayCount = 0;
+	cutLights = 0;
+	cuts = 0;
+	warmupAllocations = 0;
+	loopAllocations = 0;
+}
+
+void PathTracer::flushRays()
+{
+	rayCount += threadRays;
+	threadRays = 0;
+	cutLights += threadCutLights;
+	cuts += threadCuts;
+	threadCutLights = 0;
+	threadCuts = 0;
+	// tiles and chunks are also where paged geometry ages and releases its chunks
+	if (scene.paged != nullptr) {
+		scene.paged->flush();
+	}
+}
+
+void PathTracer::clipRegion(int& x0, int& y0, int& x1, int& y1)
+{
+	x0 = 0;
+	y0 = 0;
+	x1 = scene.width;
+	y1 = scene.height;
+	if (regionWidth > 0 && regionHeight > 0) {
+		x0 = std::clamp(regionX, 0, scene.width);
+		y0 = std::clamp(regionY, 0, scene.height);
+		x1 = std::clamp(regionX + regionWidth, x0, scene.width);
+		y1 = std::clamp(regionY + regionHeight, y0, scene.height);
+	}
+}
+
+void PathTracer::renderTile(int tile, int pass)
+{
+	TraceScope scope("tile", "tile", tile);
+	int tilesX = (scene.width + TILE_SIZE - 1) / TILE_SIZE;
+	int x0 = (tile % tilesX) * TILE_SIZE;
+	int y0 = (tile / tilesX) * TILE_SIZE;
+	int rx0, ry0, rx1, ry1;
+	clipRegion(rx0, ry0, rx1, ry1);
+	// seeded per tile and pass so the image does not depend on thread scheduling
+	random.seed((unsigned)seed ^ (tile * 0x9E3779B9u + pass * 0x85EBCA6Bu));
+	std::uniform_real_distribution<double> dis(0, 1.0);
+	bool recordHeat = !heat.empty();
+	bool recordFeatures = pass == 0 && !gbuffer.depth.empty();
+	long long allocationsBefore = heapAllocations();
+	int xBegin = std::max(x0, rx0), xEnd = std::min(x0 + TILE_SIZE, rx1);
+	int yBegin = std::max(y0, ry0), yEnd = std::min(y0 + TILE_SIZE, ry1);
+	// everything but the primary and shadow rays of the tile
+	CounterScope counting(PhaseShading, std::max(xEnd - xBegin, 0) * std::max(yEnd - yBegin, 0));
+
+	// rasterized visibility and resampling work on the whole tile, its sample positions are drawn first
+	bool resample = scene.integrator == "direct" && scene.restirCandidates > 0 && !lightCdf.empty();
+	VisibilitySample samples[TILE_SIZE * TILE_SIZE];
+	// work done for the samples before shading, for the heatmap
+	SampleCost costs[TILE_SIZE * TILE_SIZE];
+	SampleCost* sampleCosts = recordHeat ? costs : nullptr;
+	Reservoir* reservoirs = nullptr;
+	ArenaScope tileScratch(Arena::local());
+	int sample = 0;
+	if (rasterizer != nullptr || resample) {
+		for (int y = yBegin; y < yEnd; y++) {
+			for (int x = xBegin; x < xEnd; x++) {
+				samples[sample].x = pass == 0 ? x + 0.5 : x + dis(random);
+				samples[sample].y = pass == 0 ? y + 0.5 : y + dis(random);
+				sample++;
+			}
+		}
+		if (rasterizer != nullptr) {
+			TraceScope raster("raster");
+			CounterScope rasterCounting(PhasePrimary, sample);
+			auto rasterBegin = std::chrono::steady_clock::now();
+			long long tests[TILE_SIZE * TILE_SIZE] = {};
+			rasterizer->rasterize(tile, samples, sample, recordHeat ? tests : nullptr);
+			if (recordHeat) {
+				// the tile is rasterized at once, its time is shared evenly
+				double micros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - rasterBegin).count() / sample;
+				for (int i = 0; i < sample; i++) {
+					costs[i].tests += tests[i];
+					costs[i].micros += micros;
+				}
+			}
+		}
+		else {
+			for (int i = 0; i < sample; i++) {
+				CostScope cost(sampleCosts != nullptr ? &sampleCosts[i] : nullptr);
+				traceVisibility(camRay(samples[i].x, samples[i].y), samples[i]);
+			}
+		}
+		if (resample) {
+			reservoirs = resampleTile(samples, xBegin, yBegin, xEnd - xBegin, sample, sampleCosts);
+		}
+		sample = 0;
+	}
+
+	for (int y = yBegin; y < yEnd; y++) {
+		for (int x = xBegin; x < xEnd; x++) {
+			int p = y * scene.width + x;
+			auto pixelBegin = std::chrono::steady_clock::now();
+			// scratch memory of the sample is released when it is done
+			ArenaScope scratch(Arena::local());
+			pixelSteps = 0;
+			pixelTests = 0;
+			Eigen::Array3d shade;
+			SampleCost cost;
+			if (rasterizer != nullptr || resample) {
+				cost = costs[sample];
+				const VisibilitySample& visible = samples[sample];
+				shade = shadeVisible(camRay(visible.x, visible.y), visible, p, recordFeatures, reservoirs != nullptr ? &reservoirs[sample] : nullptr);
+				sample++;
+			}
+			else {
+				// camera (primary) ray generation, jittered after the first pass
+				Ray cameraRay = pass == 0 ? camRay(x, y) : camRay(x + dis(random), y + dis(random));
+				shade = shadeSample(cameraRay, p, recordFeatures);
+			}
+
+			accum[p] += shade;
+			double lum = shade.sum() / 3;
+			lumSq[p] += lum * lum;
+			sampleCount[p]++;
+
+			if (recordHeat) {
+				if (scene.heatmap == "time") {
+					heat[p] += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - pixelBegin).count() + cost.micros;
+				}
+				else if (scene.heatmap == "tests") {
+					heat[p] += pixelTests + cost.tests;
+				}
+				else {
+					heat[p] += pixelSteps + cost.steps;
+				}
+			}
+		}
+	}
+	flushRays();
+	(pass == 0 ? warmupAllocations : loopAllocations) += heapAllocations() - allocationsBefore;
+}
+
+bool PathTracer::renderPass(int pass, std::chrono::steady_clock::time_point deadline, std::function<void(double)> progress)
+{
+	TraceScope scope("pass", "pass", pass);
+	int x0, y0, x1, y1;
+	clipRegion(x0, y0, x1, y1);
+	auto stopped = [&] { return cancelRequested || std::chrono::steady_clock::now() > deadline; };
+	if (wavefront != nullptr) {
+		// the stages are parallel inside each wave
+		std::vector<int> pixels;
+		for (int y = y0; y < y1; y++) {
+			for (int x = x0; x < x1; x++) {
+				pixels.push_back(y * scene.width + x);
+			}
+		}
+		for (int begin = 0; begin < (int)pixels.size(); begin += WAVE_SIZE) {
+			if (stopped()) {
+				return false;
+			}
+			int end = std::min(begin + WAVE_SIZE, (int)pixels.size());
+			wavefront->renderWave(std::vector<int>(pixels.begin() + begin, pixels.begin() + end), pass);
+			if (progress) {
+				progress((double)end / pixels.size());
+			}
+		}
+		return true;
+	}
+	// only the tiles overlapping the region
+	int tx0 = x0 / TILE_SIZE, ty0 = y0 / TILE_SIZE;
+	int tilesX = (scene.width + TILE_SIZE - 1) / TILE_SIZE;
+	int spanX = (x1 + TILE_SIZE - 1) / TILE_SIZE - tx0;
+	int spanY = (y1 + TILE_SIZE - 1) / TILE_SIZE - ty0;
+	int tiles = std::max(spanX, 0) * std::max(spanY, 0);
+	std::vector<int> order(tiles);
+	for (int t = 0; t < tiles; t++) {
+		order[t] = t;
+	}
+	if (scene.paged != nullptr) {
+		// Z-order keeps the tiles in flight next to each other, and so the chunks they page in
+		auto morton = [&](int t) {
+			uint32_t code = 0;
+			for (int b = 0; b < 16; b++) {
+				code |= ((t % spanX) >> b & 1) << (2 * b) | ((t / spanX) >> b & 1) << (2 * b + 1);
+			}
+			return code;
+		};
+		std::sort(order.begin(), order.end(), [&](int a, int b) { return morton(a) < morton(b); });
+	}
+	std::atomic<int> tilesDone = 0;
+	std::atomic<bool> complete = true;
+	std::mutex progressLock;
+	// the tiles of a round see the cache as the earlier rounds left it, and their own stage
+	bool staged = irradianceCache != nullptr;
+	int round = staged ? CACHE_ROUND_TILES : tiles;
+	for (int first = 0; first < tiles && complete; first += round) {
+		int count = std::min(round, tiles - first);
+		if (staged) {
+			openCacheStages(count);
+		}
+		parallelFor(0, count, [&](int k) {
+			if (stopped()) {
+				complete = false;
+				return;
+			}
+			int t = order[first + k];
+			cacheStage = staged ? cacheStages[k].get() : nullptr;
+			renderTile((ty0 + t / spanX) * tilesX + tx0 + t % spanX, pass);
+			cacheStage = nullptr;
+			int done = ++tilesDone;
+			if (progress) {
+				std::lock_guard<std::mutex> guard(progressLock);
+				progress((double)done / tiles);
+			}
+		}, threads);
+		if (staged) {
+			commitCacheStages(count);
+		}
+	}
+	return complete;
+}
+
+void PathTracer::openCacheStages(int count)
+{
+	while ((int)cacheStages.size() < count) {
+		cacheStages.push_back(std::make_unique<IrradianceCache>(scene.bounds, scene.cacheError));
+	}
+}
+
+void PathTracer::commitCacheStages(int count)
+{
+	for (int s = 0; s < count; s++) {
+		irradianceCache->take(*cacheStages[s]);
+	}
+}
+
+std::vector<Eigen::Array3d> PathTracer::resolveRadiance()
+{
+	return resolveRadiance(0, 0, scene.width, scene.height);
+}
+
+std::vector<Eigen::Array3d> PathTracer::resolveRadiance(int x0, int y0, int x1, int y1)
+{
+	TraceScope scope("radiance");
+	int width = x1 - x0;
+	int pixels = width * (y1 - y0);
+	std::vector<Eigen::Array3d> radiance(pixels);
+	for (int p = 0; p < pixels; p++) {
+		int q = (y0 + p / width) * scene.width + x0 + p % width;
+		radiance[p] = sampleCount[q] > 0 ? Eigen::Array3d(accum[q] / sampleCount[q]) : Eigen::Array3d(0, 0, 0);
+	}
+
+	if (scene.denoise > 0 && !gbuffer.depth.empty()) {
+		// the whole frame is filtered in place, a region in a copy of its rectangle
+		bool whole = pixels == scene.width * scene.height;
+		GBuffer cropped;
+		if (!whole) {
+			cropped = gbuffer.crop(x0, y0, width, y1 - y0);
+		}
+		GBuffer& g = whole ? gbuffer : cropped;
+		for (int p = 0; p < pixels; p++) {
+			g.setColor(p, radiance[p]);
+		}
+		DenoiseSettings settings;
+		settings.iterations = scene.denoise;
+		settings.threads = threads;
+		TraceScope denoising("denoise");
+		denoise(g, settings);
+		for (int p = 0; p < pixels; p++) {
+			radiance[p] = Eigen::Array3d(g.color[0][p], g.color[1][p], g.color[2][p]);
+		}
+	}
+	return radiance;
+}
+
+unsigned char* PathTracer::resolve()
+{
+	TraceScope scope("resolve");
+	std::vector<Eigen::Array3d> radiance = resolveRadiance();
+	auto canvas = new unsigned char[radiance.size() * 3];
+	for (int p = 0; p < (int)radiance.size(); p++) {
+		Eigen::Vector3d shade = radiance[p];
+		NormalizeColor(shade);
+		std::copy_n(shade.data(), 3, canvas + p * 3);
+	}
+	return canvas;
+}
+
+double PathTracer::noiseLevel()
+{
+	// mean over pixels of the relative standard error of the luminance estimate
+	double total = 0;
+	int counted = 0;
+	for (int p = 0; p < (int)accum.size(); p++) {
+		int n = sampleCount[p];
+		if (n < 2) {
+			continue;
+		}
+		double mean = accum[p].sum() / 3 / n;
+		double variance = std::max(lumSq[p] / n - mean * mean, 0.0) / (n - 1);
+		total += std::sqrt(variance) / std::max(mean, 1e-3);
+		counted++;
+	}
+	return counted > 0 ? total / counted : std::numeric_limits<double>::infinity();
+}
+
 unsigned char* PathTracer::pathTraceInit()
 {
-	auto canvas = new unsigned char[scene.height * scene.width * 3];
-	int x = 0, y = 0;
+	beginRender();
 	// setup progress bar
-	int onePercent = (scene.height * scene.width * 3) / 100;
 	progressbar bar(100);
 	bar.set_done_char("");
-
-	for (int i = 0; i < scene.height * scene.width * 3; i += 3) {
-		y = i / 3 / scene.width;
-		x = (i / 3) - (i / 3 / scene.width) * scene.width;
-		if (i % onePercent == 0) {
+	int percent = 0;
+	renderPass(0, std::chrono::steady_clock::time_point::max(), [&](double done) {
+		while (percent < (int)(done * 100)) {
 			bar.update();
+			percent++;
 		}
-		// camera (primary) ray generation
-		Ray cameraRay = camRay(x, y);
-
-		// intersection test
-		Intersection hit = intersect(cameraRay);
-		Eigen::Vector3d shade(0, 0, 0);
-
-		double lightDepth = -1.0;
-		double lt = -1.0;
-		std::shared_ptr<QuadLight> light = nullptr;
-		bool lightVisiility = false;
-		for (auto l: scene.polyLights) {
-			lt = l->intersect(cameraRay);
-			if (lt > 0 && (lt < lightDepth || lightDepth < 0)) {
-				lightDepth = lt;
-				light = l;
-			}
+	});
+	return resolve();
+}
+
+unsigned char* PathTracer::progressiveRender(ProgressiveSettings settings, std::function<void(unsigned char*)> snapshot)
+{
+	auto begin = std::chrono::steady_clock::now();
+	auto deadline = settings.timeLimit > 0 ? begin + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(settings.timeLimit))
+		: std::chrono::steady_clock::time_point::max();
+	auto lastSnapshot = begin;
+	beginRender();
+	int passLimit = settings.passLimit();
+	for (int pass = 0; passLimit <= 0 || pass < passLimit; pass++) {
+		bool complete = renderPass(pass, deadline, nullptr);
+		auto now = std::chrono::steady_clock::now();
+		double noise = noiseLevel();
+		std::cout << "\tPass " << pass + 1 << (complete ? "" : " (partial)") << ": "
+			<< std::chrono::duration<double>(now - begin).count() << "s, noise " << noise << std::endl;
+		if (!complete || now >= deadline || noise <= settings.targetNoise) {
+			break;
 		}
-		if (light != nullptr) {
-			lightVisiility = lightDepth < hit.t || hit.t == -1;
+		if (snapshot && settings.snapshotInterval > 0 && std::chrono::duration<double>(now - lastSnapshot).count() >= settings.snapshotInterval) {
+			snapshot(resolve());
+			lastSnapshot = now;
 		}
+	}
+	return resolve();
+}
 
-		if (lightVisiility) {
-			shade = light->c;
-		} 
-		else if (hit.prim != nullptr) {
-			Eigen::Vector3d point = cameraRay.p0 + hit.t * cameraRay.pt;
-			shade = integratorDispatch(point, hit.prim, scene.maxdepth, scene.cameraFrom);
-		}
+// false color ramp black-blue-cyan-green-yellow-red, written in canvas (BGR) order
+Eigen::Vector3d HeatColor(double t)
+{
+	const double stops[6][3] = { {0, 0, 0}, {0, 0, 1}, {0, 1, 1}, {0, 1, 0}, {1, 1, 0}, {1, 0, 0} };
+	t = std::clamp(t, 0.0, 1.0) * 5;
+	int k = std::min((int)t, 4);
+	double f = t - k;
+	Eigen::Vector3d rgb;
+	for (int c = 0; c < 3; c++) {
+		rgb[c] = stops[k][c] * (1 - f) + stops[k + 1][c] * f;
+	}
+	return Eigen::Vector3d(rgb[2], rgb[1], rgb[0]);
+}
 
-		NormalizeColor(shade);
-		std::copy_n(shade.data(), 3, canvas + i);
+unsigned char* PathTracer::heatmapCanvas()
+{
+	if (heat.empty()) {
+		return nullptr;
+	}
+	// normalize by the 99th percentile so a handful of outliers do not flatten the map
+	std::vector<double> sorted = heat;
+	size_t k = (sorted.size() - 1) * 99 / 100;
+	std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+	double scale = sorted[k] > 0 ? sorted[k] : 1;
+	auto canvas = new unsigned char[heat.size() * 3];
+	for (size_t p = 0; p < heat.size(); p++) {
+		Eigen::Vector3d color = HeatColor(heat[p] / scale);
+		NormalizeColor(color);
+		std::copy_n(color.data(), 3, canvas + p * 3);
 	}
 	return canvas;
 }
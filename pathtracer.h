@@ -1,8 +1,47 @@
 #pragma once
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
 #include "scene.h"
+#include "gbuffer.h"
+#include "analytic.h"
+#include "irradiancecache.h"
+#include "wavefront.h"
+#include "arena.h"
+#include "lighttree.h"
+#include "raster.h"
+#include "reservoir.h"
 #include "progressbar.hpp" // https://github.com/gipert/progressbar
 
+// radiance in [0, 1] to canvas values, brighter channels clamp at 255
+void NormalizeColor(Eigen::Vector3d& color);
+
+class ProgressiveSettings {
+public:
+	// wall-clock budget in seconds, 0 for none
+	double timeLimit = 0;
+	// stop once the mean relative standard error drops below this
+	double targetNoise = 0;
+	// seconds between best-so-far images, 0 to disable
+	double snapshotInterval = 0;
+	// 0 for no limit
+	int maxPasses = 0;
+	// pass limit when neither a time nor a pass limit is set, a noise target alone may never be met
+	static constexpr int TARGET_ONLY_MAX_PASSES = 1024;
+
+	// maxPasses, or TARGET_ONLY_MAX_PASSES when nothing else bounds the render
+	int passLimit() const { return maxPasses > 0 || timeLimit > 0 ? maxPasses : TARGET_ONLY_MAX_PASSES; }
+};
+
+// cost of the work done for a sample before it is shaded, added to its pixel's heatmap
+struct SampleCost {
+	long long steps = 0;
+	long long tests = 0;
+	double micros = 0;
+};
+
 class PathTracer {
 public:
 	Scene scene;
@@ -10,28 +49,150 @@ public:
 	PathTracer(Scene s, double randomSeed);
 	Intersection intersect(Ray ray);
 	Ray camRay(int x, int y);
-	Ray reflRay(Eigen::Vector3d point, std::shared_ptr<Primitive> prim, Eigen::Vector3d eye);
+	Ray camRay(double dx, double dy);
+	Ray reflRay(const Intersection& hit, Eigen::Vector3d eye);
 
 	// initialize shading process
 	unsigned char* pathTraceInit();
-	Eigen::Array3d integratorDispatch(Eigen::Vector3d point, std::shared_ptr<Primitive> prim, int bounce, Eigen::Vector3d eye);
+	// one sample per pixel per pass, in tile order, until the budget or noise target is reached;
+	// snapshot receives (and takes ownership of) intermediate images
+	unsigned char* progressiveRender(ProgressiveSettings settings, std::function<void(unsigned char*)> snapshot);
+	Eigen::Vector3d shadeSample(Ray cameraRay, int pixel, bool recordFeatures);
+	// what the camera ray sees first, the same as the rasterizer reports it
+	void traceVisibility(const Ray& cameraRay, VisibilitySample& sample);
+	// the intersection of a primitive seen by sample, not completed
+	Intersection visibleHit(const VisibilitySample& sample);
+	// shading of a resolved sample, with the final reservoir of its hit when resampling
+	Eigen::Vector3d shadeVisible(const Ray& cameraRay, const VisibilitySample& sample, int pixel, bool recordFeatures, const Reservoir* reservoir = nullptr);
+	// tiled rendering over the worker threads
+	void beginRender();
+	void renderTile(int tile, int pass);
+	// false if the deadline or a cancel request cut the pass short; progress receives
+	// the fraction of the pass done, one call at a time
+	bool renderPass(int pass, std::chrono::steady_clock::time_point deadline, std::function<void(double)> progress);
+	// pixel rectangle rendered by renderPass(), the whole image when empty
+	int regionX = 0;
+	int regionY = 0;
+	int regionWidth = 0;
+	int regionHeight = 0;
+	void clipRegion(int& x0, int& y0, int& x1, int& y1);
+	// checked between tiles, may be set from any thread
+	std::atomic<bool> cancelRequested = false;
+	// breadth-first engine, used by renderPass() when the scene asks for it
+	std::unique_ptr<Wavefront> wavefront;
+	// primary visibility for renderTile() when the scene rasterizes it, binned by beginRender()
+	std::unique_ptr<Rasterizer> rasterizer;
+	// mean of the accumulated samples per pixel, denoised when enabled
+	std::vector<Eigen::Array3d> resolveRadiance();
+	// the same for the pixels in [x0, x1) x [y0, y1) only, row by row; the
+	// denoiser filters just that rectangle, its edges clamp as the frame's do
+	std::vector<Eigen::Array3d> resolveRadiance(int x0, int y0, int x1, int y1);
+	// the same as a canvas
+	unsigned char* resolve();
+	double noiseLevel();
+	// shading functions take a hit completed with Intersection::complete()
+	Eigen::Array3d integratorDispatch(const Intersection& hit, int bounce, Eigen::Vector3d eye, const Reservoir* reservoir = nullptr);
 	// methods for raytracing
-	Eigen::Array3d raytracer(Eigen::Vector3d point, std::shared_ptr<Primitive> prim, int bounce, Eigen::Vector3d eye);
-	Eigen::Array3d diffuse(Eigen::Vector3d point, std::shared_ptr<Primitive> prim, std::shared_ptr<Light> light);
-	Eigen::Array3d specular(Eigen::Vector3d point, std::shared_ptr<Primitive> prim, std::shared_ptr<Light> light, Eigen::Vector3d eye);
-	bool visible(Eigen::Vector3d point, std::shared_ptr<Light> light);
+	Eigen::Array3d raytracer(const Intersection& hit, int bounce, Eigen::Vector3d eye);
+	Eigen::Array3d raytracerLocal(const Intersection& hit, Eigen::Vector3d eye);
+	Eigen::Array3d raytracerReflection(const Intersection& hit, int bounce, Eigen::Vector3d eye);
+	// light arriving from light, with its color replaced by the given one
+	Eigen::Array3d diffuse(const Intersection& hit, const Light& light, const Eigen::Array3d& lightColor);
+	Eigen::Array3d specular(const Intersection& hit, const Light& light, const Eigen::Array3d& lightColor, Eigen::Vector3d eye);
+	double attenuation(const Light& light, const Eigen::Vector3d& point);
+	// diffuse and specular over attenuation
+	Eigen::Array3d unshadowed(const Intersection& hit, const Light& light, const Eigen::Array3d& color, Eigen::Vector3d eye);
+	bool visible(Eigen::Vector3d point, const Light& light);
+	// lightcuts over the simple lights, built when the scene sets an error ratio
+	LightTree lightTree;
+	// writes the cut for hit to out, which holds scene.lightcutMax entries, and returns its size
+	int lightcut(const Intersection& hit, Eigen::Vector3d eye, CutLight* out);
 	// methods for analytic integrator
-	Eigen::Array3d analytic(Eigen::Vector3d r, std::shared_ptr<Primitive> prim);
+	Eigen::Array3d analytic(const Intersection& hit);
 	double theta(Eigen::Vector3d r, Eigen::Vector3d vk, Eigen::Vector3d vk1);
 	Eigen::Vector3d gamma(Eigen::Vector3d r, Eigen::Vector3d vk, Eigen::Vector3d vk1);
-	Eigen::Vector3d phi(Eigen::Vector3d r, std::shared_ptr<QuadLight> light);
-	// methods for direct monte carlo path tracing
-	Eigen::Array3d direct(Eigen::Vector3d point, std::shared_ptr<Primitive> prim, Eigen::Vector3d eye);
-	bool visibility(Eigen::Vector3d x1, Eigen::Vector3d x2, std::shared_ptr<Primitive> prim, std::shared_ptr<QuadLight> light);
-	double geometry(std::shared_ptr<Primitive> prim, std::shared_ptr<QuadLight> light, Eigen::Vector3d x1, Eigen::Vector3d x2);
-	Eigen::Array3d phoneBRDF(std::shared_ptr<Primitive> prim, Eigen::Vector3d eye, Eigen::Vector3d x1, Eigen::Vector3d x2);
+	Eigen::Vector3d phi(Eigen::Vector3d r, const std::shared_ptr<QuadLight>& light);
+	// polyLights as SoA vertex loops for the batched kernel
+	LightBatch lightBatch;
+	// largest relative difference between the batched and scalar kernel ("check" mode)
+	double analyticError = 0;
+	// what analyticError may reach, the regression scene analytic_check fails above it;
+	// the batched kernel measures about 4e-3 there, from cancellation near light edges
+	static constexpr double ANALYTIC_ERROR_BOUND = 1e-2;
+	std::mutex statsLock;
+	// methods for direct monte carlo path tracing, resampled from reservoir when given
+	Eigen::Array3d direct(const Intersection& hit, Eigen::Vector3d eye, const Reservoir* reservoir = nullptr);
+	bool visibility(Eigen::Vector3d x1, Eigen::Vector3d x2, const std::shared_ptr<QuadLight>& light);
+	double geometry(const Intersection& hit, const std::shared_ptr<QuadLight>& light, Eigen::Vector3d x2);
+	Eigen::Array3d phoneBRDF(const Intersection& hit, Eigen::Vector3d eye, Eigen::Vector3d x2);
+	// methods for resampled direct lighting
+	// luminance of the unshadowed contribution of a light sample, the contribution itself in f
+	double lightTarget(const Intersection& hit, Eigen::Vector3d eye, int light, double r1, double r2, Eigen::Array3d* f = nullptr);
+	// streams scene.restirCandidates light samples, picked by power, into a reservoir for hit
+	Reservoir sampleLights(const Intersection& hit, Eigen::Vector3d eye);
+	// the reservoir's sample times its weight, one shadow ray
+	Eigen::Array3d shadeReservoir(const Intersection& hit, Eigen::Vector3d eye, const Reservoir& reservoir);
+	// final reservoirs of the primary hits of a tile's samples, rows of columns samples from
+	// pixel (x0, y0); arena memory of the caller. The work for each sample goes to costs, if given
+	Reservoir* resampleTile(const VisibilitySample* samples, int x0, int y0, int columns, int count, SampleCost* costs = nullptr);
+	// running sum of the power of polyLights
+	std::vector<double> lightCdf;
+	// final reservoir of each pixel in the last pass, reused by the next pass and frame
+	std::vector<Reservoir> reservoirHistory;
+	// one bounce diffuse interreflection, through the irradiance cache when enabled
+	Eigen::Array3d indirectDiffuse(const Intersection& hit);
+	IrradianceRecord sampleIrradiance(Eigen::Vector3d point, Eigen::Vector3d n);
+	std::unique_ptr<IrradianceCache> irradianceCache;
+	// records made by a tile or wavefront chunk go to its own stage, the stages join
+	// irradianceCache in a fixed order after each round of work; indirectDiffuse()
+	// reads the calling thread's stage after the cache
+	std::vector<std::unique_ptr<IrradianceCache>> cacheStages;
+	static thread_local IrradianceCache* cacheStage;
+	// at least count stages, all empty, for a round of work
+	void openCacheStages(int count);
+	// moves the records of the first count stages to irradianceCache, stage by stage
+	void commitCacheStages(int count);
+	// per-pixel cost heatmap
+	unsigned char* heatmapCanvas();
+	// camera pass feature buffers, filled when denoising or writing AOVs
+	GBuffer gbuffer;
 	//utils
 
 	double seed;
-	std::mt19937 random;
+	// threads of this tracer's parallel loops, 0 for the hardware concurrency
+	int threads = 0;
+	// per worker thread, reseeded for every tile
+	static thread_local std::mt19937 random;
+	// traversal cost accumulated by intersect() for the current pixel
+	static thread_local long long pixelSteps;
+	static thread_local long long pixelTests;
+	// adds the traversal cost and time of its lifetime to cost, nothing when cost is null;
+	// for the work done on a tile's samples before they are shaded
+	class CostScope {
+	public:
+		CostScope(SampleCost* cost);
+		~CostScope();
+
+	private:
+		SampleCost* cost;
+		std::chrono::steady_clock::time_point begin;
+	};
+	// rays traced by intersect() and lights in light cuts on this thread since the last flushRays()
+	static thread_local long long threadRays;
+	static thread_local long long threadCutLights;
+	static thread_local long long threadCuts;
+	// the same for the current render, summed from the workers as they finish tiles or chunks
+	std::atomic<long long> rayCount = 0;
+	std::atomic<long long> cutLights = 0;
+	std::atomic<long long> cuts = 0;
+	void flushRays();
+	// heap allocations made by renderTile() in the first pass, which warms up the
+	// per-thread scratch, and in later passes; counted in MPT_COUNT_ALLOCATIONS builds
+	std::atomic<long long> warmupAllocations = 0;
+	std::atomic<long long> loopAllocations = 0;
+	std::vector<double> heat;
+	// progressive accumulation: radiance sum, luminance sum of squares and sample count per pixel
+	std::vector<Eigen::Array3d> accum;
+	std::vector<double> lumSq;
+	std::vector<int> sampleCount;
 };
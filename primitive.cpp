@@ -10,11 +10,10 @@ Ray::Ray(Eigen::Vector3d v0, Eigen::Vector3d vt)
 }
 
 // Sphere methods
-Sphere::Sphere(Eigen::Vector3d center, double radius, Material material, Eigen::Transform<double, 3, Eigen::Affine> transformation, bool trans_flag)
+Sphere::Sphere(Eigen::Vector3d center, double radius, Eigen::Transform<double, 3, Eigen::Affine> transformation, bool trans_flag)
 {
 	o = center;
 	r = radius;
-	mat = material;
 	Eigen::Vector3d min_corner, max_corner;
 	min_corner = o.array() - r;
 	max_corner = o.array() + r;
@@ -23,15 +22,30 @@ Sphere::Sphere(Eigen::Vector3d center, double radius, Material material, Eigen::
 		transformed = true;
 		trans = transformation;
 		bbox.transform(trans);
+		invTrans = trans.inverse();
+		normalTrans = trans.linear().inverse().transpose();
 	}
 }
 
-double Sphere::intersect(Ray ray)
+void Sphere::transform(const Eigen::Affine3d& t)
+{
+	trans = t * trans;
+	transformed = true;
+	Eigen::Vector3d min_corner, max_corner;
+	min_corner = o.array() - r;
+	max_corner = o.array() + r;
+	bbox = Eigen::AlignedBox3d(min_corner, max_corner);
+	bbox.transform(trans);
+	invTrans = trans.inverse();
+	normalTrans = trans.linear().inverse().transpose();
+}
+
+double Sphere::intersect(const Ray& ray, Eigen::Vector2d*, int*)
 {
 	Ray newRay = ray;
 	if (transformed) {
-		newRay.p0 = trans.inverse() * ray.p0;
-		newRay.pt = trans.inverse().linear() * ray.pt;
+		newRay.p0 = invTrans * ray.p0;
+		newRay.pt = invTrans.linear() * ray.pt;
 	}
 	double a, b, d;
 	a = newRay.pt.dot(newRay.pt);
@@ -48,27 +62,29 @@ double Sphere::intersect(Ray ray)
 	else return -1;
 }
 
-Eigen::Vector3d Sphere::normal(Eigen::Vector3d point)
+void Sphere::surface(Intersection& hit)
 {
-	
 	if (!transformed) {
-		Eigen::Vector3d normal = (point - o).normalized();
-		return normal;
+		hit.geometricNormal = (hit.point - o).normalized();
 	}
-	Eigen::Vector3d normal = trans.inverse() * point - o;
-	normal = trans.linear().inverse().transpose() * normal;
-	normal.normalize();
-	return normal;
+	else {
+		hit.geometricNormal = (normalTrans * (invTrans * hit.point - o)).normalized();
+	}
+	hit.normal = hit.geometricNormal;
 }
 
 // Triangle methods
-Triangle::Triangle(Eigen::Vector3d vertex0, Eigen::Vector3d vertex1, Eigen::Vector3d vertex2, Eigen::Transform<double, 3, Eigen::Affine > transformation, Material material)
+Triangle::Triangle(Eigen::Vector3d vertex0, Eigen::Vector3d vertex1, Eigen::Vector3d vertex2, Eigen::Transform<double, 3, Eigen::Affine > transformation)
 {
-	Eigen::Vector3d edge1, edge2;
 	v0 = transformation * vertex0;
 	v1 = transformation * vertex1;
 	v2 = transformation * vertex2;
-	mat = material;
+	update();
+}
+
+void Triangle::update()
+{
+	Eigen::Vector3d edge1, edge2;
 	edge1 = v1 - v0;
 	edge2 = v2 - v0;
 	n = edge1.cross(edge2);
@@ -85,7 +101,9 @@ Triangle::Triangle(Eigen::Vector3d vertex0, Eigen::Vector3d vertex1, Eigen::Vect
 	bbox = Eigen::AlignedBox3d(min_corner, max_corner);
 }
 
-Eigen::Vector3d Triangle::barycentric(Eigen::Vector3d point) {
+// weights of v0, v1 and v2 at a point in the plane, (-1, -1, -1) outside the triangle
+static Eigen::Vector3d barycentricWeights(const Eigen::Vector3d& v0, const Eigen::Vector3d& v1, const Eigen::Vector3d& v2, const Eigen::Vector3d& point)
+{
 	Eigen::Vector3d t0 = v1 - v0;
 	Eigen::Vector3d t1 = v2 - v0;
 	Eigen::Vector3d t2 = point - v0;
@@ -107,7 +125,7 @@ Eigen::Vector3d Triangle::barycentric(Eigen::Vector3d point) {
 	return Eigen::Vector3d(u, v, w);
 }
 
-double Triangle::intersect(Ray ray)
+double intersectTriangle(const Eigen::Vector3d& v0, const Eigen::Vector3d& v1, const Eigen::Vector3d& v2, const Eigen::Vector3d& n, const Ray& ray, Eigen::Vector2d* uv)
 {
 	//ray-plane intersection
 	double t = ray.pt.dot(n);
@@ -119,16 +137,73 @@ double Triangle::intersect(Ray ray)
 		return -1;
 	}
 	// point inside triangle
-	Eigen::Vector3d bary = barycentric(Eigen::Vector3d(ray.p0 + t * ray.pt));
+	Eigen::Vector3d bary = barycentricWeights(v0, v1, v2, Eigen::Vector3d(ray.p0 + t * ray.pt));
 	if (bary[0] == -1) {
 		return -1;
 	}
+	if (uv != nullptr) {
+		*uv = Eigen::Vector2d(bary[1], bary[2]);
+	}
 	return t;
 }
 
-Eigen::Vector3d Triangle::normal(Eigen::Vector3d point)
+Eigen::Vector3d Triangle::barycentric(Eigen::Vector3d point)
+{
+	return barycentricWeights(v0, v1, v2, point);
+}
+
+double Triangle::intersect(const Ray& ray, Eigen::Vector2d* uv, int*)
 {
-	return n;
+	return intersectTriangle(v0, v1, v2, n, ray, uv);
+}
+
+void Triangle::surface(Intersection& hit)
+{
+	hit.geometricNormal = n;
+	hit.normal = n;
+}
+
+void Triangle::transform(const Eigen::Affine3d& t)
+{
+	v0 = t * v0;
+	v1 = t * v1;
+	v2 = t * v2;
+	update();
+}
+
+Eigen::AlignedBox3d Triangle::clippedBox(const Eigen::AlignedBox3d& box)
+{
+	// Sutherland-Hodgman against the six planes, a triangle gains at most one vertex per plane
+	Eigen::Vector3d polygon[9] = { v0, v1, v2 };
+	Eigen::Vector3d clipped[9];
+	int count = 3;
+	for (int plane = 0; plane < 6 && count > 0; plane++) {
+		int axis = plane / 2;
+		bool upper = plane % 2 == 1;
+		double bound = upper ? box.max()[axis] : box.min()[axis];
+		auto inside = [&](const Eigen::Vector3d& p) { return upper ? p[axis] <= bound : p[axis] >= bound; };
+		int kept = 0;
+		for (int i = 0; i < count; i++) {
+			const Eigen::Vector3d& a = polygon[i];
+			const Eigen::Vector3d& b = polygon[(i + 1) % count];
+			if (inside(a)) {
+				clipped[kept++] = a;
+			}
+			if (inside(a) != inside(b)) {
+				double t = (bound - a[axis]) / (b[axis] - a[axis]);
+				clipped[kept] = a + t * (b - a);
+				clipped[kept++][axis] = bound;
+			}
+		}
+		count = kept;
+		std::copy(clipped, clipped + count, polygon);
+	}
+	Eigen::AlignedBox3d result;
+	for (int i = 0; i < count; i++) {
+		result.extend(polygon[i]);
+	}
+	// rounding can leave the clipped points just outside the box
+	return result.intersection(box);
 }
 
 // TriNormal methods
@@ -139,8 +214,129 @@ void TriNormal::setNormal(Eigen::Vector3d normal0, Eigen::Vector3d normal1, Eige
 	n2 = normal2.normalized();
 }
 
-Eigen::Vector3d TriNormal::normal(Eigen::Vector3d point)
+void TriNormal::surface(Intersection& hit)
+{
+	double u = 1 - hit.uv[0] - hit.uv[1];
+	hit.geometricNormal = n;
+	hit.normal = (u * n0 + hit.uv[0] * n1 + hit.uv[1] * n2).normalized();
+}
+
+void TriNormal::transform(const Eigen::Affine3d& t)
 {
-	Eigen::Vector3d bary = barycentric(point);
-	return (bary[0] * n0 + bary[1] * n1 + bary[2] * n2).normalized();
+	Triangle::transform(t);
+	Eigen::Matrix3d normalTrans = t.linear().inverse().transpose();
+	setNormal(normalTrans * n0, normalTrans * n1, normalTrans * n2);
+}
+
+// MeshGrid methods
+MeshGrid::MeshGrid(const Eigen::AlignedBox3d& bounds)
+{
+	origin = bounds.min();
+	step = bounds.sizes() / 65535.0;
+}
+
+void MeshGrid::encode(const Eigen::Vector3d& p, uint16_t* code) const
+{
+	for (int a = 0; a < 3; a++) {
+		double q = step[a] > 0 ? std::round((p[a] - origin[a]) / step[a]) : 0;
+		code[a] = (uint16_t)std::clamp(q, 0.0, 65535.0);
+	}
+}
+
+Eigen::Vector3d MeshGrid::decode(const uint16_t* code) const
+{
+	return origin + Eigen::Vector3d(code[0] * step[0], code[1] * step[1], code[2] * step[2]);
+}
+
+uint32_t encodeNormal(const Eigen::Vector3d& n)
+{
+	// project onto the octahedron, the lower half folds over the diagonals
+	double l1 = std::abs(n[0]) + std::abs(n[1]) + std::abs(n[2]);
+	double x = l1 > 0 ? n[0] / l1 : 0;
+	double y = l1 > 0 ? n[1] / l1 : 0;
+	if (n[2] < 0) {
+		double fx = (1 - std::abs(y)) * (x >= 0 ? 1 : -1);
+		double fy = (1 - std::abs(x)) * (y >= 0 ? 1 : -1);
+		x = fx;
+		y = fy;
+	}
+	uint16_t qx = (uint16_t)(int16_t)std::round(std::clamp(x, -1.0, 1.0) * 32767);
+	uint16_t qy = (uint16_t)(int16_t)std::round(std::clamp(y, -1.0, 1.0) * 32767);
+	return (uint32_t)qx | (uint32_t)qy << 16;
+}
+
+Eigen::Vector3d decodeNormal(uint32_t code)
+{
+	double x = (int16_t)(code & 0xFFFF) / 32767.0;
+	double y = (int16_t)(code >> 16) / 32767.0;
+	double z = 1 - std::abs(x) - std::abs(y);
+	if (z < 0) {
+		double fx = (1 - std::abs(y)) * (x >= 0 ? 1 : -1);
+		double fy = (1 - std::abs(x)) * (y >= 0 ? 1 : -1);
+		x = fx;
+		y = fy;
+	}
+	return Eigen::Vector3d(x, y, z).normalized();
+}
+
+// CompressedTriNormal methods
+CompressedTriNormal::CompressedTriNormal(const TriNormal& face, const MeshGrid* g) : grid(g)
+{
+	id = face.id;
+	matId = face.matId;
+	Eigen::Vector3d vertices[3] = { face.v0, face.v1, face.v2 };
+	Eigen::Vector3d normals[3] = { face.n0, face.n1, face.n2 };
+	encode(vertices, normals);
+}
+
+void CompressedTriNormal::encode(const Eigen::Vector3d* vertices, const Eigen::Vector3d* normals)
+{
+	bbox.setEmpty();
+	for (int v = 0; v < 3; v++) {
+		grid->encode(vertices[v], position[v]);
+		normal[v] = encodeNormal(normals[v]);
+		bbox.extend(grid->decode(position[v]));
+	}
+}
+
+double CompressedTriNormal::intersect(const Ray& ray, Eigen::Vector2d* uv, int*)
+{
+	Eigen::Vector3d v0 = grid->decode(position[0]);
+	Eigen::Vector3d v1 = grid->decode(position[1]);
+	Eigen::Vector3d v2 = grid->decode(position[2]);
+	Eigen::Vector3d n = (v1 - v0).cross(v2 - v0).normalized();
+	return intersectTriangle(v0, v1, v2, n, ray, uv);
+}
+
+void CompressedTriNormal::surface(Intersection& hit)
+{
+	Eigen::Vector3d v0 = grid->decode(position[0]);
+	Eigen::Vector3d v1 = grid->decode(position[1]);
+	Eigen::Vector3d v2 = grid->decode(position[2]);
+	double u = 1 - hit.uv[0] - hit.uv[1];
+	hit.geometricNormal = (v1 - v0).cross(v2 - v0).normalized();
+	hit.normal = (u * decodeNormal(normal[0]) + hit.uv[0] * decodeNormal(normal[1]) + hit.uv[1] * decodeNormal(normal[2])).normalized();
+}
+
+void CompressedTriNormal::transform(const Eigen::Affine3d& t)
+{
+	Eigen::Matrix3d normalTrans = t.linear().inverse().transpose();
+	Eigen::Vector3d vertices[3], normals[3];
+	for (int v = 0; v < 3; v++) {
+		vertices[v] = t * grid->decode(position[v]);
+		normals[v] = (normalTrans * decodeNormal(normal[v])).normalized();
+	}
+	encode(vertices, normals);
+}
+
+// Intersection methods
+void Intersection::complete(const Ray& ray, const std::vector<Material>& materials)
+{
+	if (mat != nullptr || prim == nullptr) {
+		return;
+	}
+	point = ray.p0 + t * ray.pt;
+	material = prim->matId;
+	prim->surface(*this);
+	mat = &materials[material];
 }
\ No newline at end of file
@@ -3,11 +3,14 @@
 #include <Eigen/Core>
 #include <Eigen/Geometry>
 #include <string>
+#include <memory>
 #define _USE_MATH_DEFINES
 #include <math.h>
 #define PI M_PI
 #include <algorithm>
 #include <random>
+#include <cstdint>
+#include <vector>
 
 #define eps 1e-6
 
@@ -18,6 +21,11 @@ public:
 	Eigen::Array3d specualr = Eigen::Array3d(0, 0, 0);
 	double shininess = 0;
 	Eigen::Array3d emission = Eigen::Array3d(0, 0, 0);
+
+	bool operator==(const Material& other) const {
+		return (ambient == other.ambient).all() && (diffuse == other.diffuse).all() && (specualr == other.specualr).all()
+			&& shininess == other.shininess && (emission == other.emission).all();
+	}
 };
 
 class Ray {
@@ -28,13 +36,27 @@ public:
 	Ray(Eigen::Vector3d p0, Eigen::Vector3d pt);
 };
 
+class BVHnode;
+class Intersection;
+
 // abstract class for all primitives
 class Primitive {
 public:
-	Material mat;
 	Eigen::AlignedBox3d bbox;
-	virtual double intersect(Ray ray) = 0;
-	virtual Eigen::Vector3d normal(Eigen::Vector3d point) = 0;
+	// index in the scene and in its material table
+	int id = -1;
+	int matId = -1;
+	// BVH leaf holding this primitive, used for refitting
+	BVHnode* leaf = nullptr;
+	// distance along the ray or -1, uv receives the local hit coordinates when given;
+	// primitives made of several elements report the one hit in element
+	virtual double intersect(const Ray& ray, Eigen::Vector2d* uv = nullptr, int* element = nullptr) = 0;
+	// geometric and shading normal at hit.point from hit.uv
+	virtual void surface(Intersection& hit) = 0;
+	// applies a world space transformation and updates bbox
+	virtual void transform(const Eigen::Affine3d& t) = 0;
+	// bounds of the part of the primitive inside box, used by spatial splits
+	virtual Eigen::AlignedBox3d clippedBox(const Eigen::AlignedBox3d& box) { return bbox.intersection(box); }
 };
 
 class Sphere: public Primitive {
@@ -43,10 +65,14 @@ public:
 	double r;
 	bool transformed = false;
 	Eigen::Transform<double, 3, Eigen::Affine> trans = Eigen::Affine3d::Identity();
+	// kept in sync with trans
+	Eigen::Affine3d invTrans = Eigen::Affine3d::Identity();
+	Eigen::Matrix3d normalTrans = Eigen::Matrix3d::Identity();
 
-	Sphere(Eigen::Vector3d center, double radius, Material material, Eigen::Transform<double, 3, Eigen::Affine> transformation, bool trans_flag);
-	virtual double intersect(Ray ray);
-	virtual Eigen::Vector3d normal(Eigen::Vector3d point);
+	Sphere(Eigen::Vector3d center, double radius, Eigen::Transform<double, 3, Eigen::Affine> transformation, bool trans_flag);
+	virtual double intersect(const Ray& ray, Eigen::Vector2d* uv = nullptr, int* element = nullptr);
+	virtual void surface(Intersection& hit);
+	virtual void transform(const Eigen::Affine3d& t);
 };
 
 class Triangle: public Primitive {
@@ -56,10 +82,15 @@ public:
 	Eigen::Vector3d v2;
 	Eigen::Vector3d n;
 
-	Triangle(Eigen::Vector3d vertex0, Eigen::Vector3d vertex1, Eigen::Vector3d vertex2, Eigen::Transform<double, 3, Eigen::Affine > transformation, Material material);
+	Triangle(Eigen::Vector3d vertex0, Eigen::Vector3d vertex1, Eigen::Vector3d vertex2, Eigen::Transform<double, 3, Eigen::Affine > transformation);
 	Eigen::Vector3d barycentric(Eigen::Vector3d point);
-	virtual double intersect(Ray ray);
-	virtual Eigen::Vector3d normal(Eigen::Vector3d point);
+	// uv receives the barycentric weights of v1 and v2
+	virtual double intersect(const Ray& ray, Eigen::Vector2d* uv = nullptr, int* element = nullptr);
+	virtual void surface(Intersection& hit);
+	virtual void transform(const Eigen::Affine3d& t);
+	virtual Eigen::AlignedBox3d clippedBox(const Eigen::AlignedBox3d& box);
+	// recomputes n and bbox from the vertices
+	void update();
 };
 
 class TriNormal : public Triangle {
@@ -68,15 +99,76 @@ public:
 	Eigen::Vector3d n1;
 	Eigen::Vector3d n2;
 
-	TriNormal(Eigen::Vector3d vertex0, Eigen::Vector3d vertex1, Eigen::Vector3d vertex2, Eigen::Transform<double, 3, Eigen::Affine > transformation, Material material) :Triangle(vertex0, vertex1, vertex2, transformation, material) {
+	TriNormal(Eigen::Vector3d vertex0, Eigen::Vector3d vertex1, Eigen::Vector3d vertex2, Eigen::Transform<double, 3, Eigen::Affine > transformation) :Triangle(vertex0, vertex1, vertex2, transformation) {
 	};
 	void setNormal(Eigen::Vector3d normal0, Eigen::Vector3d normal1, Eigen::Vector3d normal2);
-	virtual Eigen::Vector3d normal(Eigen::Vector3d point);
+	virtual void surface(Intersection& hit);
+	virtual void transform(const Eigen::Affine3d& t);
+};
+
+// 16-bit grid over the bounds of one mesh, so the precision follows the size of
+// the mesh rather than of the scene. Vertices shared by faces of the mesh are
+// encoded to the same codes, so quantized meshes have no cracks.
+class MeshGrid {
+public:
+	Eigen::Vector3d origin;
+	// world units per step
+	Eigen::Vector3d step;
+
+	MeshGrid(const Eigen::AlignedBox3d& bounds);
+	void encode(const Eigen::Vector3d& p, uint16_t* code) const;
+	Eigen::Vector3d decode(const uint16_t* code) const;
+};
+
+// distance along the ray to the triangle with unit normal n or -1, uv receives the weights of v1 and v2
+double intersectTriangle(const Eigen::Vector3d& v0, const Eigen::Vector3d& v1, const Eigen::Vector3d& v2, const Eigen::Vector3d& n, const Ray& ray, Eigen::Vector2d* uv);
+
+// octahedral mapping of a unit vector to two 16-bit snorms packed in 32 bits
+uint32_t encodeNormal(const Eigen::Vector3d& n);
+Eigen::Vector3d decodeNormal(uint32_t code);
+
+// TriNormal stored with positions quantized on the MeshGrid of its mesh and
+// octahedral normals, decoded on each intersection and shading query. Only the
+// vertex data shrinks, from 168 to 38 bytes: the Primitive base (vtable, bbox,
+// ids, leaf) and the shared_ptr control block stay, so a face takes 136 bytes
+// instead of 264, about half.
+class CompressedTriNormal : public Primitive {
+public:
+	// owned by the scene
+	const MeshGrid* grid;
+	uint16_t position[3][3];
+	uint32_t normal[3];
+
+	CompressedTriNormal(const TriNormal& face, const MeshGrid* grid);
+	virtual double intersect(const Ray& ray, Eigen::Vector2d* uv = nullptr, int* element = nullptr);
+	virtual void surface(Intersection& hit);
+	// positions leaving the grid are clamped to its bounds
+	virtual void transform(const Eigen::Affine3d& t);
+
+private:
+	void encode(const Eigen::Vector3d* vertices, const Eigen::Vector3d* normals);
 };
 
 
 class Intersection {
 public:
 	double t = -1;
-	std::shared_ptr<Primitive> prim = nullptr;
+	// owned by the scene, a plain pointer so hits do not touch reference counts
+	Primitive* prim = nullptr;
+	// traversal cost of this query, used by the heatmap output
+	int nodes = 0;
+	int tests = 0;
+	// local coordinates reported by the primitive's intersection test
+	Eigen::Vector2d uv = Eigen::Vector2d::Zero();
+	int element = 0;
+	// filled by complete(), shading reads these instead of asking the primitive again
+	Eigen::Vector3d point = Eigen::Vector3d::Zero();
+	Eigen::Vector3d geometricNormal = Eigen::Vector3d::Zero();
+	Eigen::Vector3d normal = Eigen::Vector3d::Zero();
+	// index in the scene's material table, the primitive's unless surface() picked one
+	int material = -1;
+	const Material* mat = nullptr;
+
+	// fills the shading data for a hit of ray, once, looking the material up in materials
+	void complete(const Ray& ray, const std::vector<Material>& materials);
 };
\ No newline at end of file
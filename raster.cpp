@@ -0,0 +1,292 @@
+#include "raster.h"
+#include "parallel.h"
+#include "trace.h"
+
+// primitives projected and binned together by one worker
+constexpr int BIN_BLOCK = 4096;
+// triangles are clipped at this depth in front of the camera
+constexpr double NEAR_DEPTH = eps;
+
+Rasterizer::Rasterizer(const Scene& s, int size) : scene(s), tileSize(size)
+{
+}
+
+bool Rasterizer::supports(const Scene& scene)
+{
+	if (scene.paged != nullptr) {
+		return false;
+	}
+	for (const auto& p : scene.primitives) {
+		if (dynamic_cast<Triangle*>(p.get()) == nullptr && dynamic_cast<CompressedTriNormal*>(p.get()) == nullptr
+			&& dynamic_cast<Sphere*>(p.get()) == nullptr) {
+			return false;
+		}
+	}
+	return true;
+}
+
+Eigen::Vector3d Rasterizer::view(const Eigen::Vector3d& p) const
+{
+	Eigen::Vector3d d = p - eye;
+	return Eigen::Vector3d(d.dot(u), d.dot(v), -d.dot(w));
+}
+
+Eigen::Vector2d Rasterizer::project(const Eigen::Vector3d& c) const
+{
+	return Eigen::Vector2d((c[0] / c[2] / (hfov * scene.aspect) + 1) * scene.width / 2, (1 - c[1] / c[2] / hfov) * scene.height / 2);
+}
+
+void Rasterizer::setupTriangle(const Eigen::Vector3d* vertices, int prim, int light, std::vector<Setup>& out) const
+{
+	// camera space corners with the weights of v1 and v2, clipped against the near plane
+	Eigen::Vector3d corners[3], clipped[4];
+	Eigen::Vector2d weights[3] = { Eigen::Vector2d(0, 0), Eigen::Vector2d(1, 0), Eigen::Vector2d(0, 1) }, clippedWeights[4];
+	for (int i = 0; i < 3; i++) {
+		corners[i] = view(vertices[i]);
+	}
+	int n = 0;
+	for (int i = 0; i < 3; i++) {
+		int j = (i + 1) % 3;
+		bool in = corners[i][2] >= NEAR_DEPTH;
+		if (in) {
+			clipped[n] = corners[i];
+			clippedWeights[n++] = weights[i];
+		}
+		if (in != (corners[j][2] >= NEAR_DEPTH)) {
+			double s = (NEAR_DEPTH - corners[i][2]) / (corners[j][2] - corners[i][2]);
+			clipped[n] = corners[i] + s * (corners[j] - corners[i]);
+			clippedWeights[n++] = weights[i] + s * (weights[j] - weights[i]);
+		}
+	}
+	Eigen::Vector2d screen[4];
+	double attributes[4][3];
+	for (int i = 0; i < n; i++) {
+		screen[i] = project(clipped[i]);
+		attributes[i][0] = 1 / clipped[i][2];
+		attributes[i][1] = clippedWeights[i][0] / clipped[i][2];
+		attributes[i][2] = clippedWeights[i][1] / clipped[i][2];
+	}
+	// a fan over the clipped polygon
+	for (int k = 1; k + 1 < n; k++) {
+		int corner[3] = { 0, k, k + 1 };
+		const Eigen::Vector2d& p0 = screen[corner[0]];
+		const Eigen::Vector2d& p1 = screen[corner[1]];
+		const Eigen::Vector2d& p2 = screen[corner[2]];
+		double area = (p1[0] - p0[0]) * (p2[1] - p0[1]) - (p2[0] - p0[0]) * (p1[1] - p0[1]);
+		if (std::abs(area) < 1e-12) {
+			continue;
+		}
+		Setup s{};
+		for (int i = 0; i < 3; i++) {
+			const Eigen::Vector2d& pj = screen[corner[(i + 1) % 3]];
+			const Eigen::Vector2d& pk = screen[corner[(i + 2) % 3]];
+			s.edge[i][0] = (pj[1] - pk[1]) / area;
+			s.edge[i][1] = (pk[0] - pj[0]) / area;
+			s.edge[i][2] = (pj[0] * pk[1] - pk[0] * pj[1]) / area;
+		}
+		for (int a = 0; a < 3; a++) {
+			for (int c = 0; c < 3; c++) {
+				for (int i = 0; i < 3; i++) {
+					s.plane[a][c] += attributes[corner[i]][a] * s.edge[i][c];
+				}
+			}
+		}
+		s.x0 = std::min({ p0[0], p1[0], p2[0] });
+		s.y0 = std::min({ p0[1], p1[1], p2[1] });
+		s.x1 = std::max({ p0[0], p1[0], p2[0] });
+		s.y1 = std::max({ p0[1], p1[1], p2[1] });
+		s.prim = prim;
+		s.light = light;
+		s.sphere = false;
+		out.push_back(s);
+	}
+}
+
+void Rasterizer::setupSphere(const Primitive& sphere, int prim, std::vector<Setup>& out) const
+{
+	Setup s{};
+	s.prim = prim;
+	s.light = -1;
+	s.sphere = true;
+	s.x0 = s.y0 = std::numeric_limits<double>::infinity();
+	s.x1 = s.y1 = -std::numeric_limits<double>::infinity();
+	int behind = 0;
+	for (int c = 0; c < 8; c++) {
+		Eigen::Vector3d corner = view(sphere.bbox.corner((Eigen::AlignedBox3d::CornerType)c));
+		if (corner[2] < NEAR_DEPTH) {
+			behind++;
+			continue;
+		}
+		Eigen::Vector2d p = project(corner);
+		s.x0 = std::min(s.x0, p[0]);
+		s.y0 = std::min(s.y0, p[1]);
+		s.x1 = std::max(s.x1, p[0]);
+		s.y1 = std::max(s.y1, p[1]);
+	}
+	if (behind == 8) {
+		return;
+	}
+	// the camera is inside the bounds, any sample may see the sphere
+	if (behind > 0) {
+		s.x0 = s.y0 = 0;
+		s.x1 = scene.width;
+		s.y1 = scene.height;
+	}
+	out.push_back(s);
+}
+
+void Rasterizer::bin(int threads)
+{
+	TraceScope scope("bin", "primitives", scene.primitives.size());
+	// the camera frame of PathTracer::camRay()
+	eye = scene.cameraFrom;
+	w = (scene.cameraFrom - scene.cameraAt).normalized();
+	u = (scene.cameraUp.cross(w)).normalized();
+	v = w.cross(u);
+	hfov = tan(scene.fov * PI / 180 / 2);
+	tilesX = (scene.width + tileSize - 1) / tileSize;
+	tilesY = (scene.height + tileSize - 1) / tileSize;
+	int tiles = tilesX * tilesY;
+	auto tileRange = [&](const Setup& s, int& tx0, int& ty0, int& tx1, int& ty1) {
+		if (s.x1 < 0 || s.y1 < 0 || s.x0 > scene.width || s.y0 > scene.height) {
+			return false;
+		}
+		tx0 = (int)std::clamp(std::floor(s.x0 / tileSize), 0.0, tilesX - 1.0);
+		ty0 = (int)std::clamp(std::floor(s.y0 / tileSize), 0.0, tilesY - 1.0);
+		tx1 = (int)std::clamp(std::floor(s.x1 / tileSize), 0.0, tilesX - 1.0);
+		ty1 = (int)std::clamp(std::floor(s.y1 / tileSize), 0.0, tilesY - 1.0);
+		return true;
+	};
+
+	// quad lights come last so primitives win depth ties, as they do for camera rays
+	int items = scene.primitives.size() + scene.polyLights.size();
+	int blocks = (items + BIN_BLOCK - 1) / BIN_BLOCK;
+	std::vector<std::vector<Setup>> blockSetups(blocks);
+	std::vector<int> offsets((size_t)blocks * tiles, 0);
+	parallelFor(0, blocks, [&](int b) {
+		std::vector<Setup>& out = blockSetups[b];
+		for (int i = b * BIN_BLOCK; i < std::min((b + 1) * BIN_BLOCK, items); i++) {
+			if (i < (int)scene.primitives.size()) {
+				Primitive* p = scene.primitives[i].get();
+				if (auto triangle = dynamic_cast<Triangle*>(p)) {
+					Eigen::Vector3d vertices[3] = { triangle->v0, triangle->v1, triangle->v2 };
+					setupTriangle(vertices, i, -1, out);
+				}
+				else if (auto compressed = dynamic_cast<CompressedTriNormal*>(p)) {
+					Eigen::Vector3d vertices[3];
+					for (int k = 0; k < 3; k++) {
+						vertices[k] = compressed->grid->decode(compressed->position[k]);
+					}
+					setupTriangle(vertices, i, -1, out);
+				}
+				else {
+					setupSphere(*p, i, out);
+				}
+			}
+			else {
+				int l = i - scene.primitives.size();
+				const QuadLight& quad = *scene.polyLights[l];
+				Eigen::Vector3d first[3] = { quad.va, quad.vb, quad.vd };
+				Eigen::Vector3d second[3] = { quad.va, quad.vd, quad.vc };
+				setupTriangle(first, -1, l, out);
+				setupTriangle(second, -1, l, out);
+			}
+		}
+		int* counts = &offsets[(size_t)b * tiles];
+		int tx0, ty0, tx1, ty1;
+		for (const Setup& s : out) {
+			if (tileRange(s, tx0, ty0, tx1, ty1)) {
+				for (int ty = ty0; ty <= ty1; ty++) {
+					for (int tx = tx0; tx <= tx1; tx++) {
+						counts[ty * tilesX + tx]++;
+					}
+				}
+			}
+		}
+	}, threads);
+
+	// entries of a tile are ordered by block, and so by scene order
+	tileStart.assign(tiles + 1, 0);
+	int total = 0;
+	for (int t = 0; t < tiles; t++) {
+		tileStart[t] = total;
+		for (int b = 0; b < blocks; b++) {
+			int count = offsets[(size_t)b * tiles + t];
+			offsets[(size_t)b * tiles + t] = total;
+			total += count;
+		}
+	}
+	tileStart[tiles] = total;
+	std::vector<int> setupBase(blocks + 1, 0);
+	for (int b = 0; b < blocks; b++) {
+		setupBase[b + 1] = setupBase[b] + blockSetups[b].size();
+	}
+	setups.resize(setupBase[blocks]);
+	entries.resize(total);
+	parallelFor(0, blocks, [&](int b) {
+		int* offset = &offsets[(size_t)b * tiles];
+		int tx0, ty0, tx1, ty1;
+		for (size_t i = 0; i < blockSetups[b].size(); i++) {
+			uint32_t index = setupBase[b] + i;
+			const Setup& s = setups[index] = blockSetups[b][i];
+			if (tileRange(s, tx0, ty0, tx1, ty1)) {
+				for (int ty = ty0; ty <= ty1; ty++) {
+					for (int tx = tx0; tx <= tx1; tx++) {
+						entries[offset[ty * tilesX + tx]++] = index;
+					}
+				}
+			}
+		}
+		blockSetups[b] = std::vector<Setup>();
+	}, threads);
+}
+
+void Rasterizer::rasterize(int tile, VisibilitySample* samples, int count, long long* tests) const
+{
+	for (int i = 0; i < count; i++) {
+		samples[i].t = -1;
+		samples[i].prim = -1;
+		samples[i].light = -1;
+		samples[i].element = 0;
+	}
+	for (int e = tileStart[tile]; e < tileStart[tile + 1]; e++) {
+		const Setup& s = setups[entries[e]];
+		for (int i = 0; i < count; i++) {
+			VisibilitySample& sample = samples[i];
+			double x = sample.x, y = sample.y;
+			if (x < s.x0 || x > s.x1 || y < s.y0 || y > s.y1) {
+				continue;
+			}
+			if (tests != nullptr) {
+				tests[i]++;
+			}
+			double alpha = hfov * scene.aspect * (2.0 * x / scene.width - 1);
+			double beta = hfov * (1 - 2.0 * y / scene.height);
+			double t;
+			Eigen::Vector2d uv(0, 0);
+			if (s.sphere) {
+				t = scene.primitives[s.prim]->intersect(Ray(eye, alpha * u + beta * v - w));
+			}
+			else {
+				const double(*l)[3] = s.edge;
+				if (l[0][0] * x + l[0][1] * y + l[0][2] < 0 || l[1][0] * x + l[1][1] * y + l[1][2] < 0 || l[2][0] * x + l[2][1] * y + l[2][2] < 0) {
+					continue;
+				}
+				double iz = s.plane[0][0] * x + s.plane[0][1] * y + s.plane[0][2];
+				if (iz <= 0) {
+					continue;
+				}
+				double z = 1 / iz;
+				uv << z * (s.plane[1][0] * x + s.plane[1][1] * y + s.plane[1][2]), z * (s.plane[2][0] * x + s.plane[2][1] * y + s.plane[2][2]);
+				// depth to distance along the normalized camera ray
+				t = z * std::sqrt(1 + alpha * alpha + beta * beta);
+			}
+			if (t > eps && (sample.t < 0 || t < sample.t)) {
+				sample.t = t;
+				sample.prim = s.prim;
+				sample.light = s.light;
+				sample.uv = uv;
+			}
+		}
+	}
+}
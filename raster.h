@@ -0,0 +1,71 @@
+#pragma once
+#include <vector>
+#include "scene.h"
+
+// what a camera sample sees first, a primitive or a quad light
+struct VisibilitySample {
+	// image position of the sample, set by the caller
+	double x = 0;
+	double y = 0;
+	// distance along the camera ray, -1 where nothing was hit
+	double t = -1;
+	// index in scene.primitives or scene.polyLights, -1 for none
+	int prim = -1;
+	int light = -1;
+	// local hit coordinates and element as Primitive::intersect() reports them,
+	// the weights of v1 and v2 for triangles
+	Eigen::Vector2d uv = Eigen::Vector2d::Zero();
+	int element = 0;
+};
+
+// Primary visibility by rasterization instead of camera rays. bin() projects the
+// triangles, spheres and quad lights once per frame and sorts them into screen
+// tiles; rasterize() then resolves the nearest surface for the samples of one
+// tile with edge functions and a depth test, so each worker rasterizes the tile
+// it is about to shade. Triangles are clipped at the camera plane and their
+// weights interpolated perspective-correct; spheres are bounded on screen and
+// intersected exactly per sample.
+class Rasterizer {
+public:
+	Rasterizer(const Scene& scene, int tileSize);
+	// true when every primitive is a triangle or a sphere
+	static bool supports(const Scene& scene);
+	// projects and bins the scene as it is now, over up to threads worker threads
+	void bin(int threads = 0);
+	// samples must lie inside tile, numbered in rows of tileSize pixels; tests, if given,
+	// gets the primitives whose screen bounds cover each sample added
+	void rasterize(int tile, VisibilitySample* samples, int count, long long* tests = nullptr) const;
+	// tile entries of the last bin(), a primitive counts once per tile it overlaps
+	size_t binned() const { return entries.size(); }
+
+private:
+	// a projected triangle, or the screen rectangle of a sphere
+	struct Setup {
+		// screen space edge functions, normalized to the triangle's weights
+		double edge[3][3];
+		// 1/z and the source weights over z, linear in screen space
+		double plane[3][3];
+		double x0, y0, x1, y1;
+		int prim;
+		int light;
+		bool sphere;
+	};
+	const Scene& scene;
+	int tileSize;
+	int tilesX = 0;
+	int tilesY = 0;
+	// camera frame of the last bin(), the same as PathTracer::camRay()
+	Eigen::Vector3d eye, u, v, w;
+	double hfov = 0;
+	std::vector<Setup> setups;
+	// setups overlapping tile t are entries[tileStart[t]] to entries[tileStart[t + 1]], in scene order
+	std::vector<uint32_t> entries;
+	std::vector<int> tileStart;
+
+	// camera space position
+	Eigen::Vector3d view(const Eigen::Vector3d& p) const;
+	// screen position of a camera space point in front of the camera
+	Eigen::Vector2d project(const Eigen::Vector3d& c) const;
+	void setupTriangle(const Eigen::Vector3d* vertices, int prim, int light, std::vector<Setup>& out) const;
+	void setupSphere(const Primitive& sphere, int prim, std::vector<Setup>& out) const;
+};
@@ -0,0 +1,306 @@
+// Performance and image regression harness.
+//
+// Renders every *.test scene in the reference folder (regress/ by default), each
+// in a child process so that peak memory is measured per scene. Images are
+// checked against <folder>/reference/<scene>.png, which are rendered with a fixed
+// seed and kept in the repository. Time, ray throughput and peak memory are
+// machine specific: they are checked against <folder>/baseline.txt when that
+// exists, which --update writes locally. Scenes in "analytickernel check" mode
+// also fail when the batched kernel strays from the scalar one by more than
+// PathTracer::ANALYTIC_ERROR_BOUND. Any regression, or a scene without a
+// reference image, makes it exit non-zero.
+//
+// --update-references rewrites the reference images, after checking the new
+// renders by eye.
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <FreeImage.h>
+#include "renderer.h"
+#include "writer.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#define popen _popen
+#define pclose _pclose
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+
+class Measurement {
+public:
+	// parsing and BVH build, best render of the repeats
+	double load = 0;
+	double render = 0;
+	double raysPerSecond = 0;
+	double peakMB = 0;
+};
+
+double peakMegabytes()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+	return counters.PeakWorkingSetSize / 1048576.0;
+#else
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1048576.0;
+#else
+	return usage.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+// child side: renders one scene, saves the image and prints the measurement
+int measure(const string& scenePath, const string& imagePath, int repeat)
+{
+	auto begin = chrono::steady_clock::now();
+	ifstream scenefile(scenePath, ios::in);
+	if (!scenefile.is_open()) {
+		cerr << "Cannot open " << scenePath << endl;
+		return 1;
+	}
+	Scene scene(scenefile);
+	Measurement m;
+	m.load = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+	Renderer renderer(scene);
+	RenderOptions options;
+	// fixed so images only change when the renderer does
+	options.seed = 1;
+	vector<float> buffer(scene.width * scene.height * 3);
+	m.render = numeric_limits<double>::infinity();
+	for (int r = 0; r < repeat; r++) {
+		RenderStats stats = renderer.render(options, buffer.data());
+		if (stats.seconds < m.render) {
+			m.render = stats.seconds;
+			m.raysPerSecond = stats.rays / stats.seconds;
+		}
+	}
+	unsigned char* canvas = renderer.tracer().resolve();
+	bool saved = saveImage(canvas, scene.width, scene.height, imagePath);
+	delete[] canvas;
+	m.peakMB = peakMegabytes();
+	cout << "result " << setprecision(9) << m.load << " " << m.render << " " << m.raysPerSecond << " " << m.peakMB << endl;
+	if (scene.analyticKernel == "check") {
+		cout << "analytic " << setprecision(9) << renderer.tracer().analyticError << endl;
+	}
+	return saved ? 0 : 1;
+}
+
+// RMSE over 8 bit channels, -1 if either image is missing or the sizes differ
+double imageRmse(const string& a, const string& b)
+{
+	int wa, ha, wb, hb;
+	unsigned char* ia = loadImage(a, wa, ha);
+	unsigned char* ib = loadImage(b, wb, hb);
+	double rmse = -1;
+	if (ia != nullptr && ib != nullptr && wa == wb && ha == hb) {
+		double sum = 0;
+		for (int i = 0; i < wa * ha * 3; i++) {
+			double d = (double)ia[i] - ib[i];
+			sum += d * d;
+		}
+		rmse = sqrt(sum / (wa * ha * 3));
+	}
+	delete[] ia;
+	delete[] ib;
+	return rmse;
+}
+
+map<string, Measurement> readBaseline(const string& path)
+{
+	map<string, Measurement> baseline;
+	ifstream file(path, ios::in);
+	string line;
+	while (getline(file, line)) {
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+		stringstream s(line);
+		string name;
+		Measurement m;
+		if (s >> name >> m.load >> m.render >> m.raysPerSecond >> m.peakMB) {
+			baseline[name] = m;
+		}
+	}
+	return baseline;
+}
+
+int main(int argc, char** argv)
+{
+	string folder = "regress";
+	int repeat = 3;
+	double timeTolerance = 0.15;
+	double memoryTolerance = 0.15;
+	double minPsnr = 40;
+	// differences below this many seconds are timer noise
+	double timeFloor = 0.02;
+	bool update = false;
+	bool updateReferences = false;
+	for (int i = 1; i < argc; i++) {
+		bool hasValue = i + 1 < argc;
+		if (!strcmp(argv[i], "--measure") && i + 3 < argc) {
+			FreeImage_Initialise();
+			int rc = measure(argv[i + 1], argv[i + 2], stoi(argv[i + 3]));
+			FreeImage_DeInitialise();
+			return rc;
+		}
+		else if (!strcmp(argv[i], "--dir") && hasValue) {
+			folder = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--repeat") && hasValue) {
+			repeat = max(stoi(argv[++i]), 1);
+		}
+		else if (!strcmp(argv[i], "--time-tolerance") && hasValue) {
+			timeTolerance = stod(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--memory-tolerance") && hasValue) {
+			memoryTolerance = stod(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--min-psnr") && hasValue) {
+			minPsnr = stod(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--update")) {
+			update = true;
+		}
+		else if (!strcmp(argv[i], "--update-references")) {
+			updateReferences = true;
+		}
+		else {
+			cerr << "Usage: regress [--dir <folder>] [--repeat <n>] [--time-tolerance <x>] [--memory-tolerance <x>] [--min-psnr <db>] [--update] [--update-references]" << endl;
+			return 2;
+		}
+	}
+
+	vector<filesystem::path> scenes;
+	for (auto& entry : filesystem::directory_iterator(folder)) {
+		if (entry.path().extension() == ".test") {
+			scenes.push_back(entry.path());
+		}
+	}
+	sort(scenes.begin(), scenes.end());
+	if (scenes.empty()) {
+		cerr << "No reference scenes in " << folder << endl;
+		return 2;
+	}
+	string baselinePath = folder + "/baseline.txt";
+	map<string, Measurement> baseline = readBaseline(baselinePath);
+	map<string, Measurement> results;
+
+	FreeImage_Initialise();
+	int failures = 0;
+	cout << left << setw(14) << "scene" << right << setw(10) << "load s" << setw(10) << "render s" << setw(12) << "Mrays/s"
+		<< setw(10) << "peak MB" << setw(10) << "PSNR dB" << "  result" << endl;
+	for (auto& scenePath : scenes) {
+		string name = scenePath.stem().string();
+		string image = folder + "/out/" + name + ".png";
+		string reference = folder + "/reference/" + name + ".png";
+		filesystem::create_directories(folder + "/out");
+
+		string command = "\"" + string(argv[0]) + "\" --measure \"" + scenePath.string() + "\" \"" + image + "\" " + to_string(repeat);
+		FILE* child = popen(command.c_str(), "r");
+		Measurement m;
+		bool measured = false;
+		// -1 unless the scene runs the analytic kernel check
+		double analyticError = -1;
+		char line[512];
+		while (child != nullptr && fgets(line, sizeof(line), child) != nullptr) {
+			measured |= sscanf(line, "result %lf %lf %lf %lf", &m.load, &m.render, &m.raysPerSecond, &m.peakMB) == 4;
+			sscanf(line, "analytic %lf", &analyticError);
+		}
+		if (child == nullptr || pclose(child) != 0 || !measured) {
+			cout << left << setw(14) << name << "  FAIL: render failed" << endl;
+			failures++;
+			continue;
+		}
+		results[name] = m;
+
+		vector<string> problems;
+		if (analyticError > PathTracer::ANALYTIC_ERROR_BOUND) {
+			problems.push_back("analytic kernel error " + to_string(analyticError));
+		}
+		double psnr = numeric_limits<double>::infinity();
+		if (updateReferences) {
+			filesystem::create_directories(folder + "/reference");
+			filesystem::copy_file(image, reference, filesystem::copy_options::overwrite_existing);
+		}
+		else {
+			double rmse = imageRmse(image, reference);
+			if (rmse < 0) {
+				problems.push_back("no reference image");
+			}
+			else if (rmse > 0) {
+				psnr = 20 * log10(255 / rmse);
+				if (psnr < minPsnr) {
+					problems.push_back("image differs");
+				}
+			}
+		}
+		if (!update) {
+			// timings are only compared on the machine that wrote the baseline
+			auto base = baseline.find(name);
+			if (base != baseline.end()) {
+				Measurement& b = base->second;
+				if (m.load > b.load * (1 + timeTolerance) && m.load - b.load > timeFloor) {
+					problems.push_back("load slower");
+				}
+				if (m.render > b.render * (1 + timeTolerance) && m.render - b.render > timeFloor) {
+					problems.push_back("render slower");
+				}
+				if (m.raysPerSecond < b.raysPerSecond * (1 - timeTolerance) && m.render - b.render > timeFloor) {
+					problems.push_back("fewer rays/s");
+				}
+				if (m.peakMB > b.peakMB * (1 + memoryTolerance)) {
+					problems.push_back("more memory");
+				}
+			}
+		}
+
+		cout << left << setw(14) << name << right << fixed << setprecision(3) << setw(10) << m.load << setw(10) << m.render
+			<< setprecision(2) << setw(12) << m.raysPerSecond / 1e6 << setprecision(1) << setw(10) << m.peakMB
+			<< setw(10) << psnr << "  ";
+		if (problems.empty()) {
+			cout << (update || updateReferences ? "updated" : "ok");
+		}
+		else {
+			failures++;
+			cout << "FAIL:";
+			for (int p = 0; p < (int)problems.size(); p++) {
+				cout << (p > 0 ? ", " : " ") << problems[p];
+			}
+		}
+		cout << defaultfloat << endl;
+		auto base = baseline.find(name);
+		if (!update && base != baseline.end()) {
+			Measurement& b = base->second;
+			cout << left << setw(14) << "  baseline" << right << fixed << setprecision(3) << setw(10) << b.load << setw(10) << b.render
+				<< setprecision(2) << setw(12) << b.raysPerSecond / 1e6 << setprecision(1) << setw(10) << b.peakMB << defaultfloat << endl;
+		}
+	}
+	FreeImage_DeInitialise();
+
+	if (update) {
+		ofstream file(baselinePath, ios::out);
+		file << "# scene load(s) render(s) rays/s peak(MB), written by regress --update" << endl;
+		for (auto& [name, m] : results) {
+			file << name << " " << m.load << " " << m.render << " " << m.raysPerSecond << " " << m.peakMB << endl;
+		}
+		cout << "Baseline written to " << baselinePath << endl;
+		return failures > 0 ? 1 : 0;
+	}
+	if (baseline.empty()) {
+		cout << "No timing baseline in " << baselinePath << ", run with --update to check time and memory" << endl;
+	}
+	cout << (failures > 0 ? to_string(failures) + " scene(s) regressed" : "All scenes within tolerance") << endl;
+	return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,67 @@
+#include "renderer.h"
+#include "parallel.h"
+
+Renderer::Renderer(Scene scene)
+{
+	pathtracer = std::make_unique<PathTracer>(std::move(scene), 0);
+}
+
+void Renderer::cancel()
+{
+	pathtracer->cancelRequested = true;
+}
+
+RenderStats Renderer::render(const RenderOptions& options, float* buffer, Progress progress)
+{
+	auto begin = std::chrono::steady_clock::now();
+	PathTracer& pt = *pathtracer;
+	// 0 keeps the scene's own limit
+	pt.threads = options.threads > 0 ? options.threads : pt.scene.threads;
+	if (!options.integrator.empty()) {
+		pt.scene.integrator = options.integrator;
+	}
+	pt.seed = options.seed;
+	pt.regionX = options.regionX;
+	pt.regionY = options.regionY;
+	pt.regionWidth = options.regionWidth;
+	pt.regionHeight = options.regionHeight;
+	pt.beginRender();
+
+	RenderStats stats;
+	int spp = std::max(options.samplesPerPixel, 1);
+	for (int pass = 0; pass < spp && !pt.cancelRequested; pass++) {
+		bool complete = pt.renderPass(pass, std::chrono::steady_clock::time_point::max(), [&](double done) {
+			if (progress && !progress((pass + done) / spp)) {
+				pt.cancelRequested = true;
+			}
+		});
+		if (complete) {
+			stats.passes++;
+		}
+	}
+	// a request that comes after the last pass finished cancels nothing
+	stats.cancelled = stats.passes < spp;
+	pt.cancelRequested = false;
+
+	// canvas channel order back to RGB
+	int x0, y0, x1, y1;
+	pt.clipRegion(x0, y0, x1, y1);
+	std::vector<Eigen::Array3d> radiance = pt.resolveRadiance(x0, y0, x1, y1);
+	for (int y = y0; y < y1; y++) {
+		for (int x = x0; x < x1; x++) {
+			int p = (y - y0) * (x1 - x0) + x - x0;
+			Eigen::Array3d color = radiance[p];
+			reorder_color(color);
+			float* out = buffer + p * 3;
+			out[0] = (float)color[0];
+			out[1] = (float)color[1];
+			out[2] = (float)color[2];
+			stats.samples += pt.sampleCount[y * pt.scene.width + x];
+		}
+	}
+	stats.rays = pt.rayCount;
+	stats.primitives = pt.scene.primitives.size();
+	stats.treeBytes = pt.scene.treeBytes();
+	stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	return stats;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include "pathtracer.h"
+
+class RenderOptions {
+public:
+	// worker threads, 0 for the scene's own limit or else the hardware concurrency
+	int threads = 0;
+	// samples per pixel, the first one through the pixel center
+	int samplesPerPixel = 1;
+	// pixel rectangle to render, the whole image when empty
+	int regionX = 0;
+	int regionY = 0;
+	int regionWidth = 0;
+	int regionHeight = 0;
+	// empty keeps the scene's integrator
+	std::string integrator = "";
+	unsigned seed = 0;
+};
+
+class RenderStats {
+public:
+	double seconds = 0;
+	// completed passes, each one sample for every pixel of the region
+	int passes = 0;
+	long long samples = 0;
+	// rays traced through the acceleration structure, camera, shadow and bounce rays alike
+	long long rays = 0;
+	bool cancelled = false;
+	int primitives = 0;
+	size_t treeBytes = 0;
+};
+
+// Library entry point: renders a scene built in memory (or parsed) into a
+// caller supplied buffer, without files or a console.
+class Renderer {
+public:
+	// fraction of the render done, returning false cancels it
+	using Progress = std::function<bool(double)>;
+
+	Renderer(Scene scene);
+	// writes regionWidth * regionHeight RGB float triples, row by row from the top;
+	// blocks until done or cancelled, pixels not reached keep the samples they got
+	RenderStats render(const RenderOptions& options, float* buffer, Progress progress = nullptr);
+	// safe to call from any thread, render() returns after the tiles in flight;
+	// a cancel before render() stops that render, the request is cleared when it returns
+	void cancel();
+	PathTracer& tracer() { return *pathtracer; }
+
+private:
+	std::unique_ptr<PathTracer> pathtracer;
+};
@@ -0,0 +1,40 @@
+#include "reservoir.h"
+#include <cmath>
+
+// neighbours are reused across at most this much normal and relative depth change
+constexpr double REUSE_NORMAL_COSINE = 0.9;
+constexpr double REUSE_DEPTH_RATIO = 0.1;
+
+bool Reservoir::update(int l, double u1, double u2, double t, double weight, double n, double u)
+{
+	weightSum += weight;
+	count += n;
+	if (weight <= 0 || u * weightSum >= weight) {
+		return false;
+	}
+	light = l;
+	r1 = u1;
+	r2 = u2;
+	target = t;
+	return true;
+}
+
+bool Reservoir::merge(const Reservoir& other, double t, double u)
+{
+	return update(other.light, other.r1, other.r2, t, t * other.W * other.count, other.count, u);
+}
+
+void Reservoir::finish()
+{
+	finish(count);
+}
+
+void Reservoir::finish(double candidates)
+{
+	W = target > 0 && candidates > 0 ? weightSum / (candidates * target) : 0;
+}
+
+bool Reservoir::similar(const Eigen::Vector3d& n, double t) const
+{
+	return depth > 0 && normal.dot(n) > REUSE_NORMAL_COSINE && std::abs(depth - t) < REUSE_DEPTH_RATIO * t;
+}
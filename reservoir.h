@@ -0,0 +1,34 @@
+#pragma once
+#include <Eigen/Core>
+
+// Weighted reservoir over quad light samples for resampled direct lighting
+// (Bitterli et al. 2020). Candidates are streamed in with weight target / source
+// density and one of them is kept with probability proportional to its weight;
+// reservoirs of neighbouring pixels and earlier passes merge the same way.
+struct Reservoir {
+	// the kept sample: a light and its position va + r1 * e1 + r2 * e2
+	int light = -1;
+	double r1 = 0;
+	double r2 = 0;
+	// target density of the kept sample at the owning hit
+	double target = 0;
+	double weightSum = 0;
+	// candidates seen, fractional after merging clamped history
+	double count = 0;
+	// contribution weight of the kept sample, weightSum / (count * target)
+	double W = 0;
+	// hit the reservoir was built for, to reject history and neighbours across edges
+	Eigen::Vector3d normal = Eigen::Vector3d::Zero();
+	double depth = -1;
+
+	// streams in one sample, u uniform in [0, 1); true when it is kept
+	bool update(int light, double r1, double r2, double target, double weight, double count, double u);
+	// merges other, whose sample has target density target at this reservoir's hit
+	bool merge(const Reservoir& other, double target, double u);
+	// computes W once all candidates are in, normalized by the candidates that could
+	// have produced the kept sample when merged reservoirs cover different domains
+	void finish();
+	void finish(double candidates);
+	// whether a reservoir of another hit may be reused at normal and depth
+	bool similar(const Eigen::Vector3d& n, double t) const;
+};
@@ -0,0 +1,310 @@
+#include "sbvh.h"
+#include "counters.h"
+#include "parallel.h"
+#include "trace.h"
+#include <limits>
+
+constexpr int LEAF_REF_COUNT = 4;
+constexpr int OBJECT_BINS = 12;
+constexpr int SPATIAL_BINS = 32;
+// spatial splits are tried where the children of the best object split share
+// more than this fraction of the root area
+constexpr double OVERLAP_RATIO = 1e-5;
+// below this depth only object splits are made, each of them shrinks the node
+constexpr int SPATIAL_MAX_DEPTH = 48;
+constexpr int PARALLEL_BUILD_MIN = 4096;
+
+namespace {
+
+// a primitive, or the part of it a spatial split left in the node
+struct Reference {
+	std::shared_ptr<Primitive> prim;
+	Eigen::AlignedBox3d box;
+};
+
+struct Split {
+	double cost = std::numeric_limits<double>::infinity();
+	int axis = -1;
+	// object splits send bins up to bin left, binned from origin with scale;
+	// spatial splits cut at position
+	int bin = 0;
+	double origin = 0;
+	double scale = 0;
+	double position = 0;
+	Eigen::AlignedBox3d left;
+	Eigen::AlignedBox3d right;
+};
+
+struct Builder {
+	double rootArea;
+
+	std::shared_ptr<BVHnode> build(std::vector<Reference> refs, int budget, int depth, int tasks);
+	Split objectSplit(const std::vector<Reference>& refs);
+	Split spatialSplit(const std::vector<Reference>& refs, const Eigen::AlignedBox3d& bbox);
+	int partitionSpatial(std::vector<Reference>& refs, const Split& split, int budget, std::vector<Reference>& left, std::vector<Reference>& right);
+};
+
+int objectBin(const Reference& r, const Split& split)
+{
+	return std::min(std::max((int)((r.box.center()[split.axis] - split.origin) * split.scale), 0), OBJECT_BINS - 1);
+}
+
+Split Builder::objectSplit(const std::vector<Reference>& refs)
+{
+	Eigen::AlignedBox3d centroids;
+	for (const Reference& r : refs) {
+		centroids.extend(r.box.center());
+	}
+	Split best;
+	for (int axis = 0; axis < 3; axis++) {
+		double extent = centroids.max()[axis] - centroids.min()[axis];
+		if (extent < eps) {
+			continue;
+		}
+		Split s;
+		s.axis = axis;
+		s.origin = centroids.min()[axis];
+		s.scale = OBJECT_BINS / extent;
+		int counts[OBJECT_BINS] = {};
+		Eigen::AlignedBox3d boxes[OBJECT_BINS];
+		for (const Reference& r : refs) {
+			int b = objectBin(r, s);
+			counts[b]++;
+			boxes[b].extend(r.box);
+		}
+		Eigen::AlignedBox3d rightBoxes[OBJECT_BINS];
+		int rightCount[OBJECT_BINS];
+		Eigen::AlignedBox3d acc;
+		int n = 0;
+		for (int b = OBJECT_BINS - 1; b > 0; b--) {
+			acc.extend(boxes[b]);
+			n += counts[b];
+			rightBoxes[b] = acc;
+			rightCount[b] = n;
+		}
+		acc.setEmpty();
+		n = 0;
+		for (int b = 0; b < OBJECT_BINS - 1; b++) {
+			acc.extend(boxes[b]);
+			n += counts[b];
+			double cost = surfaceArea(acc) * n + surfaceArea(rightBoxes[b + 1]) * rightCount[b + 1];
+			if (n > 0 && rightCount[b + 1] > 0 && cost < best.cost) {
+				best = s;
+				best.cost = cost;
+				best.bin = b;
+				best.left = acc;
+				best.right = rightBoxes[b + 1];
+			}
+		}
+	}
+	return best;
+}
+
+Split Builder::spatialSplit(const std::vector<Reference>& refs, const Eigen::AlignedBox3d& bbox)
+{
+	Split best;
+	for (int axis = 0; axis < 3; axis++) {
+		double lo = bbox.min()[axis];
+		double extent = bbox.max()[axis] - lo;
+		if (extent < eps) {
+			continue;
+		}
+		double scale = SPATIAL_BINS / extent;
+		auto binOf = [&](double x) { return std::min(std::max((int)((x - lo) * scale), 0), SPATIAL_BINS - 1); };
+		// references start in their first bin and end in their last one, in
+		// between each bin is extended by the part of the primitive inside it
+		int entries[SPATIAL_BINS] = {};
+		int exits[SPATIAL_BINS] = {};
+		Eigen::AlignedBox3d boxes[SPATIAL_BINS];
+		for (const Reference& r : refs) {
+			int first = binOf(r.box.min()[axis]);
+			int last = binOf(r.box.max()[axis]);
+			entries[first]++;
+			exits[last]++;
+			if (first == last) {
+				boxes[first].extend(r.box);
+				continue;
+			}
+			for (int b = first; b <= last; b++) {
+				Eigen::AlignedBox3d slab = r.box;
+				slab.min()[axis] = std::max(slab.min()[axis], lo + b / scale);
+				slab.max()[axis] = std::min(slab.max()[axis], lo + (b + 1) / scale);
+				boxes[b].extend(r.prim->clippedBox(slab));
+			}
+		}
+		Eigen::AlignedBox3d rightBoxes[SPATIAL_BINS];
+		int rightCount[SPATIAL_BINS];
+		Eigen::AlignedBox3d acc;
+		int n = 0;
+		for (int b = SPATIAL_BINS - 1; b > 0; b--) {
+			acc.extend(boxes[b]);
+			n += exits[b];
+			rightBoxes[b] = acc;
+			rightCount[b] = n;
+		}
+		acc.setEmpty();
+		n = 0;
+		for (int b = 0; b < SPATIAL_BINS - 1; b++) {
+			acc.extend(boxes[b]);
+			n += entries[b];
+			double cost = surfaceArea(acc) * n + surfaceArea(rightBoxes[b + 1]) * rightCount[b + 1];
+			if (n > 0 && rightCount[b + 1] > 0 && cost < best.cost) {
+				best.cost = cost;
+				best.axis = axis;
+				best.position = lo + (b + 1) / scale;
+				best.left = acc;
+				best.right = rightBoxes[b + 1];
+			}
+		}
+	}
+	return best;
+}
+
+// returns the number of duplicated references
+int Builder::partitionSpatial(std::vector<Reference>& refs, const Split& split, int budget, std::vector<Reference>& left, std::vector<Reference>& right)
+{
+	int axis = split.axis;
+	Eigen::AlignedBox3d leftBox, rightBox;
+	std::vector<Reference> straddling;
+	for (Reference& r : refs) {
+		if (r.box.max()[axis] <= split.position) {
+			leftBox.extend(r.box);
+			left.push_back(std::move(r));
+		}
+		else if (r.box.min()[axis] >= split.position) {
+			rightBox.extend(r.box);
+			right.push_back(std::move(r));
+		}
+		else {
+			straddling.push_back(std::move(r));
+		}
+	}
+	// reference unsplitting: a crossing primitive goes to one side only when
+	// that is cheaper than the larger counts of duplicating it
+	int duplicated = 0;
+	for (Reference& r : straddling) {
+		Eigen::AlignedBox3d half = r.box;
+		half.max()[axis] = split.position;
+		Eigen::AlignedBox3d leftPart = r.prim->clippedBox(half);
+		half = r.box;
+		half.min()[axis] = split.position;
+		Eigen::AlignedBox3d rightPart = r.prim->clippedBox(half);
+		double nl = left.size(), nr = right.size();
+		double toLeft = surfaceArea(leftBox.merged(r.box)) * (nl + 1) + surfaceArea(rightBox) * nr;
+		double toRight = surfaceArea(leftBox) * nl + surfaceArea(rightBox.merged(r.box)) * (nr + 1);
+		double both = std::numeric_limits<double>::infinity();
+		if (duplicated < budget && !leftPart.isEmpty() && !rightPart.isEmpty()) {
+			both = surfaceArea(leftBox.merged(leftPart)) * (nl + 1) + surfaceArea(rightBox.merged(rightPart)) * (nr + 1);
+		}
+		if (both < toLeft && both < toRight) {
+			leftBox.extend(leftPart);
+			rightBox.extend(rightPart);
+			left.push_back(Reference{ r.prim, leftPart });
+			right.push_back(Reference{ r.prim, rightPart });
+			duplicated++;
+		}
+		else if (toLeft <= toRight) {
+			leftBox.extend(r.box);
+			left.push_back(std::move(r));
+		}
+		else {
+			rightBox.extend(r.box);
+			right.push_back(std::move(r));
+		}
+	}
+	return duplicated;
+}
+
+std::shared_ptr<BVHnode> Builder::build(std::vector<Reference> refs, int budget, int depth, int tasks)
+{
+	TraceScope scope(refs.size() > PARALLEL_BUILD_MIN ? "build sbvh" : nullptr, "references", refs.size());
+	CounterScope counting(PhaseBuild);
+	Eigen::AlignedBox3d bbox;
+	for (const Reference& r : refs) {
+		bbox.extend(r.box);
+	}
+	if (refs.size() <= LEAF_REF_COUNT) {
+		std::vector<std::shared_ptr<Primitive>> prims;
+		for (const Reference& r : refs) {
+			prims.push_back(r.prim);
+		}
+		return std::make_shared<BVHnode>(bbox, prims);
+	}
+
+	std::vector<Reference> left, right;
+	Split object = objectSplit(refs);
+	bool spatial = false;
+	if (budget > 0 && depth < SPATIAL_MAX_DEPTH && (object.axis < 0 || surfaceArea(object.left.intersection(object.right)) > OVERLAP_RATIO * rootArea)) {
+		Split s = spatialSplit(refs, bbox);
+		if (s.axis >= 0 && s.cost < object.cost) {
+			std::vector<Reference> copy = refs;
+			int duplicated = partitionSpatial(copy, s, budget, left, right);
+			spatial = !left.empty() && !right.empty();
+			if (spatial) {
+				budget -= duplicated;
+			}
+			else {
+				left.clear();
+				right.clear();
+			}
+		}
+	}
+	if (!spatial && object.axis >= 0) {
+		for (Reference& r : refs) {
+			(objectBin(r, object) <= object.bin ? left : right).push_back(std::move(r));
+		}
+	}
+	else if (!spatial) {
+		// every centroid in the same place, halve the list
+		int mid = refs.size() / 2;
+		left.assign(refs.begin(), refs.begin() + mid);
+		right.assign(refs.begin() + mid, refs.end());
+	}
+	refs.clear();
+	refs.shrink_to_fit();
+
+	// what is left of the budget is shared by size
+	int leftBudget = (long long)budget * left.size() / (left.size() + right.size());
+	int rightBudget = budget - leftBudget;
+	std::shared_ptr<BVHnode> l, r;
+	if (left.size() + right.size() > PARALLEL_BUILD_MIN && tasks > 0) {
+		// on the worker pool, one half may be built by another thread
+		parallelFor(0, 2, [&](int half) {
+			if (half == 0) {
+				l = build(std::move(left), leftBudget, depth + 1, tasks - 1);
+			}
+			else {
+				r = build(std::move(right), rightBudget, depth + 1, tasks - 1);
+			}
+		});
+	}
+	else {
+		l = build(std::move(left), leftBudget, depth + 1, tasks - 1);
+		r = build(std::move(right), rightBudget, depth + 1, tasks - 1);
+	}
+	bbox = l->box.merged(r->box);
+	return std::make_shared<BVHnode>(bbox, l, r);
+}
+
+}
+
+std::shared_ptr<BVHnode> buildSpatialTree(std::vector<std::shared_ptr<Primitive>> primitives, double maxGrowth, int threads)
+{
+	if (primitives.empty()) {
+		return nullptr;
+	}
+	std::vector<Reference> refs;
+	refs.reserve(primitives.size());
+	Eigen::AlignedBox3d bbox;
+	for (const auto& p : primitives) {
+		refs.push_back(Reference{ p, p->bbox });
+		bbox.extend(p->bbox);
+	}
+	Builder builder{ surfaceArea(bbox) };
+	int workers = threads > 0 ? threads : workerCount();
+	int tasks = 0;
+	while ((1 << tasks) < workers) {
+		tasks++;
+	}
+	return builder.build(std::move(refs), (int)(maxGrowth * primitives.size()), 0, tasks);
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include "bvh.h"
+
+// Split BVH of Stich et al., "Spatial Splits in Bounding Volume Hierarchies"
+// (2009). Next to binned object splits, nodes whose best object split leaves
+// overlapping children also try spatial splits: the node is cut at a plane and
+// primitives crossing it go to both sides, each bounded by its clipped part.
+// Duplicated references are capped at maxGrowth times the primitive count.
+// A primitive can end up in several leaves, so these trees are not refitted.
+// Subtrees are built on at most threads workers, 0 for workerCount().
+std::shared_ptr<BVHnode> buildSpatialTree(std::vector<std::shared_ptr<Primitive>> primitives, double maxGrowth, int threads = 0);
@@ -1,29 +1,23 @@
 #include "scene.h"
+#include "counters.h"
+#include "trace.h"
+#include <iostream>
 
 using namespace std;
 
 // Utils
-vector<double> read_vals(stringstream& s, int num) {
-	double val;
-	vector<double> vals;
+// the values go to a buffer reused across lines, callers copy them into their own
+const vector<double>& read_vals(stringstream& s, int num) {
+	thread_local vector<double> vals;
+	vals.resize(num);
 	for (int i = 0; i < num; i++) {
-		s >> val;
-		vals.push_back(val);
+		s >> vals[i];
 	}
 	return vals;
 }
 
-// only works on windows
-inline void reorder_color(Eigen::Array3d& rgb) {
-#if _WIN32 || __linux__
-	double tmp = rgb(0);
-	rgb(0) = rgb(2);
-	rgb(2) = tmp;
-#endif
-}
-
 // Scene methods
-Scene::Scene(std::ifstream& scenefile) {
+Scene::Scene(std::istream& scenefile, int threadLimit, int defaultThreads) {
 	string parseline;
 	string cmd;
 	vector<double> vals;
@@ -32,8 +26,17 @@ Scene::Scene(std::ifstream& scenefile) {
 	vector<Eigen::Vector3d> vertnormal_vertices;
 	vector<Eigen::Vector3d> vertnormal_normal;
 	Material matMem;
+	// table index of matMem, looked up again after a material command
+	int material = -1;
+	auto currentMaterial = [&]() {
+		if (material < 0) {
+			material = materialIndex(matMem);
+		}
+		return material;
+	};
 	stack<Eigen::Transform<double, 3, Eigen::Affine>> transStack;
 	Eigen::Transform<double, 3, Eigen::Affine> trans = Eigen::Affine3d::Identity();
+	string objectName;
 
 	while (getline(scenefile, parseline)) {
 		s.clear();
@@ -44,8 +47,9 @@ Scene::Scene(std::ifstream& scenefile) {
 			continue;
 		}
 		else if (cmd == "size") {
-			s >> width >> height;
-			aspect = (double)width / height;
+			int w, h;
+			s >> w >> h;
+			setSize(w, h);
 		}
 		else if (cmd == "output") {
 			s >> outname;
@@ -55,11 +59,8 @@ Scene::Scene(std::ifstream& scenefile) {
 		}
 		else if (cmd == "camera") {
 			vals = read_vals(s, 10);
-			cameraFrom << vals[0], vals[1], vals[2];
-			cameraAt << vals[3], vals[4], vals[5];
-			cameraUp << vals[6], vals[7], vals[8];
-			cameraUp.normalize();
-			fov = vals[9];
+			setCamera(Eigen::Vector3d(vals[0], vals[1], vals[2]), Eigen::Vector3d(vals[3], vals[4], vals[5]),
+				Eigen::Vector3d(vals[6], vals[7], vals[8]), vals[9]);
 		}
 		else if (cmd == "vertex") {
 			vals = read_vals(s, 3);
@@ -75,10 +76,10 @@ Scene::Scene(std::ifstream& scenefile) {
 			Eigen::Vector3d center;
 			center << vals[0], vals[1], vals[2];
 			if (trans.isApprox(trans.Identity())) {
-				primitives.push_back(make_shared<Sphere>(center, vals[3], matMem, trans, false));
+				addPrimitive(make_shared<Sphere>(center, vals[3], trans, false), currentMaterial(), objectName);
 			}
 			else {
-				primitives.push_back(make_shared<Sphere>(center, vals[3], matMem, trans, true));
+				addPrimitive(make_shared<Sphere>(center, vals[3], trans, true), currentMaterial(), objectName);
 			}
 		}
 		else if (cmd == "tri") {
@@ -87,7 +88,13 @@ Scene::Scene(std::ifstream& scenefile) {
 			v0 = vertices[(int)vals[0]];
 			v1 = vertices[(int)vals[1]];
 			v2 = vertices[(int)vals[2]];
-			primitives.push_back(make_shared<Triangle>(v0, v1, v2, trans, matMem));
+			if (paged != nullptr && objectName.empty()) {
+				Eigen::Vector3d corners[3] = { trans * v0, trans * v1, trans * v2 };
+				paged->add(corners, nullptr, currentMaterial());
+			}
+			else {
+				addPrimitive(make_shared<Triangle>(v0, v1, v2, trans), currentMaterial(), objectName);
+			}
 		}
 		else if (cmd == "trinormal") {
 			// TODO: untested
@@ -102,21 +109,26 @@ Scene::Scene(std::ifstream& scenefile) {
 			n0.normalize();
 			n1.normalize();
 			n2.normalize();
-			auto temp = make_shared<TriNormal>(v0, v1, v2, trans, matMem);
-			temp->setNormal(n0, n1, n2);
-			primitives.push_back(move(temp));
+			if (paged != nullptr && objectName.empty()) {
+				Eigen::Vector3d corners[3] = { trans * v0, trans * v1, trans * v2 };
+				Eigen::Vector3d normals[3] = { n0, n1, n2 };
+				paged->add(corners, normals, currentMaterial());
+			}
+			else {
+				auto temp = make_shared<TriNormal>(v0, v1, v2, trans);
+				temp->setNormal(n0, n1, n2);
+				addPrimitive(move(temp), currentMaterial(), objectName);
+			}
 		}
 		else if (cmd == "directional" || cmd == "point") {
 			vals = read_vals(s, 6);
 			Eigen::Vector3d p(vals[0], vals[1], vals[2]);
 			Eigen::Array3d c(vals[3], vals[4], vals[5]);
-			reorder_color(c);
 			if (cmd == "directional") {
-				p.normalize();
-				simpleLights.push_back(make_shared<Directional>(p, c));
+				addDirectionalLight(p, c);
 			}
 			else {
-				simpleLights.push_back(make_shared<PointLight>(p, c));
+				addPointLight(p, c);
 			}
 		}
 		else if (cmd == "quadLight") {
@@ -124,13 +136,12 @@ Scene::Scene(std::ifstream& scenefile) {
 			Eigen::Vector3d origin(vals[0], vals[1], vals[2]);
 			Eigen::Vector3d edge1(vals[3], vals[4], vals[5]);
 			Eigen::Vector3d edge2(vals[6], vals[7], vals[8]);
-			Eigen::Array3d c(vals[9], vals[10], vals[11]);
-			reorder_color(c);
-			polyLights.push_back(make_shared<QuadLight>(origin, edge1, edge2, c));
+			addQuadLight(origin, edge1, edge2, Eigen::Array3d(vals[9], vals[10], vals[11]));
 		}
 		else if (cmd == "ambient") {
 			vals = read_vals(s, 3);
 			matMem.ambient << vals[0], vals[1], vals[2];
+			material = -1;
 			reorder_color(matMem.ambient);
 		}
 		else if (cmd == "attenuation") {
@@ -142,21 +153,25 @@ Scene::Scene(std::ifstream& scenefile) {
 		else if (cmd == "diffuse") {
 			vals = read_vals(s, 3);
 			matMem.diffuse << vals[0], vals[1], vals[2];
+			material = -1;
 			reorder_color(matMem.diffuse);
 		}
 		else if (cmd == "specular") {
 			vals = read_vals(s, 3);
 			matMem.specualr << vals[0], vals[1], vals[2];
+			material = -1;
 			reorder_color(matMem.specualr);
 		}
 		else if (cmd == "emission") {
 			vals = read_vals(s, 3);
 			matMem.emission << vals[0], vals[1], vals[2];
+			material = -1;
 			reorder_color(matMem.emission);
 		}
 		else if (cmd == "shininess") {
 			vals = read_vals(s, 1);
 			matMem.shininess = vals[0];
+			material = -1;
 		}
 		else if (cmd == "pushTransform") {
 			transStack.push(trans);
@@ -193,7 +208,337 @@ Scene::Scene(std::ifstream& scenefile) {
 		else if (cmd == "integrator") {
 			s >> integrator;
 		}
+		else if (cmd == "heatmap") {
+			s >> heatmap;
+			if (heatmap != "time" && heatmap != "steps" && heatmap != "tests") {
+				cerr << "Unknown heatmap " << heatmap << ", use time, steps or tests" << endl;
+				heatmap.clear();
+			}
+		}
+		else if (cmd == "denoise") {
+			vals = read_vals(s, 1);
+			denoise = (int)vals[0];
+		}
+		else if (cmd == "engine") {
+			s >> engine;
+		}
+		else if (cmd == "primary") {
+			s >> primary;
+		}
+		else if (cmd == "threads") {
+			vals = read_vals(s, 1);
+			threads = (int)vals[0];
+		}
+		else if (cmd == "indirect") {
+			vals = read_vals(s, 1);
+			indirect = (int)vals[0];
+		}
+		else if (cmd == "irradiancecache") {
+			s >> cacheError >> cacheFile;
+		}
+		else if (cmd == "lightcuts") {
+			s >> lightcutError;
+			int limit;
+			if (s >> limit) {
+				lightcutMax = std::max(limit, 2);
+			}
+		}
+		else if (cmd == "restir") {
+			s >> restirCandidates;
+			int neighbors, radius;
+			if (s >> neighbors) {
+				restirNeighbors = std::max(neighbors, 0);
+			}
+			if (s >> radius) {
+				restirRadius = std::max(radius, 1);
+			}
+		}
+		else if (cmd == "analytickernel") {
+			s >> analyticKernel;
+		}
+		else if (cmd == "aov") {
+			string layer;
+			while (s >> layer) {
+				aovs.push_back(layer);
+			}
+		}
+		else if (cmd == "object") {
+			s >> objectName;
+		}
+		else if (cmd == "endObject") {
+			objectName.clear();
+		}
+		else if (cmd == "rebuildratio") {
+			vals = read_vals(s, 1);
+			rebuildRatio = vals[0];
+		}
+		else if (cmd == "bvhformat") {
+			s >> bvhFormat;
+		}
+		else if (cmd == "geometry") {
+			s >> geometry;
+			if (geometry == "paged") {
+				string file;
+				double residentMegabytes = 0;
+				s >> file >> residentMegabytes;
+				paged = make_shared<PagedGeometry>(file.empty() ? outname + ".geometry" : file, (size_t)(residentMegabytes * 1024 * 1024));
+			}
+		}
+		else if (cmd == "bvhbuilder") {
+			s >> bvhBuilder;
+			double growth;
+			if (s >> growth) {
+				sbvhGrowth = std::max(growth, 0.0);
+			}
+		}
+	}
+	if (threadLimit > 0) {
+		threads = threadLimit;
+	}
+	build(threads > 0 ? threads : defaultThreads);
+}
+
+void Scene::setSize(int w, int h)
+{
+	width = w;
+	height = h;
+	aspect = (double)width / height;
+}
+
+void Scene::setCamera(Eigen::Vector3d from, Eigen::Vector3d at, Eigen::Vector3d up, double fovy)
+{
+	cameraFrom = from;
+	cameraAt = at;
+	cameraUp = up.normalized();
+	fov = fovy;
+}
+
+static Material canvasMaterial(Material material)
+{
+	reorder_color(material.ambient);
+	reorder_color(material.diffuse);
+	reorder_color(material.specualr);
+	reorder_color(material.emission);
+	return material;
+}
+
+int Scene::materialIndex(const Material& material)
+{
+	for (size_t i = 0; i < materials.size(); i++) {
+		if (materials[i] == material) {
+			return i;
+		}
+	}
+	materials.push_back(material);
+	return materials.size() - 1;
+}
+
+shared_ptr<Sphere> Scene::addSphere(Eigen::Vector3d center, double radius, Material material, const Eigen::Affine3d& trans)
+{
+	auto sphere = make_shared<Sphere>(center, radius, trans, !trans.isApprox(Eigen::Affine3d::Identity()));
+	addPrimitive(sphere, materialIndex(canvasMaterial(material)));
+	return sphere;
+}
+
+shared_ptr<Triangle> Scene::addTriangle(Eigen::Vector3d v0, Eigen::Vector3d v1, Eigen::Vector3d v2, Material material, const Eigen::Affine3d& trans)
+{
+	auto triangle = make_shared<Triangle>(v0, v1, v2, trans);
+	addPrimitive(triangle, materialIndex(canvasMaterial(material)));
+	return triangle;
+}
+
+void Scene::addPointLight(Eigen::Vector3d position, Eigen::Array3d color)
+{
+	reorder_color(color);
+	simpleLights.push_back(make_shared<PointLight>(position, color));
+}
+
+void Scene::addDirectionalLight(Eigen::Vector3d direction, Eigen::Array3d color)
+{
+	reorder_color(color);
+	simpleLights.push_back(make_shared<Directional>(direction.normalized(), color));
+}
+
+void Scene::addQuadLight(Eigen::Vector3d origin, Eigen::Vector3d edge1, Eigen::Vector3d edge2, Eigen::Array3d color)
+{
+	reorder_color(color);
+	polyLights.push_back(make_shared<QuadLight>(origin, edge1, edge2, color));
+}
+
+void Scene::addPrimitive(shared_ptr<Primitive> prim, int materialId, const string& object)
+{
+	prim->id = primitives.size();
+	prim->matId = materialId;
+	primitives.push_back(prim);
+	if (!object.empty()) {
+		objects[object].push_back(prim);
+	}
+}
+
+void Scene::build(int buildThreads)
+{
+	if (buildThreads == 0) {
+		buildThreads = threads;
+	}
+	if (geometry == "compressed") {
+		compressGeometry();
+	}
+	if (paged != nullptr) {
+		for (auto& chunk : paged->finish()) {
+			addPrimitive(chunk, -1);
+		}
+	}
+	TraceScope scope("build BVH", "primitives", primitives.size());
+	CounterScope counting(PhaseBuild);
+	if (bvhBuilder == "sbvh") {
+		sahStats = treeStats(buildTree(primitives, buildThreads).get());
+		BVHtree = buildSpatialTree(primitives, sbvhGrowth, buildThreads);
+	}
+	else {
+		BVHtree = buildTree(primitives, buildThreads);
+	}
+	bvhStats = treeStats(BVHtree.get());
+	if (BVHtree != nullptr) {
+		bounds = BVHtree->box;
+		pointerTreeBytes = BVHtree->memoryBytes();
+	}
+	if (bvhFormat == "compact" && BVHtree != nullptr) {
+		TraceScope flatten("flatten");
+		compactTree = make_shared<CompactBVH>(BVHtree);
+		if (objects.empty()) {
+			for (auto p : primitives) {
+				p->leaf = nullptr;
+			}
+			BVHtree = nullptr;
+		}
+	}
+}
+
+void Scene::compressGeometry()
+{
+	TraceScope scope("compress");
+	// faces of objects stay as they are, sequences may move them off the grid
+	std::set<Primitive*> animated;
+	for (const auto& o : objects) {
+		for (const auto& p : o.second) {
+			animated.insert(p.get());
+		}
+	}
+	std::vector<int> faces;
+	for (int i = 0; i < (int)primitives.size(); i++) {
+		if (dynamic_cast<TriNormal*>(primitives[i].get()) != nullptr && animated.count(primitives[i].get()) == 0) {
+			faces.push_back(i);
+		}
+	}
+	// faces sharing a vertex position are one mesh, so shared vertices get identical
+	// codes and the mesh stays watertight, while a small mesh keeps its own precision
+	std::vector<int> parent(faces.size());
+	for (int f = 0; f < (int)faces.size(); f++) {
+		parent[f] = f;
+	}
+	auto root = [&parent](int f) {
+		while (parent[f] != f) {
+			f = parent[f] = parent[parent[f]];
+		}
+		return f;
+	};
+	std::map<std::array<double, 3>, int> firstFace;
+	for (int f = 0; f < (int)faces.size(); f++) {
+		auto face = static_cast<TriNormal*>(primitives[faces[f]].get());
+		for (const Eigen::Vector3d* v : { &face->v0, &face->v1, &face->v2 }) {
+			auto seen = firstFace.emplace(std::array<double, 3>{ (*v)[0], (*v)[1], (*v)[2] }, f);
+			if (!seen.second) {
+				parent[root(f)] = root(seen.first->second);
+			}
+		}
+	}
+	std::map<int, Eigen::AlignedBox3d> meshBounds;
+	for (int f = 0; f < (int)faces.size(); f++) {
+		meshBounds[root(f)].extend(primitives[faces[f]]->bbox);
+	}
+	std::map<int, MeshGrid*> grids;
+	for (const auto& m : meshBounds) {
+		meshGrids.push_back(make_shared<MeshGrid>(m.second));
+		grids[m.first] = meshGrids.back().get();
+	}
+	for (int f = 0; f < (int)faces.size(); f++) {
+		auto& p = primitives[faces[f]];
+		p = make_shared<CompressedTriNormal>(*static_cast<TriNormal*>(p.get()), grids[root(f)]);
+	}
+}
+
+size_t Scene::primitiveBytes()
+{
+	size_t bytes = 0;
+	for (const auto& p : primitives) {
+		// make_shared allocates the object next to its control block
+		bytes += 2 * sizeof(long) + sizeof(void*);
+		if (dynamic_cast<CompressedTriNormal*>(p.get()) != nullptr) {
+			bytes += sizeof(CompressedTriNormal);
+		}
+		else if (dynamic_cast<PagedChunk*>(p.get()) != nullptr) {
+			bytes += sizeof(PagedChunk);
+		}
+		else if (dynamic_cast<TriNormal*>(p.get()) != nullptr) {
+			bytes += sizeof(TriNormal);
+		}
+		else if (dynamic_cast<Triangle*>(p.get()) != nullptr) {
+			bytes += sizeof(Triangle);
+		}
+		else {
+			bytes += sizeof(Sphere);
+		}
+	}
+	return bytes;
+}
+
+// FNV-1a over the doubles
+static void hashValues(uint64_t& hash, const double* values, int count)
+{
+	const unsigned char* bytes = (const unsigned char*)values;
+	for (size_t i = 0; i < count * sizeof(double); i++) {
+		hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+	}
+}
+
+uint64_t Scene::fingerprint() const
+{
+	uint64_t hash = 0xCBF29CE484222325ull;
+	double counts[3] = { (double)primitives.size(), (double)simpleLights.size(), (double)polyLights.size() };
+	hashValues(hash, counts, 3);
+	for (const auto& p : primitives) {
+		hashValues(hash, p->bbox.min().data(), 3);
+		hashValues(hash, p->bbox.max().data(), 3);
+		double material = p->matId;
+		hashValues(hash, &material, 1);
+	}
+	for (const Material& m : materials) {
+		hashValues(hash, m.ambient.data(), 3);
+		hashValues(hash, m.diffuse.data(), 3);
+		hashValues(hash, m.specualr.data(), 3);
+		hashValues(hash, &m.shininess, 1);
+		hashValues(hash, m.emission.data(), 3);
+	}
+	for (const auto& l : simpleLights) {
+		hashValues(hash, l->v0.data(), 3);
+		hashValues(hash, l->c.data(), 3);
+	}
+	for (const auto& l : polyLights) {
+		hashValues(hash, l->va.data(), 3);
+		hashValues(hash, l->e1.data(), 3);
+		hashValues(hash, l->e2.data(), 3);
+		hashValues(hash, l->c.data(), 3);
+	}
+	hashValues(hash, attenuation.data(), attenuation.size());
+	return hash;
+}
+
+size_t Scene::treeBytes()
+{
+	size_t bytes = compactTree != nullptr ? compactTree->memoryBytes() : 0;
+	if (BVHtree != nullptr) {
+		bytes += pointerTreeBytes;
 	}
-	BVHtree = buildTree(primitives);
+	return bytes;
 }
 
@@ -1,14 +1,30 @@
 #pragma once
 #include "bvh.h"
+#include "compactbvh.h"
+#include "sbvh.h"
+#include "paging.h"
+#include <cstdint>
 #include <fstream>
 #include <cassert>
 #include <sstream>
 #include <vector>
 #include <stack>
+#include <map>
+#include <set>
+#include <array>
 #include <memory>
 #include "primitive.h"
 #include "light.h"
 
+// only works on windows
+inline void reorder_color(Eigen::Array3d& rgb) {
+#if _WIN32 || __linux__
+	double tmp = rgb(0);
+	rgb(0) = rgb(2);
+	rgb(2) = tmp;
+#endif
+}
+
 class Scene {
 public:
 	// canvas size
@@ -24,7 +40,36 @@ public:
 	double fov = 0;
 	// primitives
 	std::vector<std::shared_ptr<Primitive>> primitives;
+	// distinct materials, shared by the primitives through Primitive::matId
+	std::vector<Material> materials;
 	std::shared_ptr<BVHnode> BVHtree = nullptr;
+	// "pointer" traverses BVHtree, "compact" flattens it into compactTree; the pointer
+	// tree is then only kept when there are objects a sequence could move
+	std::string bvhFormat = "pointer";
+	std::shared_ptr<CompactBVH> compactTree = nullptr;
+	size_t pointerTreeBytes = 0;
+	// "sah" for binned object splits, "sbvh" adds spatial splits, with duplicated
+	// references growing by at most sbvhGrowth times the primitive count
+	std::string bvhBuilder = "sah";
+	double sbvhGrowth = 0.3;
+	// shape of BVHtree, and for sbvh of the tree the sah builder makes for comparison
+	BVHStats bvhStats;
+	BVHStats sahStats;
+	// bounds of all primitives
+	Eigen::AlignedBox3d bounds;
+	// named groups of primitives, targets of sequence transforms
+	std::map<std::string, std::vector<std::shared_ptr<Primitive>>> objects;
+	// "compressed" replaces the TriNormal faces outside objects by CompressedTriNormal
+	// when building, each mesh on a grid over its own bounds; "full" keeps them as parsed
+	std::string geometry = "full";
+	// one per connected mesh, faces sharing a vertex position share a grid
+	std::vector<std::shared_ptr<MeshGrid>> meshGrids;
+	// "paged <file> [residentMB]", given before the geometry, spills the static
+	// triangles to chunks of a memory-mapped file instead of keeping primitives;
+	// at most residentMB of chunks stay paged in, 0 for no limit
+	std::shared_ptr<PagedGeometry> paged = nullptr;
+	// refit quality threshold before a subtree is rebuilt
+	double rebuildRatio = 2;
 	// lighting
 	std::vector<double> attenuation{ 1, 0, 0 };
 	std::vector<std::shared_ptr<Light>> simpleLights;
@@ -36,7 +81,67 @@ public:
 	bool stratify = false;
 	// integrator
 	std::string integrator = "raytracer";
+	// per-pixel cost heatmap: "time", "steps" or "tests", empty to disable
+	std::string heatmap = "";
+	// a-trous denoiser iterations, 0 to disable
+	int denoise = 0;
+	// "recursive" shades each pixel depth first, "wavefront" runs each stage over a queue of rays
+	std::string engine = "recursive";
+	// primary visibility of the recursive engine: "trace" casts camera rays, "raster" rasterizes
+	// the scene per tile instead; scenes with paged geometry are always traced
+	std::string primary = "trace";
+	// render threads, 0 for the hardware concurrency
+	int threads = 0;
+	// hemisphere samples for diffuse interreflection in the direct integrator, 0 to disable
+	int indirect = 0;
+	// irradiance cache error bound, 0 to sample every shading point, and an optional file to reuse records
+	double cacheError = 0;
+	std::string cacheFile = "";
+	// lightcuts for the point and directional lights: a cluster of lights is shaded through
+	// one representative once its error bound is below this fraction of the total, 0 to disable;
+	// cuts hold at most lightcutMax clusters
+	double lightcutError = 0;
+	int lightcutMax = 1000;
+	// resampled direct lighting for the direct integrator: restirCandidates unshadowed light
+	// samples per hit are resampled down to one shadow ray, primary hits also reuse restirNeighbors
+	// reservoirs within restirRadius pixels and the pixel's reservoir of the previous pass or
+	// frame; 0 candidates to sample every light lightsamples times
+	int restirCandidates = 0;
+	int restirNeighbors = 4;
+	int restirRadius = 5;
+	// analytic integrator kernel: "fast" (batched), "exact" (scalar) or "check" (both, reports the difference)
+	std::string analyticKernel = "fast";
+	// extra output layers: depth, normal, albedo, primid, matid, direct, reflected
+	std::vector<std::string> aovs;
 
 	Scene() = default;
-	Scene(std::ifstream& scenefile);
+	// threadLimit overrides the scene's threads command; the BVH is built with the resulting
+	// limit, or defaultThreads if neither sets one
+	Scene(std::istream& scenefile, int threadLimit = 0, int defaultThreads = 0);
+
+	// building a scene in memory, colors are given in RGB order; call build()
+	// once all primitives are added
+	void setSize(int w, int h);
+	void setCamera(Eigen::Vector3d from, Eigen::Vector3d at, Eigen::Vector3d up, double fovy);
+	std::shared_ptr<Sphere> addSphere(Eigen::Vector3d center, double radius, Material material, const Eigen::Affine3d& trans = Eigen::Affine3d::Identity());
+	std::shared_ptr<Triangle> addTriangle(Eigen::Vector3d v0, Eigen::Vector3d v1, Eigen::Vector3d v2, Material material, const Eigen::Affine3d& trans = Eigen::Affine3d::Identity());
+	void addPointLight(Eigen::Vector3d position, Eigen::Array3d color);
+	void addDirectionalLight(Eigen::Vector3d direction, Eigen::Array3d color);
+	void addQuadLight(Eigen::Vector3d origin, Eigen::Vector3d edge1, Eigen::Vector3d edge2, Eigen::Array3d color);
+	// adds a primitive using materials[materialId], to an object when named
+	void addPrimitive(std::shared_ptr<Primitive> prim, int materialId, const std::string& object = "");
+	// index of material in the table, added when no entry equals it; colors in canvas order
+	int materialIndex(const Material& material);
+	// builds the acceleration structure on at most buildThreads workers, 0 for the scene's threads
+	void build(int buildThreads = 0);
+	// acceleration structure memory in use
+	size_t treeBytes();
+	// bytes of the primitive objects themselves
+	size_t primitiveBytes();
+	// hash of what lighting depends on: primitive bounds, materials, lights and attenuation,
+	// to tell whether data saved for a scene still fits this one
+	uint64_t fingerprint() const;
+
+private:
+	void compressGeometry();
 };
\ No newline at end of file
@@ -0,0 +1,149 @@
+#include "sequence.h"
+#include <iomanip>
+
+using namespace std;
+
+CameraKey readCamera(stringstream& s)
+{
+	CameraKey key;
+	double v[10];
+	for (int i = 0; i < 10; i++) {
+		s >> v[i];
+	}
+	key.from << v[0], v[1], v[2];
+	key.at << v[3], v[4], v[5];
+	key.up << v[6], v[7], v[8];
+	key.up.normalize();
+	key.fov = v[9];
+	return key;
+}
+
+template<class T>
+T catmullRom(T p0, T p1, T p2, T p3, double t)
+{
+	return 0.5 * ((2 * p1) + (p2 - p0) * t + (2 * p0 - 5 * p1 + 4 * p2 - p3) * t * t + (3 * p1 - p0 - 3 * p2 + p3) * t * t * t);
+}
+
+Sequence::Sequence(std::ifstream& sequencefile) {
+	string parseline;
+	string cmd;
+	stringstream s;
+	while (getline(sequencefile, parseline)) {
+		s.clear();
+		s.str(parseline);
+		s >> cmd;
+		if (parseline.length() == 0 || parseline[0] == '#') {
+			continue;
+		}
+		else if (cmd == "frame") {
+			Frame f;
+			s >> f.outname;
+			frames.push_back(f);
+		}
+		else if (cmd == "key") {
+			keys.push_back(readCamera(s));
+		}
+		else if (cmd == "path") {
+			int count;
+			string prefix;
+			s >> count >> prefix;
+			for (int i = 0; i < count; i++) {
+				Frame f;
+				stringstream name;
+				name << prefix << setw(4) << setfill('0') << i << ".png";
+				f.outname = name.str();
+				f.hasCamera = !keys.empty();
+				if (f.hasCamera) {
+					f.camera = interpolate(count > 1 ? (double)i / (count - 1) : 0);
+				}
+				frames.push_back(f);
+			}
+			keys.clear();
+		}
+		else if (frames.empty()) {
+			cerr << "Sequence command before first frame: " << parseline << endl;
+		}
+		else if (cmd == "camera") {
+			frames.back().hasCamera = true;
+			frames.back().camera = readCamera(s);
+		}
+		else if (cmd == "translate" || cmd == "rotate" || cmd == "scale") {
+			ObjectMove move;
+			double x, y, z;
+			s >> move.object >> x >> y >> z;
+			if (cmd == "translate") {
+				move.trans = Eigen::Translation<double, 3>(Eigen::Vector3d(x, y, z));
+			}
+			else if (cmd == "scale") {
+				move.trans = Eigen::Scaling(Eigen::Vector3d(x, y, z));
+			}
+			else {
+				double angle;
+				s >> angle;
+				move.trans = Eigen::AngleAxis(angle * PI / 180, Eigen::Vector3d(x, y, z).normalized());
+			}
+			frames.back().moves.push_back(move);
+		}
+	}
+}
+
+CameraKey Sequence::interpolate(double u)
+{
+	if (keys.size() == 1) {
+		return keys[0];
+	}
+	double pos = u * (keys.size() - 1);
+	int k = min((int)pos, (int)keys.size() - 2);
+	double t = pos - k;
+	// clamp the neighbours at both ends of the path
+	CameraKey& k0 = keys[max(k - 1, 0)];
+	CameraKey& k1 = keys[k];
+	CameraKey& k2 = keys[k + 1];
+	CameraKey& k3 = keys[min(k + 2, (int)keys.size() - 1)];
+	CameraKey key;
+	key.from = catmullRom(k0.from, k1.from, k2.from, k3.from, t);
+	key.at = catmullRom(k0.at, k1.at, k2.at, k3.at, t);
+	key.up = catmullRom(k0.up, k1.up, k2.up, k3.up, t).normalized();
+	key.fov = catmullRom(k0.fov, k1.fov, k2.fov, k3.fov, t);
+	return key;
+}
+
+int Sequence::apply(Scene& scene, int frame)
+{
+	if (frames[frame].hasCamera) {
+		CameraKey& camera = frames[frame].camera;
+		scene.cameraFrom = camera.from;
+		scene.cameraAt = camera.at;
+		scene.cameraUp = camera.up;
+		scene.fov = camera.fov;
+	}
+	vector<shared_ptr<Primitive>> moved;
+	for (ObjectMove& m : frames[frame].moves) {
+		auto object = scene.objects.find(m.object);
+		if (object == scene.objects.end()) {
+			cerr << "Unknown object " << m.object << endl;
+			continue;
+		}
+		for (auto p : object->second) {
+			p->transform(m.trans);
+			moved.push_back(p);
+		}
+	}
+	if (moved.empty() || scene.BVHtree == nullptr) {
+		return 0;
+	}
+	int rebuilt = 1;
+	if (scene.bvhBuilder == "sbvh") {
+		// primitives can sit in several leaves, there is no refit
+		scene.BVHtree = buildSpatialTree(scene.primitives, scene.sbvhGrowth, scene.threads);
+	}
+	else {
+		rebuilt = refitTree(moved, scene.rebuildRatio, scene.threads);
+	}
+	scene.bounds = scene.BVHtree->box;
+	// the compact layout has no refit, it is flattened again from the refitted tree
+	if (scene.compactTree != nullptr) {
+		scene.compactTree = make_shared<CompactBVH>(scene.BVHtree);
+	}
+	return rebuilt;
+}
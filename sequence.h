@@ -0,0 +1,49 @@
+#pragma once
+#include "scene.h"
+
+// transformation applied to a named object of the scene
+class ObjectMove {
+public:
+	std::string object;
+	Eigen::Affine3d trans = Eigen::Affine3d::Identity();
+};
+
+class CameraKey {
+public:
+	Eigen::Vector3d from;
+	Eigen::Vector3d at;
+	Eigen::Vector3d up;
+	double fov = 0;
+};
+
+class Frame {
+public:
+	std::string outname;
+	std::vector<ObjectMove> moves;
+	bool hasCamera = false;
+	CameraKey camera;
+};
+
+// Animation description, one block per frame:
+//   frame <output>
+//   camera <same arguments as the scene command>
+//   translate <object> x y z
+//   rotate <object> x y z angle
+//   scale <object> x y z
+// transforms are applied in world space on top of the previous frame.
+// Camera paths are given as keyframes followed by the number of frames
+// to generate along a Catmull-Rom spline through them:
+//   key <same arguments as the scene camera command>
+//   path <count> <output prefix>
+class Sequence {
+public:
+	std::vector<Frame> frames;
+	std::vector<CameraKey> keys;
+
+	Sequence() = default;
+	Sequence(std::ifstream& sequencefile);
+	// camera at parameter u in [0, 1] along the keyframes
+	CameraKey interpolate(double u);
+	// moves the objects of a frame and refits the BVH, returns the number of rebuilt subtrees
+	int apply(Scene& scene, int frame);
+};
@@ -0,0 +1,527 @@
+#include "server.h"
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include "writer.h"
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// pause after a failed accept() other than an interrupt, e.g. out of descriptors
+constexpr int ACCEPT_RETRY_MS = 100;
+
+// JSON string literal
+static std::string quote(const std::string& s)
+{
+	std::string out = "\"";
+	for (char c : s) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+		}
+		out += c;
+	}
+	return out + "\"";
+}
+
+// rough size of a loaded scene: primitives, their BVH and the scene's own arrays
+static size_t sceneBytes(Scene& scene)
+{
+	size_t primitive = std::max(sizeof(Sphere), sizeof(TriNormal)) + 2 * sizeof(std::shared_ptr<Primitive>);
+	return sizeof(Scene) + scene.primitives.size() * primitive + scene.treeBytes();
+}
+
+// SceneCache methods
+SceneCache::SceneCache(size_t budgetBytes, int threads) : budget(budgetBytes), threads(threads)
+{
+}
+
+std::string SceneCache::summary()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	std::stringstream out;
+	out << "\"scenes\":" << lru.size() << ",\"cacheBytes\":" << bytes << ",\"cacheBudget\":" << budget
+		<< ",\"hits\":" << hits << ",\"misses\":" << misses;
+	return out.str();
+}
+
+std::shared_ptr<const Scene> SceneCache::get(const std::string& path, bool& cached)
+{
+	std::ifstream file(path, std::ios::in | std::ios::binary);
+	if (!file.is_open()) {
+		return nullptr;
+	}
+	std::stringstream contents;
+	contents << file.rdbuf();
+	std::string text = contents.str();
+	// scene files are self contained, so the contents identify the scene wherever it lives
+	std::stringstream key;
+	key << std::hex << std::hash<std::string>()(text) << ":" << text.size();
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		auto found = index.find(key.str());
+		if (found != index.end()) {
+			lru.splice(lru.begin(), lru, found->second);
+			hits++;
+			cached = true;
+			return lru.front().scene;
+		}
+		misses++;
+	}
+	cached = false;
+	std::istringstream stream(text);
+	auto scene = std::make_shared<Scene>(stream, 0, threads);
+	size_t size = sceneBytes(*scene);
+
+	std::lock_guard<std::mutex> guard(lock);
+	if (index.find(key.str()) == index.end()) {
+		lru.push_front(Entry{ key.str(), scene, size });
+		index[key.str()] = lru.begin();
+		bytes += size;
+	}
+	// the newest entry stays even over budget, jobs in flight keep evicted scenes alive
+	while (bytes > budget && lru.size() > 1) {
+		bytes -= lru.back().bytes;
+		index.erase(lru.back().key);
+		lru.pop_back();
+	}
+	return scene;
+}
+
+// ServerClient methods
+ServerClient::ServerClient(int descriptor) : fd(descriptor)
+{
+}
+
+ServerClient::~ServerClient()
+{
+#ifndef _WIN32
+	if (fd >= 0) {
+		close(fd);
+	}
+#endif
+}
+
+void ServerClient::disconnect()
+{
+#ifndef _WIN32
+	std::lock_guard<std::mutex> guard(lock);
+	if (fd >= 0) {
+		shutdown(fd, SHUT_RDWR);
+	}
+#endif
+}
+
+void ServerClient::send(const std::string& line)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if (fd < 0) {
+		std::cout << line << std::endl;
+		return;
+	}
+#ifndef _WIN32
+	// a client that went away only loses its replies
+	std::string data = line + "\n";
+	for (size_t sent = 0; sent < data.size();) {
+		ssize_t n = write(fd, data.data() + sent, data.size() - sent);
+		if (n <= 0) {
+			return;
+		}
+		sent += n;
+	}
+#endif
+}
+
+// RenderServer methods
+RenderServer::RenderServer(size_t cacheBytes, int workers) : cache(cacheBytes, workers), threads(workers)
+{
+}
+
+bool RenderServer::Later::operator()(const std::shared_ptr<RenderJob>& a, const std::shared_ptr<RenderJob>& b) const
+{
+	if (a->priority != b->priority) {
+		return a->priority < b->priority;
+	}
+	return a->order > b->order;
+}
+
+void RenderServer::start()
+{
+	worker = std::thread(&RenderServer::run, this);
+}
+
+void RenderServer::finish()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_one();
+	if (worker.joinable()) {
+		worker.join();
+	}
+}
+
+void RenderServer::serveStdin()
+{
+	start();
+	auto client = std::make_shared<ServerClient>(-1);
+	std::string line;
+	while (getline(std::cin, line) && handle(line, client)) {
+	}
+	finish();
+}
+
+bool RenderServer::handle(const std::string& line, std::shared_ptr<ServerClient> client)
+{
+	std::stringstream s(line);
+	std::string cmd;
+	s >> cmd;
+	if (cmd.empty() || cmd[0] == '#') {
+		return true;
+	}
+	else if (cmd == "render") {
+		auto job = std::make_shared<RenderJob>();
+		job->client = client;
+		s >> job->sceneFile;
+		std::string arg;
+		while (s >> arg) {
+			size_t eq = arg.find('=');
+			std::string name = arg.substr(0, eq);
+			std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+			try {
+				if (name == "priority") {
+					job->priority = std::stoi(value);
+				}
+				else if (name == "spp") {
+					job->options.samplesPerPixel = std::stoi(value);
+				}
+				else if (name == "seed") {
+					job->options.seed = (unsigned)std::stoul(value);
+				}
+				else if (name == "threads") {
+					job->options.threads = std::stoi(value);
+				}
+				else if (name == "integrator") {
+					job->options.integrator = value;
+				}
+				else if (name == "output") {
+					job->output = value;
+				}
+				else if (name == "region") {
+					char comma;
+					std::stringstream r(value);
+					r >> job->options.regionX >> comma >> job->options.regionY >> comma >> job->options.regionWidth >> comma >> job->options.regionHeight;
+				}
+				else {
+					client->send("{\"status\":\"error\",\"message\":" + quote("unknown option " + name) + "}");
+					return true;
+				}
+			}
+			catch (const std::exception&) {
+				client->send("{\"status\":\"error\",\"message\":" + quote("bad value for " + name) + "}");
+				return true;
+			}
+		}
+		if (job->sceneFile.empty()) {
+			client->send("{\"status\":\"error\",\"message\":\"render needs a scene file\"}");
+			return true;
+		}
+		int waiting;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			// the worker is finishing the queue and would never pick it up
+			if (stopping) {
+				client->send("{\"status\":\"error\",\"message\":\"server is shutting down\"}");
+				return true;
+			}
+			job->id = nextId++;
+			job->order = submitted++;
+			waiting = queue.size();
+			queue.push(job);
+			jobs[job->id] = job;
+		}
+		wake.notify_one();
+		client->send("{\"id\":" + std::to_string(job->id) + ",\"status\":\"queued\",\"waiting\":" + std::to_string(waiting) + "}");
+	}
+	else if (cmd == "cancel") {
+		int id = -1;
+		s >> id;
+		std::lock_guard<std::mutex> guard(lock);
+		auto found = jobs.find(id);
+		if (found == jobs.end()) {
+			client->send("{\"id\":" + std::to_string(id) + ",\"status\":\"error\",\"message\":\"no such job\"}");
+		}
+		else {
+			// queued jobs are dropped when they come up, a running one stops after its tiles in flight;
+			// the job's own client hears "cancelled" once it has
+			found->second->cancelled = true;
+			client->send("{\"id\":" + std::to_string(id) + ",\"status\":\"cancelling\"}");
+		}
+	}
+	else if (cmd == "status") {
+		std::stringstream out;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			out << "{\"status\":\"ok\",\"jobs\":" << jobs.size();
+		}
+		out << "," << cache.summary() << "}";
+		client->send(out.str());
+	}
+	else if (cmd == "quit") {
+		return false;
+	}
+	else {
+		client->send("{\"status\":\"error\",\"message\":" + quote("unknown command " + cmd) + "}");
+	}
+	return true;
+}
+
+void RenderServer::run()
+{
+	while (true) {
+		std::shared_ptr<RenderJob> job;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			wake.wait(guard, [this] { return stopping || !queue.empty(); });
+			if (queue.empty()) {
+				return;
+			}
+			job = queue.top();
+			queue.pop();
+		}
+		if (job->cancelled) {
+			job->client->send("{\"id\":" + std::to_string(job->id) + ",\"status\":\"cancelled\"}");
+		}
+		else {
+			execute(*job);
+		}
+		std::lock_guard<std::mutex> guard(lock);
+		jobs.erase(job->id);
+	}
+}
+
+void RenderServer::execute(RenderJob& job)
+{
+	std::string id = std::to_string(job.id);
+	auto begin = std::chrono::steady_clock::now();
+	bool cached;
+	std::shared_ptr<const Scene> scene = cache.get(job.sceneFile, cached);
+	if (scene == nullptr) {
+		job.client->send("{\"id\":" + id + ",\"status\":\"error\",\"message\":" + quote("cannot open " + job.sceneFile) + "}");
+		return;
+	}
+	double load = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	std::stringstream started;
+	started << "{\"id\":" << id << ",\"status\":\"started\",\"cached\":" << (cached ? "true" : "false") << ",\"load\":" << load << "}";
+	job.client->send(started.str());
+
+	// the copy shares primitives and BVH with the cached scene, which nothing modifies
+	Renderer renderer(*scene);
+	if (job.options.threads == 0) {
+		job.options.threads = scene->threads > 0 ? scene->threads : threads;
+	}
+	PathTracer& pt = renderer.tracer();
+	pt.regionX = job.options.regionX;
+	pt.regionY = job.options.regionY;
+	pt.regionWidth = job.options.regionWidth;
+	pt.regionHeight = job.options.regionHeight;
+	int x0, y0, x1, y1;
+	pt.clipRegion(x0, y0, x1, y1);
+	std::vector<float> buffer((x1 - x0) * (y1 - y0) * 3);
+	// progress goes out in tenths
+	int reported = 0;
+	RenderStats stats = renderer.render(job.options, buffer.data(), [&](double done) {
+		if ((int)(done * 10) > reported) {
+			reported = (int)(done * 10);
+			std::stringstream progress;
+			progress << "{\"id\":" << id << ",\"status\":\"progress\",\"done\":" << reported / 10.0 << "}";
+			job.client->send(progress.str());
+		}
+		return !job.cancelled;
+	});
+	if (stats.cancelled) {
+		job.client->send("{\"id\":" + id + ",\"status\":\"cancelled\"}");
+		return;
+	}
+
+	// canvas of the region from the resolved buffer, back in canvas channel order
+	int width = x1 - x0;
+	int height = y1 - y0;
+	auto canvas = new unsigned char[width * height * 3];
+	for (int p = 0; p < width * height; p++) {
+		Eigen::Array3d color(buffer[p * 3], buffer[p * 3 + 1], buffer[p * 3 + 2]);
+		reorder_color(color);
+		Eigen::Vector3d shade = color;
+		NormalizeColor(shade);
+		std::copy_n(shade.data(), 3, canvas + p * 3);
+	}
+	std::string output = job.output.empty() ? scene->outname : job.output;
+	bool saved = saveImage(canvas, width, height, output);
+	delete[] canvas;
+
+	std::stringstream done;
+	done << "{\"id\":" << id << ",\"status\":" << (saved ? "\"done\"" : "\"error\"") << ",\"output\":" << quote(output)
+		<< ",\"width\":" << width << ",\"height\":" << height << ",\"passes\":" << stats.passes << ",\"samples\":" << stats.samples
+		<< ",\"seconds\":" << std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count() << "}";
+	job.client->send(done.str());
+}
+
+#ifdef _WIN32
+bool RenderServer::serveSocket(const std::string& path)
+{
+	std::cerr << "Unix sockets are not supported on this platform, use the stdin server" << std::endl;
+	return false;
+}
+
+void RenderServer::serveConnection(int fd, std::shared_ptr<ServerClient> client, Connection* connection)
+{
+}
+
+void RenderServer::readConnection(int fd, std::shared_ptr<ServerClient> client)
+{
+}
+
+void RenderServer::joinConnections(bool all)
+{
+}
+#else
+bool RenderServer::serveSocket(const std::string& path)
+{
+	sockaddr_un address{};
+	if (path.size() >= sizeof(address.sun_path)) {
+		std::cerr << "Socket path too long: " << path << std::endl;
+		return false;
+	}
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	listenerFd = listener;
+	if (listener < 0) {
+		std::cerr << "Cannot create socket" << std::endl;
+		return false;
+	}
+	address.sun_family = AF_UNIX;
+	std::copy(path.begin(), path.end(), address.sun_path);
+	unlink(path.c_str());
+	if (bind(listener, (sockaddr*)&address, sizeof(address)) < 0 || listen(listener, 16) < 0) {
+		std::cerr << "Cannot listen on " << path << std::endl;
+		close(listener);
+		return false;
+	}
+	// writes to closed connections fail instead of ending the server
+	signal(SIGPIPE, SIG_IGN);
+	start();
+	std::cerr << "Listening on " << path << std::endl;
+	int lastError = 0;
+	while (true) {
+		int fd = accept(listener, nullptr, nullptr);
+		joinConnections(false);
+		std::unique_lock<std::mutex> guard(lock);
+		if (stopping) {
+			if (fd >= 0) {
+				close(fd);
+			}
+			break;
+		}
+		if (fd < 0) {
+			int error = errno;
+			if (error == EINTR || error == ECONNABORTED) {
+				continue;
+			}
+			if (error != lastError) {
+				std::cerr << "accept: " << std::strerror(error) << std::endl;
+				lastError = error;
+			}
+			// out of descriptors, say; retried once connections had time to close
+			guard.unlock();
+			std::this_thread::sleep_for(std::chrono::milliseconds(ACCEPT_RETRY_MS));
+			continue;
+		}
+		lastError = 0;
+		// the client closes the descriptor once its last job has replied
+		auto client = std::make_shared<ServerClient>(fd);
+		connections.emplace_back();
+		Connection& connection = connections.back();
+		connection.client = client;
+		connection.thread = std::thread(&RenderServer::serveConnection, this, fd, client, &connection);
+	}
+	close(listener);
+	unlink(path.c_str());
+	finish();
+	joinConnections(true);
+	return true;
+}
+
+void RenderServer::joinConnections(bool all)
+{
+	std::list<Connection> finished;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		for (auto c = connections.begin(); c != connections.end();) {
+			if (all && !c->done) {
+				if (auto client = c->client.lock()) {
+					client->disconnect();
+				}
+			}
+			auto next = std::next(c);
+			if (all || c->done) {
+				finished.splice(finished.end(), connections, c);
+			}
+			c = next;
+		}
+	}
+	for (Connection& c : finished) {
+		c.thread.join();
+	}
+}
+
+void RenderServer::serveConnection(int fd, std::shared_ptr<ServerClient> client, Connection* connection)
+{
+	readConnection(fd, client);
+	client = nullptr;
+	std::lock_guard<std::mutex> guard(lock);
+	connection->done = true;
+}
+
+void RenderServer::readConnection(int fd, std::shared_ptr<ServerClient> client)
+{
+	std::string pending;
+	char chunk[4096];
+	ssize_t n;
+	while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+		pending.append(chunk, n);
+		size_t end;
+		while ((end = pending.find('\n')) != std::string::npos) {
+			std::string line = pending.substr(0, end);
+			pending.erase(0, end + 1);
+			if (!line.empty() && line.back() == '\r') {
+				line.pop_back();
+			}
+			if (line == "shutdown") {
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					stopping = true;
+				}
+				wake.notify_one();
+				// wakes the accept loop so it sees the flag
+				int waker = socket(AF_UNIX, SOCK_STREAM, 0);
+				sockaddr_un address{};
+				socklen_t length = sizeof(address);
+				getsockname(listenerFd, (sockaddr*)&address, &length);
+				connect(waker, (sockaddr*)&address, length);
+				close(waker);
+				return;
+			}
+			if (!handle(line, client)) {
+				shutdown(fd, SHUT_RD);
+				return;
+			}
+		}
+	}
+}
+#endif
@@ -0,0 +1,123 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include "renderer.h"
+
+// Parsed scenes with their BVH, keyed by a hash of the scene file contents and
+// evicted least recently used first once the memory budget is exceeded.
+class SceneCache {
+public:
+	// scenes that set no threads are built on at most threads workers, 0 for all cores
+	SceneCache(size_t budgetBytes, int threads);
+	// scene for the file as it is now, parsed and built on a miss; null if unreadable
+	std::shared_ptr<const Scene> get(const std::string& path, bool& cached);
+	// entries, bytes, budget, hits and misses as JSON fields
+	std::string summary();
+
+private:
+	size_t bytes = 0;
+	size_t budget;
+	int threads;
+	int hits = 0;
+	int misses = 0;
+	struct Entry {
+		std::string key;
+		std::shared_ptr<const Scene> scene;
+		size_t bytes;
+	};
+	// most recently used first
+	std::list<Entry> lru;
+	std::unordered_map<std::string, std::list<Entry>::iterator> index;
+	std::mutex lock;
+};
+
+// one connection, or stdin/stdout; replies are single line JSON objects
+class ServerClient {
+public:
+	// -1 for stdout
+	ServerClient(int fd);
+	~ServerClient();
+	void send(const std::string& line);
+	// ends the connection in both directions, a blocked read returns; the descriptor stays open until destruction
+	void disconnect();
+
+private:
+	int fd;
+	std::mutex lock;
+};
+
+class RenderJob {
+public:
+	int id = 0;
+	int priority = 0;
+	// submission order, breaks priority ties
+	long long order = 0;
+	std::string sceneFile;
+	// empty for the scene's own output
+	std::string output;
+	RenderOptions options;
+	std::shared_ptr<ServerClient> client;
+	std::atomic<bool> cancelled = false;
+};
+
+// Long running renderer: jobs come in as text lines, either on stdin or on a Unix
+// socket, and run by priority one at a time over all worker threads; a running job
+// is not preempted. Replies stream back as JSON lines with progress in tenths, the
+// image itself is written to the output file and its path sent in the final reply.
+//   render <scene> [priority=n] [spp=n] [seed=n] [threads=n] [integrator=name] [region=x,y,w,h] [output=file]
+//   cancel <id>   acknowledged with "cancelling", the job's client gets "cancelled"
+//   status
+//   quit          ends the session (stdin: finishes the queue and exits)
+//   shutdown      socket only, finishes the queue and stops the server
+class RenderServer {
+public:
+	// threads is the default for jobs whose scene does not set it, 0 for all cores
+	RenderServer(size_t cacheBytes, int threads);
+	// serves stdin until quit or end of input, then finishes the queued jobs
+	void serveStdin();
+	// serves connections on a Unix socket until a client sends shutdown
+	bool serveSocket(const std::string& path);
+
+private:
+	SceneCache cache;
+	int threads;
+	struct Later {
+		bool operator()(const std::shared_ptr<RenderJob>& a, const std::shared_ptr<RenderJob>& b) const;
+	};
+	std::priority_queue<std::shared_ptr<RenderJob>, std::vector<std::shared_ptr<RenderJob>>, Later> queue;
+	// queued and running jobs by id, for cancel
+	std::map<int, std::shared_ptr<RenderJob>> jobs;
+	int nextId = 1;
+	long long submitted = 0;
+	bool stopping = false;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::thread worker;
+	int listenerFd = -1;
+	// socket connections, joined when finished or when the server stops
+	struct Connection {
+		std::thread thread;
+		std::weak_ptr<ServerClient> client;
+		bool done = false;
+	};
+	std::list<Connection> connections;
+
+	void start();
+	void finish();
+	// false once the client asked to leave
+	bool handle(const std::string& line, std::shared_ptr<ServerClient> client);
+	void run();
+	void execute(RenderJob& job);
+	void serveConnection(int fd, std::shared_ptr<ServerClient> client, Connection* connection);
+	void readConnection(int fd, std::shared_ptr<ServerClient> client);
+	// joins finished connection threads, or all of them after disconnecting their clients
+	void joinConnections(bool all);
+};
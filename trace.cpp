@@ -0,0 +1,136 @@
+#include "trace.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+struct TraceEvent {
+	const char* name;
+	const char* argName;
+	long long arg;
+	// nanoseconds since startTrace
+	long long begin;
+	long long end;
+};
+
+struct ThreadTrace {
+	int id;
+	std::string name;
+	std::vector<TraceEvent> ring;
+	// events recorded so far, the ring holds the last ring.size() of them
+	size_t recorded = 0;
+};
+
+std::atomic<bool> enabled = false;
+size_t ringSize = 0;
+std::chrono::steady_clock::time_point origin;
+std::mutex registryLock;
+std::vector<std::unique_ptr<ThreadTrace>> registry;
+thread_local char threadName[32] = "";
+
+long long now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+}
+
+// buffers are owned by the registry, events of finished threads stay until written
+ThreadTrace& localTrace()
+{
+	thread_local ThreadTrace* trace = nullptr;
+	if (trace == nullptr) {
+		std::lock_guard<std::mutex> guard(registryLock);
+		registry.push_back(std::make_unique<ThreadTrace>());
+		trace = registry.back().get();
+		trace->id = registry.size();
+		trace->name = threadName[0] != 0 ? threadName : "thread " + std::to_string(trace->id);
+		trace->ring.resize(ringSize);
+	}
+	return *trace;
+}
+
+void writeEscaped(std::ofstream& out, const std::string& s)
+{
+	for (char c : s) {
+		if (c == '"' || c == '\\') {
+			out << '\\';
+		}
+		out << c;
+	}
+}
+
+}
+
+void startTrace(size_t eventsPerThread)
+{
+	ringSize = std::max(eventsPerThread, (size_t)1);
+	origin = std::chrono::steady_clock::now();
+	enabled = true;
+}
+
+bool tracing()
+{
+	return enabled.load(std::memory_order_relaxed);
+}
+
+void traceThreadName(const char* name)
+{
+	std::snprintf(threadName, sizeof(threadName), "%s", name);
+}
+
+bool writeTrace(const std::string& path)
+{
+	std::ofstream out(path);
+	if (!out.is_open()) {
+		return false;
+	}
+	std::lock_guard<std::mutex> guard(registryLock);
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+	bool first = true;
+	char timing[64];
+	for (const auto& t : registry) {
+		out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << t->id << ",\"args\":{\"name\":\"";
+		writeEscaped(out, t->name);
+		out << "\"}}";
+		first = false;
+		size_t size = t->ring.size();
+		size_t start = t->recorded > size ? t->recorded - size : 0;
+		for (size_t i = start; i < t->recorded; i++) {
+			const TraceEvent& e = t->ring[i % size];
+			// complete events, timestamps in microseconds
+			std::snprintf(timing, sizeof(timing), "\"ts\":%.3f,\"dur\":%.3f", e.begin / 1000.0, (e.end - e.begin) / 1000.0);
+			out << ",\n{\"name\":\"";
+			writeEscaped(out, e.name);
+			out << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << t->id << "," << timing;
+			if (e.argName != nullptr) {
+				out << ",\"args\":{\"";
+				writeEscaped(out, e.argName);
+				out << "\":" << e.arg << "}";
+			}
+			out << "}";
+		}
+	}
+	out << "\n]}\n";
+	return out.good();
+}
+
+TraceScope::TraceScope(const char* n, const char* an, long long a) : name(n), argName(an), arg(a), begin(-1)
+{
+	if (name != nullptr && tracing()) {
+		begin = now();
+	}
+}
+
+TraceScope::~TraceScope()
+{
+	if (begin < 0) {
+		return;
+	}
+	ThreadTrace& t = localTrace();
+	t.ring[t.recorded++ % t.ring.size()] = TraceEvent{ name, argName, arg, begin, now() };
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+// Opt-in timeline of scoped events on every thread, written as Chrome
+// trace-event JSON for chrome://tracing or Perfetto. Each thread records into
+// a ring buffer of its own, so the oldest events of a thread are dropped once
+// it fills up. While tracing is off a scope costs one flag check.
+void startTrace(size_t eventsPerThread = 1 << 16);
+bool tracing();
+// label of the calling thread in the timeline, unnamed threads are numbered
+void traceThreadName(const char* name);
+// to be called while no traced work is running
+bool writeTrace(const std::string& path);
+
+class TraceScope {
+public:
+	// name and argName are kept as pointers, string literals in practice; a null
+	// name records nothing, for scopes only worth tracing in some calls
+	TraceScope(const char* name, const char* argName = nullptr, long long arg = 0);
+	~TraceScope();
+
+private:
+	const char* name;
+	const char* argName;
+	long long arg;
+	// -1 while tracing is off
+	long long begin;
+};
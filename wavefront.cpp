@@ -0,0 +1,369 @@
+#include "wavefront.h"
+#include <algorithm>
+#include "pathtracer.h"
+#include "counters.h"
+#include "parallel.h"
+#include "trace.h"
+
+// queue entries handled by one task of a stage
+constexpr int STAGE_CHUNK = 1024;
+
+// RayQueue methods
+void RayQueue::clear()
+{
+	for (auto v : { &ox, &oy, &oz, &dx, &dy, &dz, &r, &g, &b, &minT, &maxT }) {
+		v->clear();
+	}
+	pixel.clear();
+	bounce.clear();
+}
+
+void RayQueue::push(const Ray& ray, const Eigen::Array3d& weight, int p, int bn, double tMin, double tMax)
+{
+	ox.push_back(ray.p0[0]);
+	oy.push_back(ray.p0[1]);
+	oz.push_back(ray.p0[2]);
+	dx.push_back(ray.pt[0]);
+	dy.push_back(ray.pt[1]);
+	dz.push_back(ray.pt[2]);
+	r.push_back(weight[0]);
+	g.push_back(weight[1]);
+	b.push_back(weight[2]);
+	pixel.push_back(p);
+	bounce.push_back(bn);
+	minT.push_back(tMin);
+	maxT.push_back(tMax);
+}
+
+void RayQueue::append(const RayQueue& other)
+{
+	auto cat = [](auto& a, const auto& o) { a.insert(a.end(), o.begin(), o.end()); };
+	cat(ox, other.ox);
+	cat(oy, other.oy);
+	cat(oz, other.oz);
+	cat(dx, other.dx);
+	cat(dy, other.dy);
+	cat(dz, other.dz);
+	cat(r, other.r);
+	cat(g, other.g);
+	cat(b, other.b);
+	cat(pixel, other.pixel);
+	cat(bounce, other.bounce);
+	cat(minT, other.minT);
+	cat(maxT, other.maxT);
+}
+
+Ray RayQueue::ray(int i) const
+{
+	return Ray(Eigen::Vector3d(ox[i], oy[i], oz[i]), Eigen::Vector3d(dx[i], dy[i], dz[i]));
+}
+
+Eigen::Array3d RayQueue::weight(int i) const
+{
+	return Eigen::Array3d(r[i], g[i], b[i]);
+}
+
+void RayQueue::permute(const std::vector<int>& order)
+{
+	auto gather = [&](auto& a) {
+		auto copy = a;
+		for (int i = 0; i < (int)order.size(); i++) {
+			a[i] = copy[order[i]];
+		}
+	};
+	gather(ox);
+	gather(oy);
+	gather(oz);
+	gather(dx);
+	gather(dy);
+	gather(dz);
+	gather(r);
+	gather(g);
+	gather(b);
+	gather(pixel);
+	gather(bounce);
+	gather(minT);
+	gather(maxT);
+}
+
+// Wavefront methods
+Wavefront::Wavefront(PathTracer& tracer) : pt(tracer)
+{
+}
+
+void Wavefront::seedChunk(int chunk, int depth)
+{
+	pt.random.seed((unsigned)pt.seed ^ (wavePixels[0] * 0x9E3779B9u + wavePass * 0x85EBCA6Bu + depth * 0xC2B2AE35u + chunk * 0x27D4EB2Fu));
+}
+
+void Wavefront::renderWave(const std::vector<int>& pixels, int pass)
+{
+	if (pixels.empty()) {
+		return;
+	}
+	TraceScope scope("wave", "pixels", pixels.size());
+	wavePixels = pixels;
+	wavePass = pass;
+	recordFeatures = pass == 0 && !pt.gbuffer.depth.empty();
+	recordHeat = !pt.heat.empty() && pt.scene.heatmap != "time";
+	direct.assign(pixels.size(), Eigen::Array3d(0, 0, 0));
+	reflected.assign(pixels.size(), Eigen::Array3d(0, 0, 0));
+
+	generate();
+	for (int depth = 0; paths.size() > 0; depth++) {
+		sortByDirection();
+		extend(depth);
+		shade(depth);
+		connect();
+		accumulate();
+		std::swap(paths, next);
+	}
+
+	for (int i = 0; i < (int)pixels.size(); i++) {
+		int p = pixels[i];
+		Eigen::Array3d shade = direct[i] + reflected[i];
+		pt.accum[p] += shade;
+		double lum = shade.sum() / 3;
+		pt.lumSq[p] += lum * lum;
+		pt.sampleCount[p]++;
+		if (recordFeatures) {
+			pt.gbuffer.setContributions(p, direct[i], reflected[i]);
+		}
+	}
+}
+
+// camera rays, jittered after the first pass
+void Wavefront::generate()
+{
+	paths.clear();
+	std::uniform_real_distribution<double> dis(0, 1.0);
+	seedChunk(0, -1);
+	int width = pt.scene.width;
+	for (int i = 0; i < (int)wavePixels.size(); i++) {
+		int x = wavePixels[i] % width;
+		int y = wavePixels[i] / width;
+		Ray ray = wavePass == 0 ? pt.camRay(x, y) : pt.camRay(x + dis(pt.random), y + dis(pt.random));
+		paths.push(ray, Eigen::Array3d(1, 1, 1), i, 0);
+	}
+}
+
+// groups rays by direction octant so that neighbouring rays traverse similar nodes
+void Wavefront::sortByDirection()
+{
+	TraceScope scope("sort", "rays", paths.size());
+	std::vector<int> count(9, 0);
+	auto octant = [&](int i) { return (paths.dx[i] < 0) | (paths.dy[i] < 0) << 1 | (paths.dz[i] < 0) << 2; };
+	for (int i = 0; i < paths.size(); i++) {
+		count[octant(i) + 1]++;
+	}
+	for (int o = 0; o < 8; o++) {
+		count[o + 1] += count[o];
+	}
+	std::vector<int> order(paths.size());
+	for (int i = 0; i < paths.size(); i++) {
+		order[count[octant(i)]++] = i;
+	}
+	paths.permute(order);
+}
+
+void Wavefront::extend(int depth)
+{
+	hits.assign(paths.size(), Intersection());
+	int chunks = (paths.size() + STAGE_CHUNK - 1) / STAGE_CHUNK;
+	parallelFor(0, chunks, [&](int chunk) {
+		TraceScope scope("extend", "chunk", chunk);
+		CounterScope counting(depth == 0 ? PhasePrimary : PhaseShading, std::min(STAGE_CHUNK, (int)paths.size() - chunk * STAGE_CHUNK));
+		for (int i = chunk * STAGE_CHUNK; i < std::min((chunk + 1) * STAGE_CHUNK, paths.size()); i++) {
+			hits[i] = pt.intersect(paths.ray(i));
+			// a pixel has a single path, so these writes do not collide
+			if (recordHeat) {
+				pt.heat[wavePixels[paths.pixel[i]]] += pt.scene.heatmap == "tests" ? hits[i].tests : hits[i].nodes;
+			}
+		}
+		pt.flushRays();
+	}, pt.threads);
+}
+
+// shades hits in material order; each chunk queues its continuation and shadow rays
+// locally, the queues are joined in chunk order so results do not depend on threads
+void Wavefront::shade(int depth)
+{
+	Scene& scene = pt.scene;
+	std::vector<int> order(paths.size());
+	for (int i = 0; i < (int)order.size(); i++) {
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+		int ma = hits[a].prim != nullptr ? hits[a].prim->matId : -1;
+		int mb = hits[b].prim != nullptr ? hits[b].prim->matId : -1;
+		return ma < mb;
+	});
+
+	int chunks = (paths.size() + STAGE_CHUNK - 1) / STAGE_CHUNK;
+	std::vector<RayQueue> chunkNext(chunks), chunkShadows(chunks);
+	// new irradiance records are staged per chunk and join the cache in chunk order
+	bool staged = pt.irradianceCache != nullptr;
+	if (staged) {
+		pt.openCacheStages(chunks);
+	}
+	parallelFor(0, chunks, [&](int chunk) {
+		TraceScope scope("shade", "chunk", chunk);
+		PathTracer::cacheStage = staged ? pt.cacheStages[chunk].get() : nullptr;
+		CounterScope counting(PhaseShading, std::min(STAGE_CHUNK, (int)paths.size() - chunk * STAGE_CHUNK));
+		seedChunk(chunk, depth);
+		RayQueue& outNext = chunkNext[chunk];
+		RayQueue& outShadows = chunkShadows[chunk];
+		for (int k = chunk * STAGE_CHUNK; k < std::min((chunk + 1) * STAGE_CHUNK, paths.size()); k++) {
+			int i = order[k];
+			Ray ray = paths.ray(i);
+			Intersection& hit = hits[i];
+			int pixel = paths.pixel[i];
+			int bounce = paths.bounce[i];
+			Eigen::Array3d weight = paths.weight(i);
+			Eigen::Array3d& out = bounce == 0 ? direct[pixel] : reflected[pixel];
+			// eye of this segment: the camera, or the previous hit for reflections
+			Eigen::Vector3d eye = ray.p0;
+
+			if (bounce == 0) {
+				// area lights seen directly by the camera
+				double lightDepth = -1;
+				QuadLight* light = nullptr;
+				for (const auto& l : scene.polyLights) {
+					double lt = l->intersect(ray);
+					if (lt > 0 && (lt < lightDepth || lightDepth < 0)) {
+						lightDepth = lt;
+						light = l.get();
+					}
+				}
+				if (light != nullptr && (lightDepth < hit.t || hit.t == -1)) {
+					out += light->c;
+					if (recordFeatures) {
+						pt.gbuffer.setFeatures(wavePixels[pixel], Eigen::Array3d(1, 1, 1), light->n, lightDepth);
+					}
+					continue;
+				}
+			}
+			if (hit.prim == nullptr) {
+				continue;
+			}
+			hit.complete(ray, scene.materials);
+			if (bounce == 0 && recordFeatures) {
+				pt.gbuffer.setFeatures(wavePixels[pixel], hit.mat->diffuse, hit.normal, hit.t);
+				pt.gbuffer.setIds(wavePixels[pixel], hit.prim->id, hit.material);
+			}
+
+			if (scene.integrator == "raytracer") {
+				out += weight * (hit.mat->ambient + hit.mat->emission);
+				auto shadowRay = [&](const Light& light, const Eigen::Array3d& unshadowed) {
+					double dist = std::numeric_limits<double>::infinity();
+					Eigen::Vector3d dir = light.v0;
+					if (light.kind == "point") {
+						dist = (light.v0 - hit.point).norm();
+						dir = (light.v0 - hit.point).normalized();
+					}
+					Eigen::Array3d contribution = weight * unshadowed;
+					if (!contribution.isZero()) {
+						outShadows.push(Ray(hit.point + eps * dir, dir), contribution, pixel, bounce, 0, dist);
+					}
+				};
+				if (!pt.lightTree.clusters.empty()) {
+					ArenaScope scope(Arena::local());
+					CutLight* cut = Arena::local().allocate<CutLight>(scene.lightcutMax);
+					int size = pt.lightcut(hit, eye, cut);
+					for (int c = 0; c < size; c++) {
+						shadowRay(*cut[c].light, cut[c].contribution);
+					}
+				}
+				else {
+					for (const auto& light : scene.simpleLights) {
+						shadowRay(*light, pt.unshadowed(hit, *light, light->c, eye));
+					}
+				}
+				// same depth limit as raytracer(), which starts at maxdepth and reflects while above 1
+				if (scene.maxdepth - bounce > 1 && hit.mat->specualr.sum() > eps) {
+					outNext.push(pt.reflRay(hit, eye), weight * hit.mat->specualr, pixel, bounce + 1);
+				}
+			}
+			else if (scene.integrator == "direct" && scene.restirCandidates > 0 && !pt.lightCdf.empty()) {
+				// resampled without reuse, the stages see no neighbouring pixels
+				Reservoir r = pt.sampleLights(hit, eye);
+				Eigen::Array3d f;
+				if (r.light >= 0 && r.W > 0 && pt.lightTarget(hit, eye, r.light, r.r1, r.r2, &f) > 0) {
+					const QuadLight& li = *scene.polyLights[r.light];
+					Eigen::Vector3d p = li.va + r.r1 * li.e1 + r.r2 * li.e2;
+					Eigen::Vector3d dir = (p - hit.point).normalized();
+					outShadows.push(Ray(hit.point + eps * dir, dir), weight * f * r.W, pixel, bounce, eps, (p - hit.point).norm());
+				}
+				if (scene.indirect > 0) {
+					out += weight * pt.indirectDiffuse(hit);
+				}
+			}
+			else if (scene.integrator == "direct") {
+				for (const std::shared_ptr<QuadLight>& li : scene.polyLights) {
+					ArenaScope scope(Arena::local());
+					int count = li->sampleCount(scene.sample, scene.stratify);
+					Eigen::Vector3d* lightSamples = Arena::local().allocate<Eigen::Vector3d>(count);
+					li->samples(scene.sample, scene.stratify, pt.random, lightSamples);
+					for (int s = 0; s < count; s++) {
+						const Eigen::Vector3d& p = lightSamples[s];
+						Eigen::Vector3d dir = (p - hit.point).normalized();
+						if (li->n.dot(dir) < 0) {
+							continue;
+						}
+						Eigen::Array3d contribution = weight * pt.phoneBRDF(hit, eye, p) * pt.geometry(hit, li, p) * li->c * li->area / count;
+						outShadows.push(Ray(hit.point + eps * dir, dir), contribution, pixel, bounce, eps, (p - hit.point).norm());
+					}
+				}
+				if (scene.indirect > 0) {
+					out += weight * pt.indirectDiffuse(hit);
+				}
+			}
+			else if (scene.integrator == "analyticdirect") {
+				out += weight * pt.analytic(hit);
+			}
+		}
+		PathTracer::cacheStage = nullptr;
+		pt.flushRays();
+	}, pt.threads);
+	if (staged) {
+		pt.commitCacheStages(chunks);
+	}
+
+	next.clear();
+	shadows.clear();
+	for (int c = 0; c < chunks; c++) {
+		next.append(chunkNext[c]);
+		shadows.append(chunkShadows[c]);
+	}
+}
+
+void Wavefront::connect()
+{
+	occluded.assign(shadows.size(), 0);
+	shadowCost.assign(shadows.size(), 0);
+	int chunks = (shadows.size() + STAGE_CHUNK - 1) / STAGE_CHUNK;
+	parallelFor(0, chunks, [&](int chunk) {
+		TraceScope scope("connect", "chunk", chunk);
+		CounterScope counting(PhaseShadow, std::min(STAGE_CHUNK, (int)shadows.size() - chunk * STAGE_CHUNK));
+		for (int i = chunk * STAGE_CHUNK; i < std::min((chunk + 1) * STAGE_CHUNK, shadows.size()); i++) {
+			Intersection hit = pt.intersect(shadows.ray(i));
+			occluded[i] = hit.t > shadows.minT[i] && hit.t < shadows.maxT[i];
+			shadowCost[i] = pt.scene.heatmap == "tests" ? hit.tests : hit.nodes;
+		}
+		pt.flushRays();
+	}, pt.threads);
+}
+
+// shadow rays of one pixel can sit in different chunks, so they are summed serially
+void Wavefront::accumulate()
+{
+	for (int i = 0; i < shadows.size(); i++) {
+		int pixel = shadows.pixel[i];
+		if (!occluded[i]) {
+			(shadows.bounce[i] == 0 ? direct[pixel] : reflected[pixel]) += shadows.weight(i);
+		}
+		if (recordHeat) {
+			pt.heat[wavePixels[pixel]] += shadowCost[i];
+		}
+	}
+}
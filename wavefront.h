@@ -0,0 +1,64 @@
+#pragma once
+#include <vector>
+#include "primitive.h"
+
+class PathTracer;
+
+// rays of one stage in structure-of-arrays form
+class RayQueue {
+public:
+	std::vector<double> ox, oy, oz;
+	std::vector<double> dx, dy, dz;
+	// path throughput, or the full contribution of a shadow ray
+	std::vector<double> r, g, b;
+	// pixel index within the wave and bounce the ray belongs to
+	std::vector<int> pixel;
+	std::vector<int> bounce;
+	// shadow rays are blocked by hits in (minT, maxT)
+	std::vector<double> minT, maxT;
+
+	int size() const { return (int)pixel.size(); }
+	void clear();
+	void push(const Ray& ray, const Eigen::Array3d& weight, int p, int b, double tMin = 0, double tMax = 0);
+	void append(const RayQueue& other);
+	Ray ray(int i) const;
+	Eigen::Array3d weight(int i) const;
+	// reorders all arrays so that entry i becomes entry order[i]
+	void permute(const std::vector<int>& order);
+};
+
+// Breadth-first execution of the integrators. A wave of camera paths goes
+// through generate, extend, shade, connect and accumulate stages, each run
+// over the whole queue across the worker threads: extension rays are grouped
+// by direction octant and hits are shaded in material order.
+class Wavefront {
+public:
+	Wavefront(PathTracer& tracer);
+	// renders the given pixels for one pass into the tracer's accumulation buffers
+	void renderWave(const std::vector<int>& pixels, int pass);
+
+private:
+	PathTracer& pt;
+	RayQueue paths, next, shadows;
+	std::vector<Intersection> hits;
+	std::vector<char> occluded;
+	std::vector<int> shadowCost;
+	// image pixel of each wave pixel
+	std::vector<int> wavePixels;
+	// per wave pixel, split as the direct/reflected layers are
+	std::vector<Eigen::Array3d> direct, reflected;
+	int wavePass = 0;
+	bool recordFeatures = false;
+	// traversal steps or tests, time per pixel has no meaning here
+	bool recordHeat = false;
+
+	void generate();
+	// bounce rays, past depth 0, are counted as shading
+	void extend(int depth);
+	void shade(int depth);
+	void connect();
+	void accumulate();
+	void sortByDirection();
+	// reseeds the calling thread's generator for one chunk of one stage
+	void seedChunk(int chunk, int depth);
+};
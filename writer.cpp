@@ -0,0 +1,150 @@
+#include "writer.h"
+#include <iostream>
+#include <filesystem>
+#include <algorithm>
+#include <FreeImage.h>
+#include "counters.h"
+#include "trace.h"
+
+// output names may point into folders that do not exist yet
+static void createFolders(const std::string& name)
+{
+	std::error_code error;
+	std::filesystem::path parent = std::filesystem::path(name).parent_path();
+	if (!parent.empty()) {
+		std::filesystem::create_directories(parent, error);
+	}
+}
+
+bool saveImage(unsigned char* canvas, int width, int height, std::string name)
+{
+	createFolders(name);
+	TraceScope scope("save png");
+	CounterScope counting(PhaseEncode, 1);
+	FIBITMAP* img;
+	{
+		TraceScope convert("convert");
+		img = FreeImage_ConvertFromRawBits(canvas, width, height, width * 3, 24, 0xFF0000, 0x00FF00, 0x0000FF, true);
+	}
+	bool saved = FreeImage_Save(FIF_PNG, img, name.c_str(), 0);
+	FreeImage_Unload(img);
+	return saved;
+}
+
+unsigned char* loadImage(std::string name, int& width, int& height)
+{
+	FIBITMAP* loaded = FreeImage_Load(FIF_PNG, name.c_str(), 0);
+	if (loaded == nullptr) {
+		return nullptr;
+	}
+	FIBITMAP* img = FreeImage_ConvertTo24Bits(loaded);
+	FreeImage_Unload(loaded);
+	if (img == nullptr) {
+		return nullptr;
+	}
+	width = FreeImage_GetWidth(img);
+	height = FreeImage_GetHeight(img);
+	auto canvas = new unsigned char[width * height * 3];
+	for (int y = 0; y < height; y++) {
+		// FreeImage scanlines run bottom-up, 24 bit pixels are stored BGR like the canvas
+		std::copy_n(FreeImage_GetScanLine(img, height - 1 - y), width * 3, canvas + y * width * 3);
+	}
+	FreeImage_Unload(img);
+	return canvas;
+}
+
+bool saveFloatImage(std::vector<const float*> channels, int width, int height, std::string name)
+{
+	createFolders(name);
+	bool rgb = channels.size() == 3;
+	TraceScope scope("save exr");
+	CounterScope counting(PhaseEncode, 1);
+	FIBITMAP* img = FreeImage_AllocateT(rgb ? FIT_RGBF : FIT_FLOAT, width, height);
+	if (img == nullptr) {
+		return false;
+	}
+	for (int y = 0; y < height; y++) {
+		// FreeImage scanlines run bottom-up
+		BYTE* line = FreeImage_GetScanLine(img, height - 1 - y);
+		for (int x = 0; x < width; x++) {
+			int p = y * width + x;
+			if (rgb) {
+				FIRGBF* px = (FIRGBF*)line + x;
+				px->red = channels[0][p];
+				px->green = channels[1][p];
+				px->blue = channels[2][p];
+			}
+			else {
+				((float*)line)[x] = channels[0][p];
+			}
+		}
+	}
+	bool saved = FreeImage_Save(FIF_EXR, img, name.c_str(), 0);
+	FreeImage_Unload(img);
+	return saved;
+}
+
+std::string suffixName(std::string name, std::string suffix)
+{
+	size_t dot = name.find_last_of('.');
+	if (dot == std::string::npos) {
+		return name + "_" + suffix;
+	}
+	return name.substr(0, dot) + "_" + suffix + name.substr(dot);
+}
+
+FrameWriter::FrameWriter()
+{
+	worker = std::thread(&FrameWriter::run, this);
+}
+
+FrameWriter::~FrameWriter()
+{
+	finish();
+}
+
+void FrameWriter::push(unsigned char* canvas, int width, int height, std::string name)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		jobs.push_back(Job{ canvas, width, height, name });
+	}
+	wake.notify_one();
+}
+
+void FrameWriter::finish()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		done = true;
+	}
+	wake.notify_one();
+	if (worker.joinable()) {
+		worker.join();
+	}
+}
+
+void FrameWriter::run()
+{
+	traceThreadName("writer");
+	while (true) {
+		Job job;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			wake.wait(guard, [this] { return done || !jobs.empty(); });
+			if (jobs.empty()) {
+				return;
+			}
+			job = jobs.front();
+			jobs.pop_front();
+		}
+		if (saveImage(job.canvas, job.width, job.height, job.name)) {
+			std::cout << "Image generated at " << job.name << std::endl;
+		}
+		else {
+			std::cout << "Image generation failed: " << job.name << std::endl;
+			failed++;
+		}
+		delete[] job.canvas;
+	}
+}
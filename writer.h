@@ -0,0 +1,45 @@
+#pragma once
+#include <string>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// writes a BGR canvas as png
+bool saveImage(unsigned char* canvas, int width, int height, std::string name);
+
+// reads a png into a BGR canvas laid out as saveImage expects, null if it cannot be read
+unsigned char* loadImage(std::string name, int& width, int& height);
+
+// writes 1 (grey) or 3 (RGB) planar float channels as an OpenEXR image
+bool saveFloatImage(std::vector<const float*> channels, int width, int height, std::string name);
+
+// output.png -> output_<suffix>.png
+std::string suffixName(std::string name, std::string suffix);
+
+// Encodes and saves canvases on a background thread so the next frame can
+// render meanwhile. Takes ownership of the pushed canvases.
+class FrameWriter {
+public:
+	FrameWriter();
+	~FrameWriter();
+	void push(unsigned char* canvas, int width, int height, std::string name);
+	// writes the remaining images and stops the worker
+	void finish();
+	int failed = 0;
+
+private:
+	struct Job {
+		unsigned char* canvas;
+		int width;
+		int height;
+		std::string name;
+	};
+	std::deque<Job> jobs;
+	std::mutex lock;
+	std::condition_variable wake;
+	bool done = false;
+	std::thread worker;
+	void run();
+};